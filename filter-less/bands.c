@@ -0,0 +1,111 @@
+#include <stdlib.h>  // For malloc() and free()
+#include <string.h>  // For memcpy()
+
+#include "bands.h"
+#include "scratch.h"
+
+// A band of rows of an image, together with the copies of its neighbouring rows
+typedef struct
+{
+    const FILTER *filter;
+    const OPTIONS *options;
+    IMAGE band;
+    HALO halo;
+    int status;  // What the filter returned for this band
+} JOB;
+
+const FILTER *find_filter(char flag)
+{
+    for (const FILTER *f = FILTERS; f->flag != 0; f++)
+    {
+        if (f->flag == flag)
+        {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Copy source row i of an image into a band's halo; the image's own rows get the loads fused into the pass,
+// which rows from the image's halo already had
+static void copy_row(RGBQUAD *copy, const IMAGE *image, const HALO *halo, const OPTIONS *options, int i)
+{
+    memcpy(copy, source_row(image, halo, i), image->width * sizeof(RGBQUAD));
+    if (i >= 0 && i < image->height)
+    {
+        load_row(options, copy, image->width);
+    }
+}
+
+// Filter one band; runs on whichever thread of the pool claims it
+static void run_job(void *arg, int index, int thread)
+{
+    JOB *job = (JOB *) arg + index;
+    job->status = job->filter->apply(&job->band, &job->halo, job->options);
+}
+
+int apply_filter(const FILTER *filter, const OPTIONS *options, IMAGE *image, const HALO *halo, POOL *pool)
+{
+    // Give every thread one band, but never a band without rows
+    int bands = pool_threads(pool);
+    if (bands > image->height)
+    {
+        bands = image->height;
+    }
+
+    int width = image->width;
+    int rows = filter->halo != NULL ? filter->halo(options) : 0;
+    JOB *jobs = malloc(bands * sizeof(JOB));
+    RGBQUAD *copies = rows > 0 ? scratch(SCRATCH_HALOS, (size_t) bands * 2 * rows * width * sizeof(RGBQUAD)) : NULL;
+    if (bands <= 1 || jobs == NULL || (rows > 0 && copies == NULL))
+    {
+        // A single band only needs the halo around the whole image, if any
+        free(jobs);
+        return filter->apply(image, halo, options);
+    }
+
+    // Rows of context that exist around the whole image
+    int top = halo != NULL ? -halo->above : 0;
+    int bottom = image->height + (halo != NULL ? halo->below : 0);
+
+    for (int b = 0; b < bands; b++)
+    {
+        // Spread the rows as evenly as possible over the bands
+        int start = (int) ((long long) image->height * b / bands);
+        int end = (int) ((long long) image->height * (b + 1) / bands);
+
+        JOB *job = &jobs[b];
+        job->filter = filter;
+        job->options = options;
+        job->band = *image;
+        job->band.height = end - start;
+        job->band.data = (BYTE *) image_row(image, start);
+
+        // Copy the unfiltered rows around the band before any thread starts changing them
+        // (rows beyond the edges of the image come from the image's own halo)
+        RGBQUAD *copy = copies + (size_t) b * 2 * rows * width;
+        job->halo.above = start - top < rows ? start - top : rows;
+        job->halo.below = bottom - end < rows ? bottom - end : rows;
+        job->halo.rows = copy;
+        for (int i = start - job->halo.above; i < start; i++, copy += width)
+        {
+            copy_row(copy, image, halo, options, i);
+        }
+        for (int i = end; i < end + job->halo.below; i++, copy += width)
+        {
+            copy_row(copy, image, halo, options, i);
+        }
+    }
+
+    pool_run(pool, bands, run_job, jobs);
+
+    // The image is only complete if every band was filtered
+    int status = 0;
+    for (int b = 0; b < bands; b++)
+    {
+        status |= jobs[b].status;
+    }
+
+    free(jobs);
+    return status;
+}
@@ -0,0 +1,19 @@
+// Applying filters to an image in horizontal bands, one thread per band
+
+#ifndef BANDS_H
+#define BANDS_H
+
+#include "helpers.h"
+#include "pool.h"
+
+// Find the filter selected by a command-line flag, or NULL if there is none
+const FILTER *find_filter(char flag);
+
+// Split an image into bands, give each a copy of its halo, and filter the bands in parallel;
+// the result is identical to filtering the whole image on one thread. The image may itself be a
+// band of a larger picture, with its own halo (whose rows have already had any loads fused into
+// the pass), or halo may be NULL. Returns what the filter returned: 0 on success, or 1 if it ran
+// out of memory
+int apply_filter(const FILTER *filter, const OPTIONS *options, IMAGE *image, const HALO *halo, POOL *pool);
+
+#endif
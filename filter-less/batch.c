@@ -0,0 +1,276 @@
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime(), mkdir(), opendir() and strcasecmp()
+
+#include <dirent.h>    // For listing the input directory
+#include <errno.h>     // For EEXIST
+#include <stdio.h>     // For file operations
+#include <stdlib.h>    // For malloc(), realloc(), qsort() and free()
+#include <string.h>    // For strlen(), strcmp(), strcpy() and memcpy()
+#include <strings.h>   // For strcasecmp()
+#include <sys/stat.h>  // For mkdir()
+#include <time.h>      // For clock_gettime()
+
+#include "batch.h"
+#include "bmpio.h"
+#include "scratch.h"
+#include "stream.h"
+
+// What each thread of the pool keeps from one image to the next, on a cache line of its own
+typedef struct
+{
+    _Alignas(64) BYTE *pixels;  // Buffer the images are read into
+    size_t size;                // Its size
+    size_t bytes;               // Bytes of the files this thread has filtered
+} WORKER;
+
+// Everything the threads share while filtering a batch
+typedef struct
+{
+    const char *indir;
+    const char *outdir;
+    const CHAIN *chain;
+    int rows;        // Rows per strip, or 0 to filter images whole
+    int async;       // Whether to queue each image's writes on an io_uring
+    POOL *serial;    // A pool of one thread, so that each image is filtered on the thread that took it
+    char **names;    // The files to filter, in name order
+    int *codes;      // Exit code for each file (0 for success)
+    WORKER *workers; // One per thread of the pool
+} BATCH;
+
+// Join a directory and a file name into a new string, or NULL if there is no memory
+static char *join(const char *directory, const char *name)
+{
+    size_t length = strlen(directory);
+    char *path = malloc(length + 1 + strlen(name) + 1);
+    if (path != NULL)
+    {
+        memcpy(path, directory, length);
+        path[length] = '/';
+        strcpy(path + length + 1, name);
+    }
+    return path;
+}
+
+// Compare two file names for qsort()
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// List the .bmp files in a directory, in name order, returning how many there are, or -1 if there is no memory
+static int list_images(DIR *dir, char ***names)
+{
+    int count = 0, capacity = 0;
+    *names = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        if (length <= 4 || strcasecmp(entry->d_name + length - 4, ".bmp") != 0)
+        {
+            continue;
+        }
+
+        // Double the list whenever it fills up
+        if (count == capacity)
+        {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            char **grown = realloc(*names, capacity * sizeof(char *));
+            if (grown == NULL)
+            {
+                break;
+            }
+            *names = grown;
+        }
+        (*names)[count] = malloc(length + 1);
+        if ((*names)[count] == NULL)
+        {
+            break;
+        }
+        memcpy((*names)[count++], entry->d_name, length + 1);
+    }
+
+    // Stopping early means memory ran out
+    if (entry != NULL)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            free((*names)[i]);
+        }
+        free(*names);
+        *names = NULL;
+        return -1;
+    }
+
+    qsort(*names, count, sizeof(char *), by_name);
+    return count;
+}
+
+// Filter one image of the batch; runs on whichever thread of the pool takes it
+static void filter_image(void *arg, int index, int thread)
+{
+    BATCH *batch = arg;
+    WORKER *worker = &batch->workers[thread];
+    char *infile = join(batch->indir, batch->names[index]);
+    char *outfile = join(batch->outdir, batch->names[index]);
+    if (infile == NULL || outfile == NULL)
+    {
+        printf("Not enough memory to filter %s.\n", batch->names[index]);
+        batch->codes[index] = 7;
+        free(infile);
+        free(outfile);
+        return;
+    }
+
+    // Open the input and output files, just as for a single image
+    FILE *inptr = fopen(infile, "r");
+    FILE *outptr = inptr != NULL ? fopen(outfile, "w") : NULL;
+    WRITER *writer = outptr != NULL ? writer_open(outptr, batch->async) : NULL;
+    BMPSTATUS status = BMP_OK;
+    if (inptr == NULL)
+    {
+        printf("Could not open %s.\n", infile);
+        batch->codes[index] = 4;
+    }
+    else if (outptr == NULL)
+    {
+        printf("Could not create %s.\n", outfile);
+        batch->codes[index] = 5;
+    }
+    else if (writer == NULL)
+    {
+        status = BMP_NO_MEMORY;
+    }
+    else if (batch->rows > 0 && !batch->chain->orientation.flip && !batch->chain->orientation.transpose)
+    {
+        status = stream_filter(inptr, writer, batch->chain, batch->rows, batch->serial, NULL);
+    }
+    else
+    {
+        // Read the image into this thread's buffer, filter it and write it out
+        BMP bmp;
+        status = bmp_read_into(inptr, &bmp, &worker->pixels, &worker->size);
+        if (status == BMP_OK && apply_chain(batch->chain, &bmp.image, batch->serial) != 0)
+        {
+            status = BMP_NO_MEMORY;
+        }
+        if (status == BMP_OK && bmp_write(writer, &bmp, &batch->chain->orientation) != 0)
+        {
+            status = BMP_NO_MEMORY;
+        }
+    }
+
+    if (status == BMP_UNSUPPORTED)
+    {
+        printf("Unsupported file format: %s.\n", infile);
+        batch->codes[index] = 6;
+    }
+    else if (status == BMP_NO_MEMORY)
+    {
+        printf("Not enough memory to store %s.\n", infile);
+        batch->codes[index] = 7;
+    }
+    else if (batch->codes[index] == 0)
+    {
+        worker->bytes += ftell(inptr);
+    }
+
+    // A write that failed (to a full disk, say) only shows up as the output is closed
+    int unwritten = writer != NULL && writer_close(writer) != 0;
+    if (outptr != NULL && (fclose(outptr) != 0 || unwritten) && batch->codes[index] == 0)
+    {
+        printf("Could not write %s.\n", outfile);
+        batch->codes[index] = 5;
+    }
+    if (inptr != NULL)
+    {
+        fclose(inptr);
+    }
+    free(infile);
+    free(outfile);
+}
+
+int batch_filter(const char *indir, const char *outdir, const CHAIN *chain, int rows, int async, POOL *pool,
+                 BATCHSTATS *stats)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    *stats = (BATCHSTATS) {0};
+
+    DIR *dir = opendir(indir);
+    if (dir == NULL)
+    {
+        printf("Could not open %s.\n", indir);
+        return 4;
+    }
+    if (mkdir(outdir, 0777) != 0 && errno != EEXIST)
+    {
+        closedir(dir);
+        printf("Could not create %s.\n", outdir);
+        return 5;
+    }
+
+    // Each output file is created empty before its input is read, so writing into the input directory would
+    // destroy the images before they were filtered
+    struct stat in, out;
+    if (stat(indir, &in) == 0 && stat(outdir, &out) == 0 && in.st_dev == out.st_dev && in.st_ino == out.st_ino)
+    {
+        closedir(dir);
+        printf("Could not create %s: it is the input directory.\n", outdir);
+        return 5;
+    }
+
+    BATCH batch = {.indir = indir, .outdir = outdir, .chain = chain, .rows = rows, .async = async};
+    int count = list_images(dir, &batch.names);
+    closedir(dir);
+    int threads = pool_threads(pool);
+    batch.serial = pool_create(1);
+    batch.codes = calloc(count > 0 ? count : 1, sizeof(int));
+    batch.workers = aligned_alloc(_Alignof(WORKER), threads * sizeof(WORKER));
+    if (count < 0 || batch.serial == NULL || batch.codes == NULL || batch.workers == NULL)
+    {
+        pool_destroy(batch.serial);
+        free(batch.codes);
+        free(batch.workers);
+        for (int i = 0; i < count; i++)
+        {
+            free(batch.names[i]);
+        }
+        free(batch.names);
+        printf("Not enough memory to filter %s.\n", indir);
+        return 7;
+    }
+    for (int t = 0; t < threads; t++)
+    {
+        batch.workers[t] = (WORKER) {.pixels = NULL, .size = 0, .bytes = 0};
+    }
+
+    pool_run(pool, count, filter_image, &batch);
+
+    // Report the first failure, and add up what the threads did
+    int code = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (batch.codes[i] != 0)
+        {
+            stats->failed++;
+            code = code != 0 ? code : batch.codes[i];
+        }
+        free(batch.names[i]);
+    }
+    stats->images = count - stats->failed;
+    for (int t = 0; t < threads; t++)
+    {
+        stats->bytes += batch.workers[t].bytes;
+        free(batch.workers[t].pixels);
+    }
+
+    pool_destroy(batch.serial);
+    free(batch.codes);
+    free(batch.workers);
+    free(batch.names);
+    scratch_release();
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return code;
+}
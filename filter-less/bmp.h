@@ -1,5 +1,8 @@
 // BMP-related data types based on Microsoft's own
 
+#ifndef BMP_H
+#define BMP_H
+
 #include <stdint.h>
 
 // These data types are essentially aliases for C/C++ primitive data types. 
@@ -54,4 +57,20 @@ typedef struct
     BYTE  rgbtGreen;
     BYTE  rgbtRed;
 } __attribute__((__packed__))
-RGBTRIPLE;
\ No newline at end of file
+RGBTRIPLE;
+
+// The RGBQUAD structure describes a color consisting of relative intensities of
+// red, green, and blue, plus a reserved byte; pixels take this form in memory while
+// they are filtered, so that each starts on a 4-byte boundary and whole pixels fill
+// vector registers. Adapted from http://msdn.microsoft.com/en-us/library/dd162938(VS.85).aspx.
+
+typedef struct
+{
+    BYTE  rgbBlue;
+    BYTE  rgbGreen;
+    BYTE  rgbRed;
+    BYTE  rgbReserved;
+} __attribute__((__aligned__(4)))
+RGBQUAD;
+
+#endif
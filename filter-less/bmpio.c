@@ -0,0 +1,437 @@
+#define _POSIX_C_SOURCE 200809L  // For fileno(), ftello(), fstat() and mmap()
+
+#include <stdlib.h>    // For malloc() and free()
+#include <string.h>    // For memcpy() and memset()
+#include <sys/mman.h>  // For mmap(), munmap() and posix_madvise()
+#include <sys/stat.h>  // For fstat()
+
+#include "bmpio.h"
+#include "simd.h"      // For the vectorized conversions of 24-bit scanlines
+
+// Bytes of reflected or converted scanlines gathered before each write, or read before each conversion
+#define BUFFER_BYTES (256 * 1024)
+
+// Blocks of converted scanlines that take turns when writes are queued
+#define BLOCKS 4
+
+// Pixels along each side of the tiles that images are transposed in
+#define TILE 32
+
+// Check that the headers describe a 24-bit or 32-bit uncompressed BMP file that the filters understand
+static int supported(const BITMAPFILEHEADER *bf, const BITMAPINFOHEADER *bi)
+{
+    return bf->bfType == 0x4d42 && bf->bfOffBits == 54 && bi->biSize == 40 &&
+           (bi->biBitCount == 24 || bi->biBitCount == 32) && bi->biCompression == 0 && bi->biWidth > 0;
+}
+
+// Get the number of bytes a scanline of width pixels takes up in a file of the given bits per pixel: rows are
+// padded to 4-byte boundaries in a 24-bit file, and 32-bit pixels always end on one
+static size_t scanline_bytes(int width, int bits)
+{
+    return bits == 32 ? (size_t) width * 4 : ((size_t) width * sizeof(RGBTRIPLE) + 3) & ~(size_t) 3;
+}
+
+size_t bmp_scanline(const BMP *bmp)
+{
+    return scanline_bytes(bmp->image.width, bmp->bi.biBitCount);
+}
+
+// Describe the rows in memory that start at data, given the info header
+static void describe(BMP *bmp, BYTE *data)
+{
+    bmp->image.height = abs(bmp->bi.biHeight);  // Negative for top-down bitmaps
+    bmp->image.width = bmp->bi.biWidth;
+    bmp->image.stride = row_stride(bmp->image.width);
+    bmp->image.data = data;
+    bmp->image.bottom_up = bmp->bi.biHeight > 0;
+}
+
+// Spread a 24-bit scanline out into a row of pixels in memory
+static void expand_row(const BYTE *in, RGBQUAD *row, int width)
+{
+    for (int j = expand_simd(in, row, width); j < width; j++)
+    {
+        row[j] = (RGBQUAD) {in[3 * j], in[3 * j + 1], in[3 * j + 2], 0};
+    }
+}
+
+// Pack a row of pixels in memory into a 24-bit scanline, reflected if mirror is set
+static void pack_row(const RGBQUAD *row, BYTE *out, int width, int mirror)
+{
+    for (int j = pack_simd(row, out, width, mirror); j < width; j++)
+    {
+        const RGBQUAD *pixel = &row[mirror ? width - 1 - j : j];
+        out[3 * j] = pixel->rgbBlue;
+        out[3 * j + 1] = pixel->rgbGreen;
+        out[3 * j + 2] = pixel->rgbRed;
+    }
+}
+
+BMPSTATUS bmp_read_headers(FILE *inptr, BMP *bmp)
+{
+    // Read the BITMAPFILEHEADER and BITMAPINFOHEADER from the input file
+    if (fread(&bmp->bf, sizeof(BITMAPFILEHEADER), 1, inptr) != 1 ||
+        fread(&bmp->bi, sizeof(BITMAPINFOHEADER), 1, inptr) != 1 ||
+        !supported(&bmp->bf, &bmp->bi))
+    {
+        return BMP_UNSUPPORTED;
+    }
+
+    describe(bmp, NULL);
+    bmp->extra = NULL;
+    return BMP_OK;
+}
+
+// Convert scanline in of a file into row i of rows in memory: a 24-bit one is spread out to 4 bytes a pixel, and a
+// 32-bit one (blue, green, red and a fourth byte per pixel, with no padding) is copied as it is, with its fourth
+// bytes kept aside in extra as well, since the filters are free to change the fourth bytes in memory
+static void convert_row(const BYTE *in, IMAGE *rows, int i, BYTE *extra)
+{
+    int width = rows->width;
+    RGBQUAD *row = image_row(rows, i);
+    if (extra == NULL)
+    {
+        expand_row(in, row, width);
+        return;
+    }
+    memcpy(row, in, width * sizeof(RGBQUAD));
+    BYTE *fourth = extra + (size_t) i * width;
+    for (int j = 0; j < width; j++)
+    {
+        fourth[j] = in[4 * j + 3];
+    }
+}
+
+BMPSTATUS bmp_read_rows(FILE *inptr, IMAGE *rows, BYTE *extra)
+{
+    // The scanlines are read in batches of about BUFFER_BYTES, and each is converted into a row in memory
+    // Missing rows are left black
+    size_t scanline = scanline_bytes(rows->width, extra != NULL ? 32 : 24);
+    int batch = scanline < BUFFER_BYTES ? BUFFER_BYTES / scanline : 1;
+    BYTE *buffer = malloc((size_t) batch * scanline);
+    if (buffer == NULL)
+    {
+        return BMP_NO_MEMORY;
+    }
+    for (int start = 0; start < rows->height; start += batch)
+    {
+        int count = rows->height - start < batch ? rows->height - start : batch;
+        size_t got = fread(buffer, 1, count * scanline, inptr);
+        memset(buffer + got, 0x00, count * scanline - got);
+        for (int i = 0; i < count; i++)
+        {
+            convert_row(buffer + i * scanline, rows, start + i, extra);
+        }
+    }
+    free(buffer);
+    return BMP_OK;
+}
+
+// Convert the pixels of a whole file straight out of a read-only mapping of it, which takes no read() calls and
+// no buffer in between; returns BMP_NO_MEMORY, having converted nothing, if the file cannot be mapped
+static BMPSTATUS map_rows(FILE *inptr, BMP *bmp)
+{
+    struct stat st;
+    if (fstat(fileno(inptr), &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        return BMP_NO_MEMORY;
+    }
+
+    // A truncated file would fault when the missing rows were touched, so let the caller read it instead, and so
+    // must a BMP file that does not start at the start of the file (as on stdin, after something else has read it)
+    size_t scanline = bmp_scanline(bmp);
+    int height = bmp->image.height;
+    if ((size_t) st.st_size < bmp->bf.bfOffBits + scanline * height || ftello(inptr) != bmp->bf.bfOffBits)
+    {
+        return BMP_NO_MEMORY;
+    }
+
+    const BYTE *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(inptr), 0);
+    if (map == MAP_FAILED)
+    {
+        return BMP_NO_MEMORY;
+    }
+    posix_madvise((void *) map, st.st_size, POSIX_MADV_SEQUENTIAL);
+    for (int i = 0; i < height; i++)
+    {
+        convert_row(map + bmp->bf.bfOffBits + i * scanline, &bmp->image, i, bmp->extra);
+    }
+    munmap((void *) map, st.st_size);
+    return BMP_OK;
+}
+
+// Fill the image of a BMP file whose headers have just been read, converting its pixels straight out of the file
+// where it can be mapped, or else reading them a batch at a time
+static BMPSTATUS load_rows(FILE *inptr, BMP *bmp)
+{
+    if (map_rows(inptr, bmp) == BMP_OK)
+    {
+        return BMP_OK;
+    }
+    return bmp_read_rows(inptr, &bmp->image, bmp->extra);
+}
+
+BMPSTATUS bmp_load_pixels(FILE *inptr, BMP *bmp)
+{
+    bmp->image.data = alloc_rows(bmp->image.stride * bmp->image.height);
+    if (bmp->bi.biBitCount == 32)
+    {
+        bmp->extra = malloc((size_t) bmp->image.width * bmp->image.height);
+    }
+    if (bmp->image.data == NULL || (bmp->bi.biBitCount == 32 && bmp->extra == NULL) ||
+        load_rows(inptr, bmp) != BMP_OK)
+    {
+        free(bmp->image.data);
+        free(bmp->extra);
+        bmp->image.data = NULL;
+        bmp->extra = NULL;
+        return BMP_NO_MEMORY;
+    }
+    return BMP_OK;
+}
+
+BMPSTATUS bmp_load(FILE *inptr, BMP *bmp)
+{
+    BMPSTATUS status = bmp_read_headers(inptr, bmp);
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    return bmp_load_pixels(inptr, bmp);
+}
+
+BMPSTATUS bmp_read_into(FILE *inptr, BMP *bmp, BYTE **buffer, size_t *size)
+{
+    BMPSTATUS status = bmp_read_headers(inptr, bmp);
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+
+    // Only grow the buffer for an image larger than any it has held (its old contents are not needed)
+    // The fourth bytes of a 32-bit file's pixels go after the rows
+    size_t length = bmp->image.stride * bmp->image.height;
+    size_t extra = bmp->bi.biBitCount == 32 ? (size_t) bmp->image.width * bmp->image.height : 0;
+    if (length + extra > *size)
+    {
+        free(*buffer);
+        *buffer = alloc_rows(length + extra);
+        *size = *buffer != NULL ? length + extra : 0;
+        if (*buffer == NULL)
+        {
+            return BMP_NO_MEMORY;
+        }
+    }
+
+    bmp->image.data = *buffer;
+    bmp->extra = extra > 0 ? *buffer + length : NULL;
+    return load_rows(inptr, bmp);
+}
+
+int bmp_write_headers(WRITER *writer, const BMP *bmp)
+{
+    // Write the BITMAPFILEHEADER and BITMAPINFOHEADER to the output file, as one write
+    struct iovec pieces[2] = {{(void *) &bmp->bf, sizeof(BITMAPFILEHEADER)},
+                              {(void *) &bmp->bi, sizeof(BITMAPINFOHEADER)}};
+    writer_wait(writer, writer_write(writer, pieces, 2));
+    return 0;
+}
+
+// Write the scanlines of an image, after the given headers unless they are NULL, last row first if flip is set
+// (see bmp_write_rows())
+static int write_scanlines(WRITER *writer, const BITMAPFILEHEADER *bf, const BITMAPINFOHEADER *bi,
+                           const IMAGE *image, const BYTE *extra, int mirror, int flip)
+{
+    // The headers go out with the first scanlines
+    struct iovec pieces[MAX_PIECES];
+    int count = 0;
+    if (bf != NULL)
+    {
+        pieces[count++] = (struct iovec) {(void *) bf, sizeof(BITMAPFILEHEADER)};
+        pieces[count++] = (struct iovec) {(void *) bi, sizeof(BITMAPINFOHEADER)};
+    }
+
+    // Rows are converted into blocks of whole scanlines (of about BUFFER_BYTES), each written with one call once
+    // it is full. Queued writes need several blocks, so that one can be filled while the others are written
+    int width = image->width;
+    size_t scanline = scanline_bytes(width, extra != NULL ? 32 : 24);
+    int rows = scanline < BUFFER_BYTES ? BUFFER_BYTES / scanline : 1;
+    int blocks = writer_async(writer) ? BLOCKS : 1;
+    BYTE *buffer = malloc((size_t) blocks * rows * scanline);
+    if (buffer == NULL)
+    {
+        return 1;
+    }
+
+    long tickets[BLOCKS] = {0};
+    long last = 0;
+    for (int start = 0, b = 0; start < image->height; start += rows, b = (b + 1) % blocks)
+    {
+        // Wait for the block's previous write before refilling it
+        writer_wait(writer, tickets[b]);
+        BYTE *block = buffer + (size_t) b * rows * scanline;
+        int n = image->height - start < rows ? image->height - start : rows;
+        for (int i = 0; i < n; i++)
+        {
+            int from_row = flip ? image->height - 1 - (start + i) : start + i;
+            const RGBQUAD *row = image_row(image, from_row);
+            BYTE *out = block + (size_t) i * scanline;
+            if (extra == NULL)
+            {
+                // Padding bytes are always written as zeros
+                pack_row(row, out, width, mirror);
+                memset(out + width * sizeof(RGBTRIPLE), 0x00, scanline - width * sizeof(RGBTRIPLE));
+                continue;
+            }
+
+            // Each pixel gets its fourth byte back, and keeps it when reflected
+            const BYTE *fourth = extra + (size_t) from_row * width;
+            for (int j = 0; j < width; j++)
+            {
+                int from = mirror ? width - 1 - j : j;
+                out[4 * j] = row[from].rgbBlue;
+                out[4 * j + 1] = row[from].rgbGreen;
+                out[4 * j + 2] = row[from].rgbRed;
+                out[4 * j + 3] = fourth[from];
+            }
+        }
+        pieces[count++] = (struct iovec) {block, n * scanline};
+        last = tickets[b] = writer_write(writer, pieces, count);
+        count = 0;
+    }
+
+    // An image with no rows still has its headers
+    if (count > 0)
+    {
+        last = writer_write(writer, pieces, count);
+    }
+    writer_wait(writer, last);
+    free(buffer);
+    return 0;
+}
+
+// Write the scanlines of an image transposed, after the given headers (which describe the transposed image),
+// then reflected if mirror is set and flipped if flip is set; returns 0 on success, or 1 if there was no memory.
+// Each row of the output is a column of the image, and walking down a column touches a new row (and often a new
+// page) for every pixel, so each block of output rows is filled a tile at a time instead: TILE pixels along each
+// of TILE rows of the image, so that every cache line and page brought in is used up before moving on
+static int write_transposed(WRITER *writer, const BITMAPFILEHEADER *bf, const BITMAPINFOHEADER *bi,
+                            const IMAGE *image, const BYTE *extra, int mirror, int flip)
+{
+    int width = image->height;
+    int height = image->width;
+    size_t bytes = extra != NULL ? 4 : sizeof(RGBTRIPLE);
+    size_t used = (size_t) width * bytes;
+    size_t scanline = scanline_bytes(width, extra != NULL ? 32 : 24);
+
+    // A block holds at least a tile's worth of output rows, however wide they are
+    int rows = scanline < BUFFER_BYTES / TILE ? BUFFER_BYTES / scanline : TILE;
+    int blocks = writer_async(writer) ? BLOCKS : 1;
+    BYTE *buffer = malloc((size_t) blocks * rows * scanline);
+    if (buffer == NULL)
+    {
+        return 1;
+    }
+
+    // The headers go out with the first block
+    struct iovec pieces[MAX_PIECES] = {{(void *) bf, sizeof(BITMAPFILEHEADER)},
+                                       {(void *) bi, sizeof(BITMAPINFOHEADER)}};
+    int count = 2;
+    long tickets[BLOCKS] = {0};
+    long last = 0;
+    for (int start = 0, b = 0; start < height; start += rows, b = (b + 1) % blocks)
+    {
+        // Wait for the block's previous write before refilling it
+        writer_wait(writer, tickets[b]);
+        BYTE *block = buffer + (size_t) b * rows * scanline;
+        int n = height - start < rows ? height - start : rows;
+        for (int y = 0; y < n; y++)
+        {
+            memset(block + y * scanline + used, 0x00, scanline - used);
+        }
+
+        // Output row start + y is column start + y of the image (counting from the right if flipped), and its
+        // pixel x comes from row x (counting from the last row if reflected)
+        for (int top = 0; top < width; top += TILE)
+        {
+            int bottom = top + TILE < width ? top + TILE : width;
+            for (int first = 0; first < n; first += TILE)
+            {
+                int end = first + TILE < n ? first + TILE : n;
+                for (int r = top; r < bottom; r++)
+                {
+                    // Each pixel of a 32-bit file gets its fourth byte back
+                    const RGBQUAD *row = image_row(image, r);
+                    const BYTE *fourth = extra != NULL ? extra + (size_t) r * height : NULL;
+                    BYTE *out = block + (size_t) (mirror ? width - 1 - r : r) * bytes;
+                    for (int y = first; y < end; y++)
+                    {
+                        int c = flip ? height - 1 - (start + y) : start + y;
+                        BYTE *pixel = out + y * scanline;
+                        pixel[0] = row[c].rgbBlue;
+                        pixel[1] = row[c].rgbGreen;
+                        pixel[2] = row[c].rgbRed;
+                        if (fourth != NULL)
+                        {
+                            pixel[3] = fourth[c];
+                        }
+                    }
+                }
+            }
+        }
+        pieces[count++] = (struct iovec) {block, n * scanline};
+        last = tickets[b] = writer_write(writer, pieces, count);
+        count = 0;
+    }
+
+    // An image with no columns still has its headers
+    if (count > 0)
+    {
+        last = writer_write(writer, pieces, count);
+    }
+    writer_wait(writer, last);
+    free(buffer);
+    return 0;
+}
+
+int bmp_write_rows(WRITER *writer, const IMAGE *image, const BYTE *extra, int mirror)
+{
+    return write_scanlines(writer, NULL, NULL, image, extra, mirror, 0);
+}
+
+int bmp_write(WRITER *writer, const BMP *bmp, const ORIENTATION *orientation)
+{
+    // The orientation is as the image is seen, but a bottom-up file (with a positive height) stores its last row
+    // first. Reflecting and flipping are the same either way up, but transposing the image as it is seen is
+    // transposing its rows about the other diagonal: a transpose, reflect and flip of the rows as stored
+    int transpose = orientation->transpose;
+    int upended = transpose && bmp->bi.biHeight > 0;
+    int mirror = orientation->mirror ^ upended;
+    int flip = orientation->flip ^ upended;
+    if (!transpose)
+    {
+        return write_scanlines(writer, &bmp->bf, &bmp->bi, &bmp->image, bmp->extra, mirror, flip);
+    }
+
+    // A transposed image is as wide as the image was tall and as tall as it was wide, stored the same way up, with
+    // padding to suit its new width
+    BITMAPFILEHEADER bf = bmp->bf;
+    BITMAPINFOHEADER bi = bmp->bi;
+    size_t scanline = scanline_bytes(bmp->image.height, bi.biBitCount);
+    size_t size = scanline * bmp->image.width;
+    bi.biWidth = bmp->image.height;
+    bi.biHeight = bmp->bi.biHeight < 0 ? -bmp->image.width : bmp->image.width;
+    bi.biXPelsPerMeter = bmp->bi.biYPelsPerMeter;
+    bi.biYPelsPerMeter = bmp->bi.biXPelsPerMeter;
+    bi.biSizeImage = bmp->bi.biSizeImage != 0 ? size : 0;
+    bf.bfSize = bf.bfOffBits + size;
+    return write_transposed(writer, &bf, &bi, &bmp->image, bmp->extra, mirror, flip);
+}
+
+void bmp_free(BMP *bmp)
+{
+    free(bmp->image.data);
+    free(bmp->extra);
+    bmp->image.data = NULL;
+    bmp->extra = NULL;
+}
@@ -1,71 +1,433 @@
-#include <getopt.h>  // Includes the getopt library for command-line option parsing
-#include <stdio.h>   // Includes the standard I/O library for file operations and printing
-#include <stdlib.h>  // Includes the standard library for memory allocation and process control
-#include <math.h>    // Includes the mathematical functions library for math operations
+#define _POSIX_C_SOURCE 200809L  // For fdopen() and dup()
 
-#include "helpers.h" // Includes the custom header file defining the BITMAPFILEHEADER, BITMAPINFOHEADER, RGBTRIPLE structures, and image processing functions
+#include <getopt.h>  // For command-line option parsing
+#include <stdio.h>   // For file operations and standard I/O functions
+#include <stdlib.h>  // For memory allocation and utility functions
+#include <string.h>  // For building the option string
+#include <unistd.h>  // For dup() and dup2()
 
-int main(int argc, char *argv[])
+#include "bands.h"   // For applying a filter to bands of rows in parallel
+#include "batch.h"   // For filtering whole directories of images
+#include "bmpio.h"   // For loading and writing BMP files
+#include "chain.h"   // For chains of filters
+#include "helpers.h" // For definitions of BITMAPFILEHEADER, BITMAPINFOHEADER, RGBQUAD, and image processing functions
+#include "pool.h"    // For the threads that filter the bands
+#include "region.h"  // For filtering just a rectangle of an image
+#include "service.h" // For filtering images sent over a socket
+#include "stats.h"   // For timing each stage of a run
+#include "stream.h"  // For filtering images a strip at a time
+#include "writer.h"  // For writing the output in large blocks
+
+// Values getopt_long returns for options that only have a long form
+enum
+{
+    STRIP = 256,
+    CHAIN_LIST,
+    BATCH_MODE,
+    STATS_REPORT,
+    ASYNC_WRITE,
+    SERVE_MODE,
+    REGION_OF_INTEREST
+};
+
+// Ways of reporting --stats
+enum
+{
+    NO_STATS,
+    TEXT_STATS,
+    JSON_STATS
+};
+
+// Open the file named on the command line for reading, where - means stdin
+static FILE *open_input(const char *name)
+{
+    return strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+}
+
+// Open the file named on the command line for writing, where - means stdout; anything printed from then on goes to
+// stderr instead, so that it cannot end up in the middle of the image
+static FILE *open_output(const char *name)
+{
+    if (strcmp(name, "-") != 0)
+    {
+        return fopen(name, "w");
+    }
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+        return NULL;
+    }
+    return fdopen(fd, "w");
+}
+
+// Load the whole image, filter it and write it out, timing each stage if stats is not NULL
+static BMPSTATUS filter_in_memory(FILE *inptr, WRITER *writer, const CHAIN *chain, POOL *pool, STATS *stats)
 {
-    // Define allowable filter options: b for blur, g for grayscale, r for reflect, s for sepia
-    char *filters = "bgrs";
+    // Read the headers
+    BMP bmp;
+    double start = stats_now();
+    BMPSTATUS status = bmp_read_headers(inptr, &bmp);
+    stats_add(stats, STAGE_HEADERS, start, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+    if (status != BMP_OK)
+    {
+        return status;
+    }
 
-    // Get filter flag from command-line arguments
-    char filter = getopt(argc, argv, filters);
+    // Load the pixels, converting them into rows the filters can work on (straight out of a mapping of the input file,
+    // where it can be mapped)
+    start = stats_now();
+    status = bmp_load_pixels(inptr, &bmp);
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    // Reading and writing move the file's scanlines, and filtering the rows in memory
+    size_t size = bmp_scanline(&bmp) * bmp.image.height;
+    size_t length = bmp.image.stride * bmp.image.height;
+    if (stats != NULL)
+    {
+        stats->megapixels = (double) bmp.image.width * bmp.image.height / 1e6;
+    }
+    stats_add(stats, STAGE_READ, start, size);
 
-    // Check if an invalid filter flag was provided
-    if (filter == '?')
+    // Apply the chain of filters to the image, a pass at a time and one band of rows per thread
+    // The filters work on the rows in place, so nothing is copied
+    start = stats_now();
+    stats_start_counters(stats);
+    int failed = apply_chain(chain, &bmp.image, pool);
+    stats_stop_counters(stats);
+    stats_add(stats, STAGE_FILTER, start, length * chain->pass_count);
+    if (failed)
     {
-        printf("Invalid filter.\n");
-        return 1;  // Exit with error code 1 for invalid filter
+        bmp_free(&bmp);
+        return BMP_NO_MEMORY;
     }
 
-    // Ensure that only one filter is specified
-    if (getopt(argc, argv, filters) != -1)
+    // Write the headers and the modified image to the output file, reflecting it on the way if the chain ends that way
+    start = stats_now();
+    failed = bmp_write(writer, &bmp, &chain->orientation);
+    stats_add(stats, STAGE_WRITE, start, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + size);
+
+    // Free the image
+    start = stats_now();
+    bmp_free(&bmp);
+    stats_add(stats, STAGE_CLOSE, start, 0);
+    return failed ? BMP_NO_MEMORY : BMP_OK;
+}
+
+int main(int argc, char *argv[])
+{
+    // Allow one flag per filter (e.g., b for blur), as many times as wanted, plus -j for the number of threads
+    // (filters that take an argument, like -b for the blur radius, may have it attached or follow)
+    char flags[64] = "j:";
+    for (const FILTER *f = FILTERS; f->flag != 0; f++)
     {
-        printf("Only one filter allowed.\n");
-        return 2;  // Exit with error code 2 for multiple filters
+        strncat(flags, &f->flag, 1);
+        if (f->parse != NULL)
+        {
+            strcat(flags, "::");
+        }
     }
 
-    // Ensure proper usage of the program (i.e., exactly two additional arguments: infile and outfile)
-    if (argc != optind + 2)
+    // Long options: --strip ROWS streams the image through the filters ROWS rows at a time, and
+    // --chain LIST adds a comma-separated list of filters (e.g., --chain g,b5,r is the same as -g -b5 -r),
+    // --batch filters every BMP file in one directory into another, --stats[=json] reports how long each
+    // stage of the run took, --async-write queues the output's writes on an io_uring, --serve[=socket] keeps
+    // running, filtering the jobs that clients send over a Unix socket, and --roi x,y,w,h only filters that
+    // rectangle of the image
+    static const struct option long_options[] =
+    {
+        {"strip", required_argument, NULL, STRIP},
+        {"chain", required_argument, NULL, CHAIN_LIST},
+        {"batch", no_argument, NULL, BATCH_MODE},
+        {"stats", optional_argument, NULL, STATS_REPORT},
+        {"async-write", no_argument, NULL, ASYNC_WRITE},
+        {"serve", optional_argument, NULL, SERVE_MODE},
+        {"roi", required_argument, NULL, REGION_OF_INTEREST},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Parse filter flags, thread count and strip height from command-line arguments
+    // The filters are applied in the order they are given
+    CHAIN chain = {.step_count = 0};
+    int threads = 1;
+    int strip = 0;
+    int batch = 0;
+    int async = 0;
+    const char *socket_path = NULL;
+    REGION region;
+    int cropped = 0;
+    int report = NO_STATS;
+    int option;
+    while ((option = getopt_long(argc, argv, flags, long_options, NULL)) != -1)
     {
-        printf("Usage: ./filter [flag] infile outfile\n");
+        // Check if an invalid filter flag was provided
+        if (option == '?')
+        {
+            printf("Invalid filter.\n");
+            return 1;  // Exit with error code 1 for invalid filter
+        }
+
+        // Remember how many threads to filter with (0 means one per CPU)
+        if (option == 'j')
+        {
+            char *end;
+            threads = strtol(optarg, &end, 10);
+            if (*end != '\0' || threads < 0)
+            {
+                printf("Invalid number of threads.\n");
+                return 1;  // Exit with error code 1 for an invalid option
+            }
+            continue;
+        }
+
+        // Remember how many rows to stream at a time (0 means load the whole image)
+        if (option == STRIP)
+        {
+            char *end;
+            strip = strtol(optarg, &end, 10);
+            if (*end != '\0' || strip < 0)
+            {
+                printf("Invalid strip height.\n");
+                return 1;  // Exit with error code 1 for an invalid option
+            }
+            continue;
+        }
+
+        // Report on each stage of the run, as a table or as JSON
+        if (option == STATS_REPORT)
+        {
+            if (optarg == NULL || strcmp(optarg, "text") == 0)
+            {
+                report = TEXT_STATS;
+            }
+            else if (strcmp(optarg, "json") == 0)
+            {
+                report = JSON_STATS;
+            }
+            else
+            {
+                printf("Invalid stats format.\n");
+                return 1;  // Exit with error code 1 for an invalid option
+            }
+            continue;
+        }
+
+        // Filter directories rather than files
+        if (option == BATCH_MODE)
+        {
+            batch = 1;
+            continue;
+        }
+
+        // Serve jobs from clients rather than filtering files named here
+        if (option == SERVE_MODE)
+        {
+            socket_path = optarg != NULL ? optarg : SOCKET_PATH;
+            continue;
+        }
+
+        // Only filter a rectangle of the image
+        if (option == REGION_OF_INTEREST)
+        {
+            if (!parse_region(optarg, &region))
+            {
+                printf("Invalid region.\n");
+                return 1;  // Exit with error code 1 for an invalid option
+            }
+            cropped = 1;
+            continue;
+        }
+
+        // Queue the writes rather than making them there and then
+        if (option == ASYNC_WRITE)
+        {
+            async = 1;
+            continue;
+        }
+
+        // Add a list of filters to the chain
+        if (option == CHAIN_LIST)
+        {
+            int invalid = chain_parse(optarg, &chain);
+            if (invalid == 1)
+            {
+                printf("Invalid filter.\n");
+                return 1;  // Exit with error code 1 for invalid filter
+            }
+            if (invalid == 2)
+            {
+                printf("Too many filters.\n");
+                return 2;  // Exit with error code 2 for too many filters
+            }
+            continue;
+        }
+
+        const FILTER *filter = find_filter(option);
+        OPTIONS options = DEFAULT_OPTIONS;
+
+        // Read the filter's argument, either attached (-b5) or as the next word (-b 5), as long as
+        // that still leaves the two filenames
+        if (filter->parse != NULL && optarg != NULL)
+        {
+            if (!filter->parse(optarg, &options))
+            {
+                printf("Invalid filter.\n");
+                return 1;  // Exit with error code 1 for invalid filter
+            }
+        }
+        else if (filter->parse != NULL && optind + 2 < argc && filter->parse(argv[optind], &options))
+        {
+            optind++;
+        }
+
+        // Add the filter to the end of the chain
+        if (!chain_add(&chain, filter, &options))
+        {
+            printf("Too many filters.\n");
+            return 2;  // Exit with error code 2 for too many filters
+        }
+    }
+
+    // Ensure proper usage: exactly two additional arguments (input and output filenames, or directories); either
+    // file may be -, for stdin or stdout. A service takes its filters and files from each job instead
+    if (socket_path != NULL && argc == optind && chain.step_count == 0)
+    {
+        return serve(socket_path, threads, async);
+    }
+    if (argc != optind + 2 || socket_path != NULL || (batch && cropped))
+    {
+        printf("Usage: ./filter [flag [argument]]... [--chain list] [-j threads] [--strip rows] [--roi x,y,w,h] "
+               "[--async-write] [--stats[=json]] infile outfile\n"
+               "       ./filter [flag [argument]]... [--chain list] [-j threads] [--strip rows] [--async-write] "
+               "--batch indir outdir\n"
+               "       ./filter [-j threads] [--async-write] --serve[=socket]\n");
         return 3;  // Exit with error code 3 for incorrect usage
     }
 
+    // Fuse the chain into as few passes as possible
+    chain_compile(&chain);
+
+    // A rectangle of the image cannot be turned without moving it over the rest
+    if (cropped && (chain.orientation.transpose || chain.orientation.mirror || chain.orientation.flip))
+    {
+        printf("Invalid region.\n");
+        return 1;  // Exit with error code 1 for an invalid option
+    }
+
+    // Filter a whole directory of images, spread over the threads one image at a time, and sum up how it went
+    if (batch)
+    {
+        POOL *pool = pool_create(threads);
+        if (pool == NULL)
+        {
+            printf("Not enough memory to start threads.\n");
+            return 7;  // Exit with error code 7 for memory allocation failure
+        }
+        BATCHSTATS summary;
+        int code = batch_filter(argv[optind], argv[optind + 1], &chain, strip, async, pool, &summary);
+        pool_destroy(pool);
+        if (summary.images + summary.failed == 0 && code != 0)
+        {
+            return code;
+        }
+
+        double seconds = summary.seconds > 0 ? summary.seconds : 1e-9;
+        printf("Filtered %d images (%.1f MB) in %.3f s: %.1f images/s, %.1f MB/s", summary.images,
+               summary.bytes / 1e6, summary.seconds, summary.images / seconds, summary.bytes / 1e6 / seconds);
+        if (summary.failed > 0)
+        {
+            printf("; %d failed", summary.failed);
+        }
+        printf(".\n");
+        return code;
+    }
+
     // Store input and output filenames from command-line arguments
     char *infile = argv[optind];
     char *outfile = argv[optind + 1];
 
+    // Start timing, and open the hardware counters before any threads are started, so that they count them all
+    STATS stats;
+    STATS *recording = report != NO_STATS ? &stats : NULL;
+    if (recording != NULL)
+    {
+        stats_init(recording);
+    }
+
+    // An image written to stdout must not be mixed up with messages, so claim it before anything else is printed
+    // (a named output file is only created once the input has been opened)
+    double start = stats_now();
+    FILE *outptr = NULL;
+    if (strcmp(outfile, "-") == 0 && (outptr = open_output(outfile)) == NULL)
+    {
+        printf("Could not create %s.\n", outfile);
+        return 5;  // Exit with error code 5 for failure to create output file
+    }
+
     // Open the input file for reading
-    FILE *inptr = fopen(infile, "r");
+    FILE *inptr = open_input(infile);
     if (inptr == NULL)
     {
         printf("Could not open %s.\n", infile);
+        if (outptr != NULL)
+        {
+            fclose(outptr);
+        }
         return 4;  // Exit with error code 4 for failure to open input file
     }
 
     // Open the output file for writing
-    FILE *outptr = fopen(outfile, "w");
-    if (outptr == NULL)
+    if (outptr == NULL && (outptr = open_output(outfile)) == NULL)
     {
         fclose(inptr);  // Close input file if output file cannot be created
         printf("Could not create %s.\n", outfile);
         return 5;  // Exit with error code 5 for failure to create output file
     }
 
-    // Read the BITMAPFILEHEADER from the input file
-    BITMAPFILEHEADER bf;
-    fread(&bf, sizeof(BITMAPFILEHEADER), 1, inptr);
+    stats_add(recording, STAGE_OPEN, start, 0);
 
-    // Read the BITMAPINFOHEADER from the input file
-    BITMAPINFOHEADER bi;
-    fread(&bi, sizeof(BITMAPINFOHEADER), 1, inptr);
+    // Start the threads that filter the image, and the writer that writes it out
+    POOL *pool = pool_create(threads);
+    WRITER *writer = writer_open(outptr, async);
+    if (pool == NULL || writer == NULL)
+    {
+        printf("Not enough memory to start threads.\n");
+        pool_destroy(pool);
+        if (writer != NULL)
+        {
+            writer_close(writer);
+        }
+        fclose(outptr);  // Close output file
+        fclose(inptr);   // Close input file
+        return 7;  // Exit with error code 7 for memory allocation failure
+    }
+
+    // Filter just a rectangle of the image, or the image either a strip at a time, or all at once (as it must be to
+    // come out flipped or transposed, since its first row out is then its last row, or column, in)
+    BMPSTATUS status;
+    if (cropped)
+    {
+        status = region_filter(inptr, writer, &chain, &region, pool, recording);
+    }
+    else if (strip > 0 && !chain.orientation.flip && !chain.orientation.transpose)
+    {
+        status = stream_filter(inptr, writer, &chain, strip, pool, recording);
+    }
+    else
+    {
+        status = filter_in_memory(inptr, writer, &chain, pool, recording);
+    }
+    pool_destroy(pool);
+
+    // Wait for the writes still under way (all of them, with --async-write), which is part of writing the image
+    start = stats_now();
+    int unwritten = writer_close(writer);
+    stats_add(recording, STAGE_WRITE, start, 0);
 
-    // Validate that the input file is a 24-bit uncompressed BMP file
-    if (bf.bfType != 0x4d42 || bf.bfOffBits != 54 || bi.biSize != 40 ||
-        bi.biBitCount != 24 || bi.biCompression != 0)
+    // Validate that the input file is a 24-bit or 32-bit uncompressed BMP file
+    if (status == BMP_UNSUPPORTED)
     {
         fclose(outptr);  // Close output file
         fclose(inptr);   // Close input file
@@ -73,13 +435,8 @@ int main(int argc, char *argv[])
         return 6;  // Exit with error code 6 for unsupported file format
     }
 
-    // Get image dimensions
-    int height = abs(bi.biHeight);  // Height of the image (absolute value for BMP files where height is negative for top-down bitmaps)
-    int width = bi.biWidth;         // Width of the image
-
-    // Allocate memory for the image
-    RGBTRIPLE(*image)[width] = calloc(height, width * sizeof(RGBTRIPLE));
-    if (image == NULL)
+    // Make sure there was room for the image
+    if (status == BMP_NO_MEMORY)
     {
         printf("Not enough memory to store image.\n");
         fclose(outptr);  // Close output file
@@ -87,68 +444,22 @@ int main(int argc, char *argv[])
         return 7;  // Exit with error code 7 for memory allocation failure
     }
 
-    // Calculate padding for each row (rows must be aligned to 4-byte boundaries)
-    int padding = (4 - (width * sizeof(RGBTRIPLE)) % 4) % 4;
-
-    // Read the image's scanlines from the input file
-    for (int i = 0; i < height; i++)
+    // Close the input and output files, making sure that every byte of the output made it (a full disk, say, only
+    // shows up here)
+    start = stats_now();
+    fclose(inptr);
+    if (fclose(outptr) != 0 || unwritten)
     {
-        // Read one row of pixels into the image array
-        fread(image[i], sizeof(RGBTRIPLE), width, inptr);
-
-        // Skip over the padding bytes at the end of the row
-        fseek(inptr, padding, SEEK_CUR);
+        printf("Could not write %s.\n", outfile);
+        return 5;  // Exit with error code 5 for failure to write output file
     }
+    stats_add(recording, STAGE_CLOSE, start, 0);
 
-    // Apply the selected filter to the image
-    switch (filter)
+    // Report where the time went
+    if (recording != NULL)
     {
-        // Apply blur filter
-        case 'b':
-            blur(height, width, image);
-            break;
-
-        // Apply grayscale filter
-        case 'g':
-            grayscale(height, width, image);
-            break;
-
-        // Apply reflection filter
-        case 'r':
-            reflect(height, width, image);
-            break;
-
-        // Apply sepia filter
-        case 's':
-            sepia(height, width, image);
-            break;
+        stats_print(recording, report == JSON_STATS);
     }
 
-    // Write the BITMAPFILEHEADER to the output file
-    fwrite(&bf, sizeof(BITMAPFILEHEADER), 1, outptr);
-
-    // Write the BITMAPINFOHEADER to the output file
-    fwrite(&bi, sizeof(BITMAPINFOHEADER), 1, outptr);
-
-    // Write the modified image to the output file
-    for (int i = 0; i < height; i++)
-    {
-        // Write one row of pixels to the output file
-        fwrite(image[i], sizeof(RGBTRIPLE), width, outptr);
-
-        // Write padding bytes at the end of the row to align with 4-byte boundaries
-        for (int k = 0; k < padding; k++)
-        {
-            fputc(0x00, outptr);
-        }
-    }
-
-    // Free the allocated memory for the image
-    free(image);
-
-    // Close the input and output files
-    fclose(inptr);
-    fclose(outptr);
-    
     return 0;  // Exit successfully
 }
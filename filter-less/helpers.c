@@ -1,141 +1,380 @@
+#define _GNU_SOURCE  // For MADV_HUGEPAGE
+
 #include "helpers.h"
-#include <math.h>  // Library for mathematical functions like round()
+#include <stdlib.h>  // Library for strtol() and aligned_alloc()
+#include <string.h>  // Library for memset()
+#include <sys/mman.h> // Library for madvise()
+
+#include "scratch.h" // For the blur's row sums, kept from one image to the next
+
+// Convert one row to grayscale
+static void grayscale_row(RGBQUAD *row, int width, const OPTIONS *options)
+{
+    // Set each pixel's red, green, and blue to the rounded average of the three (see matrix.c)
+    matrix_row(row, width, &GRAYSCALE_MATRIX);
+}
 
 // Convert image to grayscale
 // Converts each pixel of the image to grayscale by averaging its red, green, and blue color values.
-void grayscale(int height, int width, RGBTRIPLE image[height][width])
+int grayscale(IMAGE *image, const HALO *halo, const OPTIONS *options)
 {
     // Iterate over each row of the image
-    for (int i = 0; i < height; i++)
+    for (int i = 0; i < image->height; i++)
     {
-        // Iterate over each column of the image
-        for (int j = 0; j < width; j++)
-        {
-            // Compute the average of the red, green, and blue components for the current pixel
-            // (Note: Using `3.0` ensures floating-point division)
-            int mid_value = round((image[i][j].rgbtRed + image[i][j].rgbtBlue + image[i][j].rgbtGreen) / 3.0);
-            
-            // Set the red, green, and blue components of the current pixel to the computed average value
-            // This effectively converts the pixel to grayscale
-            image[i][j].rgbtRed = mid_value;
-            image[i][j].rgbtBlue = mid_value;
-            image[i][j].rgbtGreen = mid_value;
-        }
+        grayscale_row(image_row(image, i), image->width, options);
     }
+
+    return 0;
+}
+
+// Convert one row to sepia
+static void sepia_row(RGBQUAD *row, int width, const OPTIONS *options)
+{
+    // Combine each pixel's original color components with fixed weights (see matrix.c)
+    matrix_row(row, width, &SEPIA_MATRIX);
 }
 
 // Convert image to sepia
 // Applies a sepia filter to the entire image to give it a warm, brownish tone.
-void sepia(int height, int width, RGBTRIPLE image[height][width])
+int sepia(IMAGE *image, const HALO *halo, const OPTIONS *options)
 {
     // Iterate over each row of the image
-    for (int i = 0; i < height; i++)
+    for (int i = 0; i < image->height; i++)
     {
-        // Iterate over each column of the image
-        for (int j = 0; j < width; j++)
-        {
-            // Retrieve the original red, green, and blue color values of the current pixel
-            int originalRed = image[i][j].rgbtRed;
-            int originalGreen = image[i][j].rgbtGreen;
-            int originalBlue = image[i][j].rgbtBlue;
-
-            // Apply the sepia filter formula to compute the new red, green, and blue values
-            // The formula combines the original color components with fixed weights to achieve a sepia effect
-            int sepiaRed = round(0.393 * originalRed + 0.769 * originalGreen + 0.189 * originalBlue);
-            int sepiaGreen = round(0.349 * originalRed + 0.686 * originalGreen + 0.168 * originalBlue);
-            int sepiaBlue = round(0.272 * originalRed + 0.534 * originalGreen + 0.131 * originalBlue);
-
-            // Clamp the sepia color values to ensure they do not exceed the maximum allowed value of 255
-            // This prevents overflow and keeps the colors within the valid range
-            if (sepiaRed > 255) sepiaRed = 255;
-            if (sepiaGreen > 255) sepiaGreen = 255;
-            if (sepiaBlue > 255) sepiaBlue = 255;
-
-            // Set the red, green, and blue components of the current pixel to the computed sepia values
-            image[i][j].rgbtRed = sepiaRed;
-            image[i][j].rgbtGreen = sepiaGreen;
-            image[i][j].rgbtBlue = sepiaBlue;
-        }
+        sepia_row(image_row(image, i), image->width, options);
+    }
+
+    return 0;
+}
+
+// Apply the color matrix chosen on the command line to one row
+static void recolor_row(RGBQUAD *row, int width, const OPTIONS *options)
+{
+    matrix_row(row, width, &options->matrix);
+}
+
+// Apply a color matrix
+// Sets each channel of each pixel to a weighted sum of its red, green, and blue, plus an offset.
+int recolor(IMAGE *image, const HALO *halo, const OPTIONS *options)
+{
+    for (int i = 0; i < image->height; i++)
+    {
+        recolor_row(image_row(image, i), image->width, options);
+    }
+
+    return 0;
+}
+
+// Reflect one row
+static void reflect_row(RGBQUAD *row, int width, const OPTIONS *options)
+{
+    // Initialize two pointers for the start and end of the current row
+    int start = 0;
+    int end = width - 1;
+
+    // Swap pixels from the start and end, moving towards the center of the row
+    while (start < end)
+    {
+        // Temporarily store the pixel at the start position
+        RGBQUAD temp = row[start];
+        
+        // Swap the pixel at the start position with the pixel at the end position
+        row[start] = row[end];
+        row[end] = temp;
+
+        // Move the start pointer right and the end pointer left
+        start++;
+        end--;
     }
 }
 
 // Reflect image horizontally
 // Mirrors the image horizontally by swapping pixels from the left side with those on the right side of each row.
-void reflect(int height, int width, RGBTRIPLE image[height][width])
+int reflect(IMAGE *image, const HALO *halo, const OPTIONS *options)
 {
     // Iterate over each row of the image
-    for (int i = 0; i < height; i++)
+    for (int i = 0; i < image->height; i++)
+    {
+        reflect_row(image_row(image, i), image->width, options);
+    }
+
+    return 0;
+}
+
+// Bytes in a huge page, which the rows of images at least that large are aligned to
+#define HUGE_PAGE (2 * 1024 * 1024)
+
+BYTE *alloc_rows(size_t size)
+{
+    // aligned_alloc() wants a whole number of alignments, and at least one
+    size_t alignment = size >= HUGE_PAGE ? HUGE_PAGE : ROW_ALIGNMENT;
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    BYTE *rows = aligned_alloc(alignment, rounded > 0 ? rounded : alignment);
+
+    // A large image is read into rows that nothing has touched yet, and on huge pages (where the kernel allows
+    // them) that takes one page fault every 2 MB instead of every 4 KB
+#ifdef MADV_HUGEPAGE
+    if (rows != NULL && alignment == HUGE_PAGE)
+    {
+        madvise(rows, rounded, MADV_HUGEPAGE);
+    }
+#endif
+    return rows;
+}
+
+void turn(ORIENTATION *orientation, int transpose, int mirror, int flip)
+{
+    // Transposing swaps the axes, so a reflection done before it is a flip after it, and the other way around
+    if (transpose)
+    {
+        int mirrored = orientation->mirror;
+        orientation->mirror = orientation->flip;
+        orientation->flip = mirrored;
+        orientation->transpose ^= 1;
+    }
+    orientation->mirror ^= mirror;
+    orientation->flip ^= flip;
+}
+
+// How each of the transforms turns an image: reflecting swaps left and right, flipping swaps top and bottom, and
+// rotating clockwise by 90 degrees is transposing and then reflecting (by 270, transposing and then flipping)
+static void orient_reflect(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, 0, 1, 0);
+}
+static void orient_flip(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, 0, 0, 1);
+}
+static void orient_transpose(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, 1, 0, 0);
+}
+static void orient_rotate(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, options->degrees != 180, options->degrees != 270, options->degrees != 90);
+}
+
+// Run a list of fused point filters on a row, in the order they were chained
+static void run_steps(const STEP *const *steps, int count, RGBQUAD *row, int width)
+{
+    for (int k = 0; k < count; k++)
+    {
+        steps[k]->filter->row(row, width, &steps[k]->options);
+    }
+}
+
+void load_row(const OPTIONS *options, RGBQUAD *row, int width)
+{
+    if (options->fusion != NULL)
+    {
+        run_steps(options->fusion->loads, options->fusion->load_count, row, width);
+    }
+}
+
+void store_row(const OPTIONS *options, RGBQUAD *row, int width)
+{
+    if (options->fusion != NULL)
+    {
+        run_steps(options->fusion->stores, options->fusion->store_count, row, width);
+    }
+}
+
+// Run only the point filters fused into a pass
+// Every point filter in a chain is applied to one row before moving to the next, while the row is in cache
+int points(IMAGE *image, const HALO *halo, const OPTIONS *options)
+{
+    for (int i = 0; i < image->height; i++)
+    {
+        load_row(options, image_row(image, i), image->width);
+    }
+
+    return 0;
+}
+
+// Get source row x of a band the first time the pass reads it, running the loads fused into the pass on it
+// if it is one of the band's own rows (halo rows had them when they were copied)
+static const RGBQUAD *first_read(IMAGE *image, const HALO *halo, const OPTIONS *options, int x)
+{
+    if (x >= 0 && x < image->height)
     {
-        // Initialize two pointers for the start and end of the current row
-        int start = 0;
-        int end = width - 1;
+        load_row(options, image_row(image, x), image->width);
+    }
+    return source_row(image, halo, x);
+}
 
-        // Swap pixels from the start and end, moving towards the center of the row
-        while (start < end)
+// Sum each pixel's row neighbours within radius columns of it (3 sums per pixel: blue, green, red)
+// A running sum is kept while moving along the row, so the cost does not depend on the radius
+static void sum_row(const RGBQUAD *row, int width, int radius, int *sums)
+{
+    int sumRed = 0, sumGreen = 0, sumBlue = 0;
+
+    // Start with the pixels around the first column
+    for (int y = 0; y < radius && y < width; y++)
+    {
+        sumRed += row[y].rgbRed;
+        sumGreen += row[y].rgbGreen;
+        sumBlue += row[y].rgbBlue;
+    }
+
+    for (int j = 0; j < width; j++)
+    {
+        // Add the pixel entering the neighborhood on the right, and remove the one leaving it on the left
+        if (j + radius < width)
         {
-            // Temporarily store the pixel at the start position
-            RGBTRIPLE temp = image[i][start];
-            
-            // Swap the pixel at the start position with the pixel at the end position
-            image[i][start] = image[i][end];
-            image[i][end] = temp;
-
-            // Move the start pointer right and the end pointer left
-            start++;
-            end--;
+            sumRed += row[j + radius].rgbRed;
+            sumGreen += row[j + radius].rgbGreen;
+            sumBlue += row[j + radius].rgbBlue;
         }
+        if (j - radius - 1 >= 0)
+        {
+            sumRed -= row[j - radius - 1].rgbRed;
+            sumGreen -= row[j - radius - 1].rgbGreen;
+            sumBlue -= row[j - radius - 1].rgbBlue;
+        }
+
+        sums[3 * j] = sumBlue;
+        sums[3 * j + 1] = sumGreen;
+        sums[3 * j + 2] = sumRed;
     }
 }
 
 // Blur image
-// Applies a blur effect to the image by averaging the colors of neighboring pixels in a 3x3 grid.
-void blur(int height, int width, RGBTRIPLE image[height][width])
+// Applies a box blur to the image by averaging the colors of neighboring pixels in a square around each pixel,
+// radius pixels in every direction (a 3x3 grid for the default radius of 1).
+// The square is separable: each source row is summed horizontally once, and those row sums are added up vertically.
+// Both sums slide along with running totals, so a pixel costs the same however large the radius is.
+int blur(IMAGE *image, const HALO *halo, const OPTIONS *options)
 {
-    // Create a temporary copy of the image to store original pixel values
-    // This prevents modifying pixels while calculating the blur effect
-    RGBTRIPLE temp[height][width];
-    for (int i = 0; i < height; i++)
+    int height = image->height;
+    int width = image->width;
+    int radius = options->radius;
+
+    // Source rows run from top to bottom - 1, including the band's halo (none when the band is the whole image)
+    int top = halo != NULL ? -halo->above : 0;
+    int bottom = height + (halo != NULL ? halo->below : 0);
+
+    // Keep the row sums of the 2 * radius + 1 rows around the current row in a ring, and add them up per column
+    // This is all the memory the blur needs, so it never copies the image
+    int window = 2 * radius + 1;
+    int *ring = scratch(SCRATCH_RING, (size_t) window * width * 3 * sizeof(int));
+    int *totals = scratch(SCRATCH_TOTALS, (size_t) width * 3 * sizeof(int));
+    if (ring == NULL || totals == NULL)
     {
-        for (int j = 0; j < width; j++)
+        return 1;
+    }
+    memset(totals, 0, (size_t) width * 3 * sizeof(int));
+
+    // Start with the rows around the first row (row x lives in slot (x + window) % window of the ring)
+    for (int x = top; x < radius && x < bottom; x++)
+    {
+        int *sums = ring + (size_t) ((x + window) % window) * width * 3;
+        sum_row(first_read(image, halo, options, x), width, radius, sums);
+        for (int k = 0; k < width * 3; k++)
         {
-            // Copy each pixel from the original image to the temporary image
-            temp[i][j] = image[i][j];
+            totals[k] += sums[k];
         }
     }
 
     // Iterate over each row of the image
     for (int i = 0; i < height; i++)
     {
-        // Iterate over each column of the image
-        for (int j = 0; j < width; j++)
+        // Slide the window down a row: remove the row leaving it at the top, and add the row entering it at the bottom
+        // The entering row is read before row i is written, so the band can be blurred in place
+        int *sums = ring + (size_t) ((i + radius) % window) * width * 3;
+        if (i - radius - 1 >= top)
         {
-            // Initialize variables to accumulate the sum of color values and count the number of pixels considered
-            int sumRed = 0, sumGreen = 0, sumBlue = 0;
-            int count = 0;
-
-            // Iterate over the neighboring pixels within a 3x3 grid centered around the current pixel
-            // This covers the pixel itself and its 8 neighbors
-            for (int x = i - 1; x <= i + 1; x++)
+            for (int k = 0; k < width * 3; k++)
             {
-                for (int y = j - 1; y <= j + 1; y++)
-                {
-                    // Check if the neighboring pixel is within the image boundaries
-                    if (x >= 0 && x < height && y >= 0 && y < width)
-                    {
-                        // Accumulate the color values of the neighboring pixel
-                        sumRed += temp[x][y].rgbtRed;
-                        sumGreen += temp[x][y].rgbtGreen;
-                        sumBlue += temp[x][y].rgbtBlue;
-                        count++;
-                    }
-                }
+                totals[k] -= sums[k];
             }
+        }
+        if (i + radius < bottom)
+        {
+            sum_row(first_read(image, halo, options, i + radius), width, radius, sums);
+            for (int k = 0; k < width * 3; k++)
+            {
+                totals[k] += sums[k];
+            }
+        }
 
-            // Compute the average color values for the current pixel and update its color
-            // Casting `count` to `float` ensures accurate division
-            image[i][j].rgbtRed = round((float)sumRed / count);
-            image[i][j].rgbtGreen = round((float)sumGreen / count);
-            image[i][j].rgbtBlue = round((float)sumBlue / count);
+        // Count the rows of the square that are inside the image
+        int rows = (i + radius < bottom ? i + radius : bottom - 1) - (i - radius > top ? i - radius : top) + 1;
+
+        RGBQUAD *row = image_row(image, i);
+
+        // Iterate over each column of the image
+        for (int j = 0; j < width; j++)
+        {
+            // Only the neighboring pixels within the image boundaries are averaged
+            int columns = (j + radius < width ? j + radius : width - 1) - (j - radius > 0 ? j - radius : 0) + 1;
+            int count = rows * columns;
+
+            // Compute the average color values for the current pixel, rounding halves up
+            // (exactly what rounding the floating-point average would give)
+            row[j].rgbBlue = (totals[3 * j] + count / 2) / count;
+            row[j].rgbGreen = (totals[3 * j + 1] + count / 2) / count;
+            row[j].rgbRed = (totals[3 * j + 2] + count / 2) / count;
         }
+        store_row(options, row, width);
+    }
+    return 0;
+}
+
+// Read the radius of a blur, e.g. the 5 of -b 5
+static int parse_radius(const char *text, OPTIONS *options)
+{
+    char *end;
+    long radius = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || radius < 1 || radius > MAX_RADIUS)
+    {
+        return 0;
     }
+    options->radius = radius;
+    return 1;
 }
+
+// Read a color matrix, e.g. the sepia of -m sepia
+static int parse_colors(const char *text, OPTIONS *options)
+{
+    return parse_matrix(text, &options->matrix);
+}
+
+// Read the angle of a rotation, which must be a quarter turn (or two, or three)
+static int parse_degrees(const char *text, OPTIONS *options)
+{
+    char *end;
+    long degrees = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || (degrees != 90 && degrees != 180 && degrees != 270))
+    {
+        return 0;
+    }
+    options->degrees = degrees;
+    return 1;
+}
+
+// Blurs need as many rows of context as their radius
+static int radius_halo(const OPTIONS *options)
+{
+    return options->radius;
+}
+
+// Settings used unless the command line says otherwise
+const OPTIONS DEFAULT_OPTIONS = {.radius = 1, .matrix = {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}, 1},
+                                 .degrees = 90};
+
+// The filters, with the arguments they take and the rows of context they need around a band
+// (every one of them commutes with reflecting, flipping, rotating and transposing the image, since none treats
+// one direction differently from another)
+const FILTER FILTERS[] =
+{
+    {.flag = 'b', .name = "blur", .parse = parse_radius, .halo = radius_halo, .apply = blur, .symmetric = 1},
+    {.flag = 'g', .name = "grayscale", .apply = grayscale, .row = grayscale_row, .symmetric = 1},
+    {.flag = 'm', .name = "matrix", .parse = parse_colors, .apply = recolor, .row = recolor_row, .symmetric = 1},
+    {.flag = 'r', .name = "reflect", .apply = reflect, .row = reflect_row, .orient = orient_reflect, .symmetric = 1},
+    {.flag = 's', .name = "sepia", .apply = sepia, .row = sepia_row, .symmetric = 1},
+    {.flag = 't', .name = "transpose", .orient = orient_transpose, .symmetric = 1},
+    {.flag = 'v', .name = "flip", .orient = orient_flip, .symmetric = 1},
+    {.flag = 'R', .name = "rotate", .parse = parse_degrees, .orient = orient_rotate, .symmetric = 1},
+    {0}
+};
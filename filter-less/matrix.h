@@ -0,0 +1,43 @@
+// Color matrices: filters that set each channel of a pixel to a weighted sum of the pixel's red, green and blue,
+// plus an offset (e.g., grayscale, sepia, saturation or brightness)
+
+#ifndef MATRIX_H
+#define MATRIX_H
+
+#include "bmp.h"
+
+// Largest weight and offset a matrix may have, which keeps every sum within 32 bits
+#define MAX_WEIGHT 100
+#define MAX_OFFSET 255
+
+// A 3x4 color matrix: its rows give the new red, green and blue, and its columns weigh the old red, green and
+// blue, then add an offset. Results are rounded (halves away from zero) and clamped to 0..255. The weights are
+// kept as exact fractions over a common denominator, so that the vector code can compute them in integers, and
+// results are exact, but for the grayscale and sepia presets (see doubles)
+typedef struct
+{
+    int numerators[3][4];
+    int denominator;
+    int doubles;  // Whether results that are exactly halfway are rounded as they are with the weights in doubles,
+                  // which are not exact and can land either side of the half, as grayscale and sepia always were
+} MATRIX;
+
+// Grayscale (the average of the three channels) and sepia, exactly as the filters have always computed them,
+// and the matrix that changes nothing
+extern const MATRIX GRAYSCALE_MATRIX;
+extern const MATRIX SEPIA_MATRIX;
+extern const MATRIX IDENTITY_MATRIX;
+
+// Read a matrix given on the command line, returning 0 if text is not one. It is either a preset:
+//   grayscale, sepia, swap-rb, swap-rg or swap-gb (exchanging two channels),
+//   saturate=F (F from 0 for gray to 10; 1 changes nothing) or brightness=N (adding N from -255 to 255),
+// or the 12 numbers of the matrix, row by row, separated by commas (with up to 4 decimal places)
+int parse_matrix(const char *text, MATRIX *matrix);
+
+// Apply a matrix to one pixel
+void matrix_pixel(RGBQUAD *pixel, const MATRIX *matrix);
+
+// Apply a matrix to a row of pixels
+void matrix_row(RGBQUAD *row, int width, const MATRIX *matrix);
+
+#endif
@@ -0,0 +1,27 @@
+// A pool of worker threads for running independent tasks in parallel
+
+#ifndef POOL_H
+#define POOL_H
+
+// A task is called once for every index in [0, count) of a run, told which of the pool's threads
+// (numbered from 0, the caller's) it is running on, so that it can keep state for each thread
+typedef void (*TASK)(void *arg, int index, int thread);
+
+typedef struct POOL POOL;
+
+// Start a pool that runs tasks on the given number of threads (including the caller's);
+// 0 means one thread per online CPU, and 1 means tasks simply run on the calling thread
+POOL *pool_create(int threads);
+
+// Number of threads that tasks run on, including the caller's
+int pool_threads(const POOL *pool);
+
+// Run task(arg, index, thread) for every index in [0, count), returning once they have all finished
+// Each thread starts with an even share of the indices, and a thread that runs out steals half of
+// what another has left, so uneven tasks still keep every thread busy
+void pool_run(POOL *pool, int count, TASK task, void *arg);
+
+// Stop the pool's threads and free it
+void pool_destroy(POOL *pool);
+
+#endif
@@ -0,0 +1,25 @@
+// Scratch memory for the filters, which each thread keeps from one image to the next, so that filtering many
+// images (--batch, or --serve) allocates it once per thread rather than once per image
+
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <stddef.h>
+
+// What each of a thread's buffers is for; a thread has one of each
+typedef enum
+{
+    SCRATCH_HALOS,    // Copies of the rows around each band (bands.c)
+    SCRATCH_RING,     // A blur's row sums, and the totals of their columns
+    SCRATCH_TOTALS,
+    SCRATCH_SLOTS
+} SCRATCH;
+
+// Get the calling thread's buffer for a use, at least size bytes long, growing it if it is smaller; returns NULL
+// if there is no memory. Whatever the last user left in it is still there
+void *scratch(SCRATCH slot, size_t size);
+
+// Free the calling thread's buffers; every thread that filters calls this before it exits
+void scratch_release(void);
+
+#endif
@@ -0,0 +1,27 @@
+// Vectorized versions of the per-pixel color filters, and of the conversions between the pixels of 24-bit files
+// and pixels in memory, for CPUs that support them
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include "bmp.h"
+#include "matrix.h"
+
+// Each function converts as many pixels from the start of a row as it can with vector
+// instructions and returns how many it converted; the caller finishes the rest of the row.
+// Results are identical to the scalar code, rounding included.
+
+// Apply a color matrix to the start of a row (none of it, if the matrix's weights are too
+// large for 16 bits), converting pixels the vector code cannot round exactly the same way
+// with matrix_pixel()
+int matrix_simd(RGBQUAD *row, int width, const MATRIX *matrix);
+
+// Spread the 3-byte pixels of a 24-bit scanline out into 4-byte pixels in memory, with zero fourth bytes;
+// returns how many pixels it did
+int expand_simd(const BYTE *in, RGBQUAD *out, int width);
+
+// Pack 4-byte pixels in memory into the 3-byte pixels of a 24-bit scanline, reflecting the row on the way if
+// mirror is set (so that out's first pixels come from the end of in); returns how many pixels of out it did
+int pack_simd(const RGBQUAD *in, BYTE *out, int width, int mirror);
+
+#endif
@@ -0,0 +1,20 @@
+// Streaming a BMP file through a chain of filters a strip of rows at a time, for images too large to hold in memory
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+#include "bmpio.h"
+#include "chain.h"
+#include "pool.h"
+#include "stats.h"
+
+// Read the BMP file in inptr a strip of rows at a time, run each strip through the passes of a compiled
+// chain as soon as the rows below it have been through the pass before, and write it to output straight
+// away. Reading, filtering and writing run on their own threads, so I/O overlaps with compute, and only a
+// few strips per pass are ever in memory. The output is identical to filtering the whole image at once.
+// Each stage is timed into stats, unless it is NULL. The chain may reflect the image, but not flip or transpose it.
+BMPSTATUS stream_filter(FILE *inptr, WRITER *output, const CHAIN *chain, int rows, POOL *pool, STATS *stats);
+
+#endif
@@ -0,0 +1,392 @@
+#define _GNU_SOURCE  // For pwritev(), fseeko(), copy_file_range(), MAP_POPULATE and syscall()
+
+#include <errno.h>       // For EINTR
+#include <stdatomic.h>   // For the ring's head and tail indices, shared with the kernel
+#include <stdlib.h>      // For calloc(), malloc() and free()
+#include <string.h>      // For memcpy() and memset()
+#include <sys/mman.h>    // For mapping the ring
+#include <unistd.h>      // For lseek(), close(), syscall() and copy_file_range()
+
+#ifdef __linux__
+#include <linux/io_uring.h>  // For the io_uring interface
+#include <sys/syscall.h>     // For SYS_io_uring_setup and SYS_io_uring_enter
+#endif
+
+#include "writer.h"
+
+// Writes an io_uring keeps in flight at once
+#define DEPTH 8
+
+// Bytes copied through memory at a time, when the kernel cannot copy them itself
+#define COPY_BYTES (256 * 1024)
+
+// A queued write, remembered until it is done, so that a short one can be finished off
+typedef struct
+{
+    long ticket;                        // 0 for a free slot
+    struct iovec pieces[MAX_PIECES];
+    int count;
+    off_t offset;
+} SLOT;
+
+struct WRITER
+{
+    FILE *outptr;
+    int fd;
+    off_t offset;    // Where the next write goes, or -1 for outputs that are written in order (e.g., pipes)
+    long tickets;    // Tickets handed out so far
+    int failed;      // Whether any write failed
+    int ring;        // The io_uring's file descriptor, or -1 when writes are made there and then
+#ifdef __linux__
+    // The submission queue, its entries, and the completion queue, all shared with the kernel
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_length, cq_length, sqes_length;
+
+    SLOT slots[DEPTH];
+    int pending;     // Slots in use
+#endif
+};
+
+// Drop bytes from the front of some pieces of memory
+static void skip(struct iovec **pieces, int *count, size_t bytes)
+{
+    while (*count > 0 && bytes >= (*pieces)->iov_len)
+    {
+        bytes -= (*pieces)->iov_len;
+        (*pieces)++;
+        (*count)--;
+    }
+    if (*count > 0)
+    {
+        (*pieces)->iov_base = (char *) (*pieces)->iov_base + bytes;
+        (*pieces)->iov_len -= bytes;
+    }
+}
+
+// Write all of some pieces at an offset (or in order, for -1), carrying on after short writes; returns 0 on success
+static int write_fully(int fd, struct iovec *pieces, int count, off_t offset)
+{
+    skip(&pieces, &count, 0);
+    while (count > 0)
+    {
+        ssize_t written = offset >= 0 ? pwritev(fd, pieces, count, offset) : writev(fd, pieces, count);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            return 1;
+        }
+        if (offset >= 0)
+        {
+            offset += written;
+        }
+        skip(&pieces, &count, written);
+    }
+    return 0;
+}
+
+#ifdef __linux__
+
+// Set up an io_uring for a writer, mapping its queues; returns 0 on success
+static int ring_setup(WRITER *writer)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = syscall(SYS_io_uring_setup, DEPTH, &params);
+    if (ring < 0)
+    {
+        return 1;
+    }
+
+    writer->sq_length = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    writer->cq_length = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    writer->sqes_length = params.sq_entries * sizeof(struct io_uring_sqe);
+    int flags = MAP_SHARED | MAP_POPULATE;
+    writer->sq_map = mmap(NULL, writer->sq_length, PROT_READ | PROT_WRITE, flags, ring, IORING_OFF_SQ_RING);
+    writer->cq_map = mmap(NULL, writer->cq_length, PROT_READ | PROT_WRITE, flags, ring, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, writer->sqes_length, PROT_READ | PROT_WRITE, flags, ring, IORING_OFF_SQES);
+    if (writer->sq_map == MAP_FAILED || writer->cq_map == MAP_FAILED || sqes == MAP_FAILED)
+    {
+        if (writer->sq_map != MAP_FAILED)
+        {
+            munmap(writer->sq_map, writer->sq_length);
+        }
+        if (writer->cq_map != MAP_FAILED)
+        {
+            munmap(writer->cq_map, writer->cq_length);
+        }
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, writer->sqes_length);
+        }
+        close(ring);
+        return 1;
+    }
+
+    char *sq = writer->sq_map;
+    char *cq = writer->cq_map;
+    writer->sq_head = (_Atomic unsigned *) (sq + params.sq_off.head);
+    writer->sq_tail = (_Atomic unsigned *) (sq + params.sq_off.tail);
+    writer->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+    writer->sq_array = (unsigned *) (sq + params.sq_off.array);
+    writer->sqes = sqes;
+    writer->cq_head = (_Atomic unsigned *) (cq + params.cq_off.head);
+    writer->cq_tail = (_Atomic unsigned *) (cq + params.cq_off.tail);
+    writer->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+    writer->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    writer->ring = ring;
+    return 0;
+}
+
+// Hand a slot's write to the kernel, or, if the kernel will not take it, make the write there and then and free
+// the slot
+static void ring_submit(WRITER *writer, SLOT *slot)
+{
+    // Only this thread moves the tail, and the kernel only reads the entry once the tail has moved past it
+    unsigned tail = atomic_load_explicit(writer->sq_tail, memory_order_relaxed);
+    unsigned index = tail & *writer->sq_mask;
+    struct io_uring_sqe *sqe = &writer->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = writer->fd;
+    sqe->addr = (unsigned long) slot->pieces;
+    sqe->len = slot->count;
+    sqe->off = slot->offset;
+    sqe->user_data = slot - writer->slots;
+    writer->sq_array[index] = index;
+    atomic_store_explicit(writer->sq_tail, tail + 1, memory_order_release);
+
+    int submitted;
+    do
+    {
+        submitted = syscall(SYS_io_uring_enter, writer->ring, 1, 0, 0, NULL, 0);
+    }
+    while (submitted < 0 && errno == EINTR);
+
+    // Without a polling thread, the kernel only takes entries during io_uring_enter(), so one it has not taken by
+    // now never will be, and can be withdrawn (otherwise it is in flight, and is reaped like any other)
+    if (submitted != 1 && atomic_load_explicit(writer->sq_head, memory_order_acquire) == tail)
+    {
+        atomic_store_explicit(writer->sq_tail, tail, memory_order_release);
+        if (write_fully(writer->fd, slot->pieces, slot->count, slot->offset) != 0)
+        {
+            writer->failed = 1;
+        }
+        slot->ticket = 0;
+        writer->pending--;
+    }
+}
+
+// Finish off the writes the kernel has completed, first waiting for at least one if wait is set
+static void ring_reap(WRITER *writer, int wait)
+{
+    if (wait)
+    {
+        syscall(SYS_io_uring_enter, writer->ring, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+
+    unsigned head = atomic_load_explicit(writer->cq_head, memory_order_relaxed);
+    while (head != atomic_load_explicit(writer->cq_tail, memory_order_acquire))
+    {
+        struct io_uring_cqe *cqe = &writer->cqes[head & *writer->cq_mask];
+        SLOT *slot = &writer->slots[cqe->user_data];
+
+        // A failed write is a failure, and a short one is finished there and then (which fails in turn if whatever
+        // stopped it, like a full disk, still does)
+        struct iovec *pieces = slot->pieces;
+        int count = slot->count;
+        if (cqe->res < 0)
+        {
+            writer->failed = 1;
+        }
+        else
+        {
+            skip(&pieces, &count, cqe->res);
+            if (count > 0 && write_fully(writer->fd, pieces, count, slot->offset + cqe->res) != 0)
+            {
+                writer->failed = 1;
+            }
+        }
+
+        slot->ticket = 0;
+        writer->pending--;
+        head++;
+    }
+    atomic_store_explicit(writer->cq_head, head, memory_order_release);
+}
+
+#endif
+
+WRITER *writer_open(FILE *outptr, int async)
+{
+    WRITER *writer = calloc(1, sizeof(WRITER));
+    if (writer == NULL)
+    {
+        return NULL;
+    }
+    fflush(outptr);
+    writer->outptr = outptr;
+    writer->fd = fileno(outptr);
+    writer->offset = lseek(writer->fd, 0, SEEK_CUR);
+    writer->ring = -1;
+#ifdef __linux__
+    if (async && writer->offset >= 0 && ring_setup(writer) != 0)
+    {
+        writer->ring = -1;
+    }
+#endif
+    return writer;
+}
+
+int writer_async(const WRITER *writer)
+{
+    return writer->ring >= 0;
+}
+
+long writer_write(WRITER *writer, const struct iovec *pieces, int count)
+{
+    long ticket = ++writer->tickets;
+    off_t offset = writer->offset;
+    if (writer->offset >= 0)
+    {
+        for (int k = 0; k < count; k++)
+        {
+            writer->offset += pieces[k].iov_len;
+        }
+    }
+
+#ifdef __linux__
+    // Queue the write in a free slot, waiting for one if they are all in flight
+    if (writer->ring >= 0)
+    {
+        while (writer->pending == DEPTH)
+        {
+            ring_reap(writer, 1);
+        }
+        SLOT *slot = writer->slots;
+        while (slot->ticket != 0)
+        {
+            slot++;
+        }
+        memcpy(slot->pieces, pieces, count * sizeof(struct iovec));
+        slot->count = count;
+        slot->offset = offset;
+        slot->ticket = ticket;
+        writer->pending++;
+        ring_submit(writer, slot);
+        return ticket;
+    }
+#endif
+
+    struct iovec copy[MAX_PIECES];
+    memcpy(copy, pieces, count * sizeof(struct iovec));
+    if (write_fully(writer->fd, copy, count, offset) != 0)
+    {
+        writer->failed = 1;
+    }
+    return ticket;
+}
+
+void writer_wait(WRITER *writer, long ticket)
+{
+#ifdef __linux__
+    // Writes can finish out of order, so wait until no slot holds this one or any before it
+    while (writer->ring >= 0)
+    {
+        int waiting = 0;
+        for (int s = 0; s < DEPTH; s++)
+        {
+            waiting |= writer->slots[s].ticket != 0 && writer->slots[s].ticket <= ticket;
+        }
+        if (!waiting)
+        {
+            break;
+        }
+        ring_reap(writer, 1);
+    }
+#endif
+}
+
+int writer_copy(WRITER *writer, FILE *inptr, size_t length)
+{
+    // Every queued write must land first, since the copy is not queued
+    writer_wait(writer, writer->tickets);
+
+    // The input's position is where stdio has got to, which may be behind the file descriptor's, so copy from
+    // there at an offset, and move stdio on past what was copied (which also drops what it had buffered)
+#ifdef __linux__
+    off_t from = ftello(inptr);
+    if (writer->offset >= 0 && from >= 0)
+    {
+        off_t to = writer->offset;
+        while (length > 0)
+        {
+            ssize_t copied = copy_file_range(fileno(inptr), &from, writer->fd, &to, length, 0);
+            if (copied < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (copied <= 0)
+            {
+                break;
+            }
+            length -= copied;
+        }
+        writer->offset = to;
+        fseeko(inptr, from, SEEK_SET);
+    }
+#endif
+
+    // Whatever is left (all of it, for pipes or where the file systems cannot copy between them) is read and written
+    // a buffer at a time, with zeros where the input runs out
+    char *buffer = length > 0 ? malloc(COPY_BYTES) : NULL;
+    if (length > 0 && buffer == NULL)
+    {
+        return 1;
+    }
+    while (length > 0)
+    {
+        size_t chunk = length < COPY_BYTES ? length : COPY_BYTES;
+        size_t got = fread(buffer, 1, chunk, inptr);
+        memset(buffer + got, 0x00, chunk - got);
+        struct iovec piece = {buffer, chunk};
+        writer_wait(writer, writer_write(writer, &piece, 1));
+        length -= chunk;
+    }
+    free(buffer);
+    return 0;
+}
+
+int writer_close(WRITER *writer)
+{
+    writer_wait(writer, writer->tickets);
+#ifdef __linux__
+    if (writer->ring >= 0)
+    {
+        munmap(writer->sq_map, writer->sq_length);
+        munmap(writer->cq_map, writer->cq_length);
+        munmap(writer->sqes, writer->sqes_length);
+        close(writer->ring);
+    }
+#endif
+
+    // The file descriptor was written at offsets, so tell stdio where it now stands
+    if (writer->offset >= 0)
+    {
+        fseeko(writer->outptr, writer->offset, SEEK_SET);
+    }
+    int failed = writer->failed;
+    free(writer);
+    return failed;
+}
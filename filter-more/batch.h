@@ -0,0 +1,30 @@
+// Filtering every BMP file in a directory in one run, for large numbers of small images
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+
+#include "chain.h"
+#include "pool.h"
+
+// What a batch did, for its summary
+typedef struct
+{
+    int images;      // Images filtered
+    int failed;      // Images that could not be filtered
+    size_t bytes;    // Bytes of the files filtered
+    double seconds;  // Wall-clock time, from listing the directory to writing the last image
+} BATCHSTATS;
+
+// Filter every .bmp file in indir through a compiled chain into a file of the same name in outdir (which is
+// created if it does not exist). Each image is filtered whole on one of the pool's threads, which take images
+// from each other when they run out, and each thread reuses its pixel buffer from one image to the next.
+// With rows > 0, each image is streamed through the chain that many rows at a time instead, and with async set,
+// the writes of each image are queued on an io_uring (see writer.h). Problems with single images are reported
+// as they happen. Returns 0 if every image was filtered, or else the exit code that the
+// first failure (in name order) would have had on its own
+int batch_filter(const char *indir, const char *outdir, const CHAIN *chain, int rows, int async, POOL *pool,
+                 BATCHSTATS *stats);
+
+#endif
@@ -0,0 +1,246 @@
+// Benchmark every filter on synthetic images of several sizes, and on any BMP files named on the command
+// line, printing the timings as JSON so that runs of different versions can be compared
+// Usage: ./bench [-j threads] [-n repeats] [-b radius] [-s megapixels,...] [image.bmp ...]
+
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime()
+
+#include <getopt.h>  // For command-line option parsing
+#include <math.h>    // For sqrt() and ceil()
+#include <stdio.h>   // For printing the results
+#include <stdlib.h>  // For malloc(), qsort(), strtod() and atoi()
+#include <string.h>  // For memcpy()
+#include <time.h>    // For clock_gettime()
+
+#include "bands.h"
+#include "bmpio.h"
+#include "helpers.h"
+#include "pool.h"
+
+// Sizes of the synthetic images, in megapixels, and how many times each filter runs on each image
+#define DEFAULT_SIZES "1,4,16,100"
+#define DEFAULT_REPEATS 9
+
+// Seconds since some fixed point, for timing
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Fill an image with reproducible pixels: smooth gradients with noise on top, so that no filter gets an
+// unrealistically easy ride (e.g., from runs of identical pixels)
+static void synthesize(IMAGE *image)
+{
+    unsigned state = 2463534242u;
+    for (int i = 0; i < image->height; i++)
+    {
+        RGBQUAD *row = image_row(image, i);
+        for (int j = 0; j < image->width; j++)
+        {
+            // A xorshift generator supplies the noise
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            row[j].rgbRed = (j * 255 / image->width + (state & 63)) & 0xff;
+            row[j].rgbGreen = (i * 255 / image->height + (state >> 8 & 63)) & 0xff;
+            row[j].rgbBlue = ((i + j) & 0xff) ^ (state >> 16 & 31);
+            row[j].rgbReserved = 0;
+        }
+    }
+}
+
+// Compare two times for qsort()
+static int by_time(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Print a string as a JSON string literal
+static void print_string(const char *text)
+{
+    putchar('"');
+    for (const char *c = text; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+        {
+            putchar('\\');
+        }
+        putchar(*c);
+    }
+    putchar('"');
+}
+
+// Run every filter on an image, repeats times each, starting from the same pixels every time, and print one
+// JSON result per filter. Returns 1 if a filter ran out of memory
+static int benchmark(const char *name, const IMAGE *pristine, const OPTIONS *options, int repeats, POOL *pool,
+                     int *results)
+{
+    size_t length = pristine->stride * pristine->height;
+    IMAGE work = *pristine;
+    work.data = alloc_rows(length);
+    double *times = malloc(repeats * sizeof(double));
+    if (work.data == NULL || times == NULL)
+    {
+        free(work.data);
+        free(times);
+        return 1;
+    }
+
+    double megapixels = (double) pristine->width * pristine->height / 1e6;
+    for (const FILTER *filter = FILTERS; filter->flag != 0; filter++)
+    {
+        // Flips, rotations and transposes happen as the image is written, so there is nothing to time here
+        if (filter->apply == NULL && filter->whole == NULL)
+        {
+            continue;
+        }
+
+        // One untimed run warms up the caches and the pool's threads
+        for (int r = -1; r < repeats; r++)
+        {
+            memcpy(work.data, pristine->data, length);
+            double start = now();
+            if (apply_filter(filter, options, &work, NULL, pool) != 0)
+            {
+                free(work.data);
+                free(times);
+                return 1;
+            }
+            if (r >= 0)
+            {
+                times[r] = now() - start;
+            }
+        }
+
+        // The median is the middle time (or the mean of the middle two), and p99 the time that 99% of runs beat
+        qsort(times, repeats, sizeof(double), by_time);
+        double median = repeats % 2 ? times[repeats / 2] : (times[repeats / 2 - 1] + times[repeats / 2]) / 2;
+        double p99 = times[(int) ceil(0.99 * repeats) - 1];
+
+        printf("%s\n    {\"image\": ", (*results)++ > 0 ? "," : "");
+        print_string(name);
+        printf(", \"width\": %d, \"height\": %d, \"filter\": \"%s\", \"median_ms\": %.3f, \"p99_ms\": %.3f, "
+               "\"megapixels_per_s\": %.1f}",
+               pristine->width, pristine->height, filter->name, median * 1e3, p99 * 1e3, megapixels / median);
+        fprintf(stderr, "%-12s %-24s %10.3f ms %10.1f MP/s\n", filter->name, name, median * 1e3, megapixels / median);
+    }
+
+    free(work.data);
+    free(times);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 1;
+    int repeats = DEFAULT_REPEATS;
+    const char *sizes = DEFAULT_SIZES;
+    OPTIONS options = DEFAULT_OPTIONS;
+    int option;
+    while ((option = getopt(argc, argv, "j:n:b:s:")) != -1)
+    {
+        if (option == 'j')
+        {
+            threads = atoi(optarg);
+        }
+        else if (option == 'n')
+        {
+            repeats = atoi(optarg);
+        }
+        else if (option == 'b' && find_filter('b') != NULL && find_filter('b')->parse(optarg, &options))
+        {
+            continue;
+        }
+        else if (option == 's')
+        {
+            sizes = optarg;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: ./bench [-j threads] [-n repeats] [-b radius] [-s megapixels,...] [image.bmp ...]\n");
+            return 3;
+        }
+    }
+    if (repeats < 1 || threads < 0)
+    {
+        fprintf(stderr, "Invalid option.\n");
+        return 1;
+    }
+
+    POOL *pool = pool_create(threads);
+    if (pool == NULL)
+    {
+        fprintf(stderr, "Not enough memory to start threads.\n");
+        return 7;
+    }
+
+    printf("{\n  \"threads\": %d,\n  \"repeats\": %d,\n  \"blur_radius\": %d,\n  \"results\": [",
+           pool_threads(pool), repeats, options.radius);
+    int results = 0;
+    int failed = 0;
+
+    // Synthetic images are close to square, with an odd width so that their rows are padded like most real ones
+    for (const char *size = sizes; !failed; size++)
+    {
+        char *end;
+        double megapixels = strtod(size, &end);
+        if (end == size || megapixels <= 0)
+        {
+            break;
+        }
+
+        IMAGE image;
+        image.width = (int) sqrt(megapixels * 1e6) | 1;
+        image.height = (int) (megapixels * 1e6 / image.width);
+        image.stride = row_stride(image.width);
+        image.data = alloc_rows(image.stride * image.height);
+        if (image.data == NULL)
+        {
+            failed = 1;
+            break;
+        }
+        synthesize(&image);
+
+        char name[32];
+        snprintf(name, sizeof(name), "synthetic-%gmp", megapixels);
+        failed = benchmark(name, &image, &options, repeats, pool, &results);
+        free(image.data);
+
+        // Sizes are separated by commas
+        if (*end != ',')
+        {
+            break;
+        }
+        size = end;
+    }
+
+    // Then the images named on the command line
+    for (int i = optind; i < argc && !failed; i++)
+    {
+        FILE *inptr = fopen(argv[i], "r");
+        BMP bmp;
+        if (inptr == NULL || bmp_load(inptr, &bmp) != BMP_OK)
+        {
+            fprintf(stderr, "Could not load %s.\n", argv[i]);
+            if (inptr != NULL)
+            {
+                fclose(inptr);
+            }
+            continue;
+        }
+        failed = benchmark(argv[i], &bmp.image, &options, repeats, pool, &results);
+        bmp_free(&bmp);
+        fclose(inptr);
+    }
+
+    printf("\n  ]\n}\n");
+    pool_destroy(pool);
+    if (failed)
+    {
+        fprintf(stderr, "Not enough memory to benchmark.\n");
+        return 7;
+    }
+    return 0;
+}
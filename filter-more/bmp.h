@@ -1,5 +1,8 @@
 // BMP-related data types based on Microsoft's own
 
+#ifndef BMP_H
+#define BMP_H
+
 #include <stdint.h>
 
 /**
@@ -73,3 +76,24 @@ typedef struct
     BYTE  rgbtRed;
 } __attribute__((__packed__))
 RGBTRIPLE;
+
+/**
+ * RGBQUAD
+ *
+ * This structure describes a color consisting of relative intensities of
+ * red, green, and blue, plus a reserved byte. It is the form pixels take
+ * in memory while they are filtered: 4 bytes apiece, so that every pixel
+ * starts on a 4-byte boundary and whole pixels fill vector registers.
+ *
+ * Adapted from http://msdn.microsoft.com/en-us/library/dd162938(VS.85).aspx.
+ */
+typedef struct
+{
+    BYTE  rgbBlue;
+    BYTE  rgbGreen;
+    BYTE  rgbRed;
+    BYTE  rgbReserved;
+} __attribute__((__aligned__(4)))
+RGBQUAD;
+
+#endif
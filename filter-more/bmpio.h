@@ -0,0 +1,73 @@
+// Reading and writing of 24-bit and 32-bit uncompressed BMP files
+// The filters work on rows of 4-byte pixels, each row aligned to ROW_ALIGNMENT (see helpers.h), so the scanlines
+// of a file are converted once as they are read, and once more as they are written: 24-bit pixels are spread out
+// and packed back, and 32-bit pixels are copied, with their fourth bytes (unused, or alpha) kept aside and put
+// back, since the filters do not keep the fourth bytes in memory
+
+#ifndef BMPIO_H
+#define BMPIO_H
+
+#include <stdio.h>
+
+#include "helpers.h"
+#include "writer.h"
+
+// Outcomes of loading a BMP file
+typedef enum
+{
+    BMP_OK,
+    BMP_UNSUPPORTED,  // Not a 24-bit or 32-bit uncompressed BMP file
+    BMP_NO_MEMORY     // Could not allocate the pixels
+} BMPSTATUS;
+
+// A BMP file loaded into memory, with its pixels ready to be filtered in place
+typedef struct
+{
+    BITMAPFILEHEADER bf;  // File header, copied out of the file
+    BITMAPINFOHEADER bi;  // Info header, copied out of the file
+    IMAGE image;          // The rows in file order, converted to 4-byte pixels
+    BYTE *extra;          // The fourth byte of each pixel of a 32-bit file, row by row, or NULL for a 24-bit file
+} BMP;
+
+// Load a BMP file, converting its pixels straight out of a read-only mapping of the file when possible (a regular
+// file holding every row), or else reading them a batch at a time
+BMPSTATUS bmp_load(FILE *inptr, BMP *bmp);
+
+// Read and validate just the headers of a BMP file from the current position of inptr, describing
+// its image with no pixels attached (for streaming the pixels in later)
+BMPSTATUS bmp_read_headers(FILE *inptr, BMP *bmp);
+
+// Load the pixels of a BMP file whose headers have just been read, mapping the file when possible
+BMPSTATUS bmp_load_pixels(FILE *inptr, BMP *bmp);
+
+// Get the number of bytes each scanline of a BMP file takes up in the file, padding included
+size_t bmp_scanline(const BMP *bmp);
+
+// Read the next rows->height scanlines of a BMP file into rows, converting them; missing rows are left black.
+// For a 32-bit file, extra gets the fourth byte of each pixel (rows->width per row); it is NULL for a 24-bit file
+BMPSTATUS bmp_read_rows(FILE *inptr, IMAGE *rows, BYTE *extra);
+
+// Read a whole BMP file into a buffer that is reused from one file to the next, replacing it with a larger
+// one (and updating size) when the image does not fit, and mapping the file when possible; the BMP must not be
+// passed to bmp_free
+BMPSTATUS bmp_read_into(FILE *inptr, BMP *bmp, BYTE **buffer, size_t *size);
+
+// Write a loaded (and possibly filtered) BMP file, turned as the orientation says; returns 0 on success, or 1 if
+// there was no memory to convert it. Its headers are changed to match (a transposed image swaps its width and
+// height, and its rows get new padding). The rows are converted into blocks of scanlines, and each block goes out
+// in one write (flipped, the rows go into the blocks last to first)
+int bmp_write(WRITER *writer, const BMP *bmp, const ORIENTATION *orientation);
+
+// Write the rows of an image as scanlines, with zeros for padding, reflecting every row on the way out if mirror
+// is set (which costs no more than converting it), and wait until they are written; returns 0 on success, or 1 if
+// there was no memory to convert them (writer_close() reports failed writes). They are written as 32-bit
+// scanlines, with the fourth bytes from extra, unless extra is NULL
+int bmp_write_rows(WRITER *writer, const IMAGE *image, const BYTE *extra, int mirror);
+
+// Write just the headers of a BMP file; returns 0 on success
+int bmp_write_headers(WRITER *writer, const BMP *bmp);
+
+// Release the memory held by a loaded BMP file
+void bmp_free(BMP *bmp);
+
+#endif
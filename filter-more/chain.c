@@ -0,0 +1,169 @@
+#include <string.h>  // For strchr(), strlen() and memcpy()
+
+#include "bands.h"
+#include "chain.h"
+
+// The pass that runs a chain of point filters with no other filter to fuse them into
+static const FILTER POINTS = {.apply = points, .symmetric = 1};
+
+int chain_add(CHAIN *chain, const FILTER *filter, const OPTIONS *options)
+{
+    if (chain->step_count == MAX_STEPS)
+    {
+        return 0;
+    }
+    chain->steps[chain->step_count].filter = filter;
+    chain->steps[chain->step_count].options = *options;
+    chain->step_count++;
+    return 1;
+}
+
+int chain_parse(const char *list, CHAIN *chain)
+{
+    const char *item = list;
+    while (1)
+    {
+        const char *end = strchr(item, ',');
+        if (end == NULL)
+        {
+            end = item + strlen(item);
+        }
+
+        // The flag must name a filter, and anything after it must be an argument that filter accepts
+        const FILTER *filter = item < end ? find_filter(*item) : NULL;
+        if (filter == NULL)
+        {
+            return 1;
+        }
+        OPTIONS options = DEFAULT_OPTIONS;
+        if (end - item > 1)
+        {
+            char argument[128];
+            if (filter->parse == NULL || end - item - 1 >= (int) sizeof(argument))
+            {
+                return 1;
+            }
+            memcpy(argument, item + 1, end - item - 1);
+            argument[end - item - 1] = '\0';
+            if (!filter->parse(argument, &options))
+            {
+                return 1;
+            }
+        }
+        if (!chain_add(chain, filter, &options))
+        {
+            return 2;
+        }
+
+        if (*end == '\0')
+        {
+            return 0;
+        }
+        item = end + 1;
+    }
+}
+
+void chain_compile(CHAIN *chain)
+{
+    chain->pass_count = 0;
+
+    // Walking backwards, a reflect can move to the very end when every filter after it is symmetric, or can be
+    // changed to suit. The other transforms change the shape of the image, so they can only be done as it is
+    // written, and always move to the end (every filter is symmetric or can be changed, so that is where they would
+    // go anyway)
+    int folded[MAX_STEPS];
+    int symmetric = 1;
+    for (int k = chain->step_count - 1; k >= 0; k--)
+    {
+        const FILTER *filter = chain->steps[k].filter;
+        folded[k] = filter->orient != NULL && (symmetric || filter->apply == NULL);
+        symmetric &= filter->symmetric || filter->reorient != NULL;
+    }
+
+    // The transforms at the end add up, in order, to a single way of turning the image (two reflects cancel out,
+    // for instance, and so do four quarter turns), and each filter that is not symmetric is changed to run before
+    // the transforms that came before it
+    chain->orientation = (ORIENTATION) {0, 0, 0};
+
+    // Point filters before the first pass wait for it in a fusion of their own
+    FUSION pending = {.load_count = 0};
+    PASS *pass = NULL;
+    for (int k = 0; k < chain->step_count; k++)
+    {
+        const STEP *step = &chain->steps[k];
+        if (folded[k])
+        {
+            step->filter->orient(&chain->orientation, &step->options);
+            continue;
+        }
+
+        // A point filter joins the stores of the last pass, or the loads of the next one
+        if (step->filter->row != NULL)
+        {
+            if (pass != NULL)
+            {
+                pass->fusion.stores[pass->fusion.store_count++] = step;
+            }
+            else
+            {
+                pending.loads[pending.load_count++] = step;
+            }
+            continue;
+        }
+
+        // Any other filter starts a new pass
+        pass = &chain->passes[chain->pass_count++];
+        pass->filter = step->filter;
+        pass->options = step->options;
+        if (step->filter->reorient != NULL)
+        {
+            step->filter->reorient(&pass->options, &chain->orientation);
+        }
+        pass->fusion = pending;
+        pending.load_count = 0;
+    }
+
+    // A chain of point filters only still needs a pass of its own
+    if (pending.load_count > 0)
+    {
+        pass = &chain->passes[chain->pass_count++];
+        pass->filter = &POINTS;
+        pass->options = DEFAULT_OPTIONS;
+        pass->fusion = pending;
+    }
+
+    for (int p = 0; p < chain->pass_count; p++)
+    {
+        chain->passes[p].options.fusion = &chain->passes[p].fusion;
+    }
+}
+
+int pass_halo(const PASS *pass)
+{
+    return pass->filter->halo != NULL ? pass->filter->halo(&pass->options) : 0;
+}
+
+int chain_whole(const CHAIN *chain)
+{
+    for (int p = 0; p < chain->pass_count; p++)
+    {
+        if (chain->passes[p].filter->whole != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int apply_chain(const CHAIN *chain, IMAGE *image, POOL *pool)
+{
+    for (int p = 0; p < chain->pass_count; p++)
+    {
+        const PASS *pass = &chain->passes[p];
+        if (apply_filter(pass->filter, &pass->options, image, NULL, pool) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Chains of filters (e.g., -g -b -r), compiled into as few passes over the image as possible
+
+#ifndef CHAIN_H
+#define CHAIN_H
+
+#include "helpers.h"
+#include "pool.h"
+
+// One pass over the image: a filter, with point filters fused into the rows it loads and stores
+typedef struct
+{
+    const FILTER *filter;  // The filter, or one that only runs the loads for a chain of point filters
+    OPTIONS options;       // The filter's settings, pointing at fusion
+    FUSION fusion;
+} PASS;
+
+// A chain of filters in the order they were given, and the passes it compiles to
+// (passes point into the chain's own steps, so a compiled chain must not be copied)
+typedef struct
+{
+    STEP steps[MAX_STEPS];
+    int step_count;
+    PASS passes[MAX_STEPS];
+    int pass_count;
+    ORIENTATION orientation;  // How to turn the image as it is written (the transforms folded into writing it)
+} CHAIN;
+
+// Add a filter to the end of a chain, returning 0 if the chain is already full
+int chain_add(CHAIN *chain, const FILTER *filter, const OPTIONS *options);
+
+// Add the filters of a --chain list like g,b5,msepia,r to a chain: each item is a filter's flag, followed by its
+// argument if it takes one (the numbers of a custom -m matrix are separated by colons there). Returns 0 on
+// success, 1 for an invalid filter, or 2 for too many filters
+int chain_parse(const char *list, CHAIN *chain);
+
+// Compile the steps of a chain into passes. A reflect followed only by symmetric filters is folded into
+// writing the output, and so is every flip, rotate and transpose (which have no other form). Each point filter
+// is fused into the loads of the next filter that needs other rows (if it comes before all of them) or into the
+// stores of the last one before it, so that every pass touches each row once, however many filters run on it
+void chain_compile(CHAIN *chain);
+
+// Rows of context a pass needs above and below each band
+int pass_halo(const PASS *pass);
+
+// Whether any pass of a compiled chain needs the whole picture at once (a Gaussian blur), so that the image can
+// neither be streamed a strip at a time nor cut down to the context around a region
+int chain_whole(const CHAIN *chain);
+
+// Run the passes of a compiled chain over an image one after another, one band of rows per thread, leaving
+// the image unturned for its orientation to be applied as it is written. Returns 0 on success or 1 if a pass
+// ran out of memory
+int apply_chain(const CHAIN *chain, IMAGE *image, POOL *pool);
+
+#endif
@@ -0,0 +1,251 @@
+// Filters an image by sending it as a job to a running filter service (see ./filter --serve), with the same
+// filters, arguments and exit codes as ./filter itself, but without starting up the filters for every image
+// Usage: ./client [--socket path] [flag [argument]]... [--chain list] infile outfile
+
+#define _GNU_SOURCE  // For memfd_create() and realpath()
+
+#include <getopt.h>      // For command-line option parsing
+#include <limits.h>      // For PATH_MAX
+#include <stdio.h>       // For standard I/O functions
+#include <stdlib.h>      // For realpath()
+#include <string.h>      // For building the chain and the paths
+#include <sys/mman.h>    // For memfd_create()
+#include <sys/socket.h>  // For the socket, and the file descriptors passed over it
+#include <sys/un.h>      // For struct sockaddr_un
+#include <unistd.h>      // For read(), write(), getcwd() and close()
+
+#include "bands.h"       // For finding filters by their flags
+#include "chain.h"       // For checking the filters before sending them
+#include "service.h"     // For the jobs and replies
+
+// Values getopt_long returns for options that only have a long form
+enum
+{
+    SOCKET_OPTION = 256,
+    CHAIN_LIST
+};
+
+// Add an item to the end of a --chain list, returning 0 if it does not fit
+static int append(char *list, const char *item)
+{
+    size_t length = strlen(list);
+    if (length + (length > 0) + strlen(item) >= CHAIN_BYTES)
+    {
+        return 0;
+    }
+    if (length > 0)
+    {
+        list[length++] = ',';
+    }
+    strcpy(list + length, item);
+    return 1;
+}
+
+// Copy all of stdin into a memfd, so that the service can read the image without it going through a pipe;
+// returns the memfd, or -1 on failure
+static int copy_stdin(void)
+{
+    int fd = memfd_create("image", 0);
+    char buffer[64 * 1024];
+    ssize_t got;
+    while (fd >= 0 && (got = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t done = 0, wrote; done < got; done += wrote)
+        {
+            wrote = write(fd, buffer + done, got - done);
+            if (wrote <= 0)
+            {
+                close(fd);
+                return -1;
+            }
+        }
+    }
+    if (fd >= 0 && lseek(fd, 0, SEEK_SET) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Send a job to the service at path, with some file descriptors attached, and wait for its reply; returns 0 if
+// the reply came
+static int submit(const char *path, const JOB *job, const int *fds, int count, REPLY *reply)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int connection = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (connection < 0 || connect(connection, (struct sockaddr *) &address, sizeof(address)) != 0)
+    {
+        if (connection >= 0)
+        {
+            close(connection);
+        }
+        return 1;
+    }
+
+    // The file descriptors ride along with the job, in one message
+    union
+    {
+        char buffer[CMSG_SPACE(2 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec piece = {(void *) job, sizeof(JOB)};
+    struct msghdr message = {.msg_iov = &piece, .msg_iovlen = 1};
+    if (count > 0)
+    {
+        message.msg_control = control.buffer;
+        message.msg_controllen = CMSG_SPACE(count * sizeof(int));
+        struct cmsghdr *c = CMSG_FIRSTHDR(&message);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(c), fds, count * sizeof(int));
+    }
+    int failed = sendmsg(connection, &message, MSG_NOSIGNAL) != sizeof(JOB) ||
+                 recv(connection, reply, sizeof(REPLY), 0) != sizeof(REPLY);
+    close(connection);
+    reply->message[sizeof(reply->message) - 1] = '\0';
+    return failed;
+}
+
+int main(int argc, char *argv[])
+{
+    // The same filter flags as ./filter, plus --socket for where the service listens
+    char flags[64] = "";
+    for (const FILTER *f = FILTERS; f->flag != 0; f++)
+    {
+        strncat(flags, &f->flag, 1);
+        if (f->parse != NULL)
+        {
+            strcat(flags, "::");
+        }
+    }
+    static const struct option long_options[] =
+    {
+        {"socket", required_argument, NULL, SOCKET_OPTION},
+        {"chain", required_argument, NULL, CHAIN_LIST},
+        {NULL, 0, NULL, 0}
+    };
+
+    // Gather the filters into one --chain list, in the order they are given (the numbers of a custom -m matrix
+    // are separated by colons there)
+    JOB job = {.chain = "", .input = "", .output = ""};
+    const char *path = SOCKET_PATH;
+    int option;
+    while ((option = getopt_long(argc, argv, flags, long_options, NULL)) != -1)
+    {
+        if (option == '?')
+        {
+            printf("Invalid filter.\n");
+            return 1;  // Exit with error code 1 for invalid filter
+        }
+        if (option == SOCKET_OPTION)
+        {
+            path = optarg;
+            continue;
+        }
+
+        char item[CHAIN_BYTES];
+        if (option == CHAIN_LIST)
+        {
+            snprintf(item, sizeof(item), "%s", optarg);
+        }
+        else
+        {
+            // A filter's argument is either attached (-b5) or the next word (-b 5), as long as that still leaves
+            // the two filenames
+            const FILTER *filter = find_filter(option);
+            OPTIONS options = DEFAULT_OPTIONS;
+            const char *argument = optarg;
+            if (filter->parse != NULL && argument == NULL && optind + 2 < argc &&
+                filter->parse(argv[optind], &options))
+            {
+                argument = argv[optind++];
+            }
+            snprintf(item, sizeof(item), "%c%s", option, argument != NULL ? argument : "");
+            for (char *c = item; *c != '\0'; c++)
+            {
+                *c = *c == ',' ? ':' : *c;
+            }
+        }
+        if (!append(job.chain, item))
+        {
+            printf("Too many filters.\n");
+            return 2;  // Exit with error code 2 for too many filters
+        }
+    }
+
+    // Ensure proper usage: exactly two additional arguments (input and output filenames, either of which may be -)
+    if (argc != optind + 2)
+    {
+        printf("Usage: ./client [--socket path] [flag [argument]]... [--chain list] infile outfile\n");
+        return 3;  // Exit with error code 3 for incorrect usage
+    }
+    char *infile = argv[optind];
+    char *outfile = argv[optind + 1];
+
+    // Messages go to stderr when the image goes to stdout, so that they cannot end up in it
+    FILE *messages = strcmp(outfile, "-") == 0 ? stderr : stdout;
+
+    // Check the filters here, so that a mistake is reported without bothering the service
+    CHAIN chain = {.step_count = 0};
+    int invalid = job.chain[0] != '\0' ? chain_parse(job.chain, &chain) : 0;
+    if (invalid != 0)
+    {
+        fprintf(messages, "%s\n", invalid == 1 ? "Invalid filter." : "Too many filters.");
+        return invalid;  // Exit with error code 1 for invalid filter, or 2 for too many filters
+    }
+
+    // The service runs elsewhere, so named files go by their absolute paths; stdin goes as a memfd holding the
+    // image, and stdout as itself
+    int fds[2];
+    int count = 0;
+    if (strcmp(infile, "-") == 0)
+    {
+        fds[count] = copy_stdin();
+        if (fds[count++] < 0)
+        {
+            fprintf(messages, "Could not open %s.\n", infile);
+            return 4;  // Exit with error code 4 for failure to open input file
+        }
+    }
+    else if (realpath(infile, job.input) == NULL)
+    {
+        fprintf(messages, "Could not open %s.\n", infile);
+        return 4;  // Exit with error code 4 for failure to open input file
+    }
+    if (strcmp(outfile, "-") == 0)
+    {
+        fds[count++] = STDOUT_FILENO;
+    }
+    else
+    {
+        char directory[PATH_MAX];
+        int fits = outfile[0] == '/' ? snprintf(job.output, PATH_BYTES, "%s", outfile) < PATH_BYTES :
+                   getcwd(directory, sizeof(directory)) != NULL &&
+                   snprintf(job.output, PATH_BYTES, "%s/%s", directory, outfile) < PATH_BYTES;
+        if (!fits)
+        {
+            fprintf(messages, "Could not create %s.\n", outfile);
+            return 5;  // Exit with error code 5 for failure to create output file
+        }
+    }
+
+    // Hand the job over, and report what came of it
+    REPLY reply;
+    if (submit(path, &job, fds, count, &reply) != 0)
+    {
+        fprintf(messages, "Could not reach the filter service at %s.\n", path);
+        return 8;  // Exit with error code 8 for no service
+    }
+    if (reply.message[0] != '\0')
+    {
+        fprintf(messages, "%s\n", reply.message);
+    }
+    return reply.code;
+}
@@ -0,0 +1,465 @@
+#include <math.h>    // For sqrtf()
+#include <string.h>  // For memcpy(), memset() and memcmp()
+
+#include "convolve.h"
+#include "scratch.h"  // For the blur's and the kernels' rows, kept from one image to the next
+#include "simd.h"    // For the vectorized Sobel operators
+
+// Where a band's source rows come from: its own rows, then (for rows top to bottom - 1 outside it) its halo. The
+// band's rows get the loads fused into the pass the first time they are read, in order
+typedef struct
+{
+    IMAGE *image;
+    const HALO *halo;
+    const OPTIONS *options;
+    int top;     // First source row, which is the top of the picture if the halo has fewer rows than asked for
+    int bottom;  // One past the last source row
+    int loaded;  // How many of the band's rows have had their loads
+} SOURCE;
+
+// Run the loads fused into the pass on every row of the band up to row x that has not had them yet (halo rows had
+// them when they were copied)
+static void load_rows(SOURCE *source, int x)
+{
+    for (; source->loaded <= x && source->loaded < source->image->height; source->loaded++)
+    {
+        load_row(source->options, image_row(source->image, source->loaded), source->image->width);
+    }
+}
+
+// Get unfiltered source row x, which must be one of top to bottom - 1, running the loads on it first if need be
+static const RGBQUAD *reach(SOURCE *source, int x)
+{
+    load_rows(source, x);
+    return source_row(source->image, source->halo, x);
+}
+
+// Divide a channel's sum by a positive divisor, rounding halves away from zero, and clamp it to 0..255 (a negative
+// sum gives 0 however it rounds)
+static inline BYTE scale(int sum, int divisor)
+{
+    if (sum <= 0)
+    {
+        return 0;
+    }
+    int value = (sum + divisor / 2) / divisor;
+    return value > 255 ? 255 : value;
+}
+
+// The same as scale, for divisors up to MAX_RECIPROCAL, but multiplying by a reciprocal, since there is no vector
+// integer division and the loops that use this are meant to be vectorized. With the sum capped at 256 * divisor
+// (which scales to 255 either way), (n + 0.5) * inverse is within 257 * 2^-23 of the exact quotient, less than the
+// 0.5 / divisor that the half keeps it from the integers on either side, so it always truncates the same way
+#define MAX_RECIPROCAL 4096
+static inline BYTE divide(int sum, int divisor, float inverse)
+{
+    int n = (sum < 256 * divisor ? sum : 256 * divisor) + divisor / 2;
+    int value = (int) (((float) n + 0.5f) * inverse);
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+}
+
+// Compute one color channel of an edge pixel from its gradients: round(sqrt(gx * gx + gy * gy)), capped at 255
+// Past 255 * 255 + 255 the result is always capped, and below that a float square root is never close enough
+// to a rounding boundary (at least 0.0004 away) to round differently from the double-precision one
+static inline BYTE magnitude(int gx, int gy)
+{
+    int squared = gx * gx + gy * gy;
+    if (squared > 255 * 255 + 255)
+    {
+        return 255;
+    }
+    return (int) (sqrtf(squared) + 0.5f);
+}
+
+// Copy a row into the middle of padded, with radius pixels either side standing in for the ones past its ends:
+// black when they are skipped (so that they add nothing to a sum), or the ones the border mode picks
+static void pad_row(const RGBQUAD *row, int width, int radius, BORDER border, RGBQUAD *padded)
+{
+    memcpy(padded + radius, row, width * sizeof(RGBQUAD));
+    for (int y = 1; y <= radius; y++)
+    {
+        RGBQUAD black = {0, 0, 0, 0};
+        padded[radius - y] = border == BORDER_SKIP ? black : row[outside(-y, 0, width, border)];
+        padded[radius + width - 1 + y] = border == BORDER_SKIP ? black : row[outside(width - 1 + y, 0, width, border)];
+    }
+}
+
+// Sum each pixel's row neighbours within radius columns of it (3 sums per pixel: blue, green, red), given the row
+// padded with radius pixels either side. A running sum is kept while moving along the row, so the cost does not
+// depend on the radius, and the padding takes care of the ends, so there is nothing to check
+static void sum_row(const RGBQUAD *padded, int width, int radius, int *sums)
+{
+    int sumRed = 0, sumGreen = 0, sumBlue = 0;
+
+    // Start with the pixels left of the first column's right edge (padded[radius + y] is column y)
+    for (int y = 0; y < 2 * radius; y++)
+    {
+        sumRed += padded[y].rgbRed;
+        sumGreen += padded[y].rgbGreen;
+        sumBlue += padded[y].rgbBlue;
+    }
+
+    for (int j = 0; j < width; j++)
+    {
+        // Add the pixel entering the neighborhood on the right, then remove the one about to leave it on the left
+        sumRed += padded[j + 2 * radius].rgbRed;
+        sumGreen += padded[j + 2 * radius].rgbGreen;
+        sumBlue += padded[j + 2 * radius].rgbBlue;
+
+        sums[3 * j] = sumBlue;
+        sums[3 * j + 1] = sumGreen;
+        sums[3 * j + 2] = sumRed;
+
+        sumRed -= padded[j].rgbRed;
+        sumGreen -= padded[j].rgbGreen;
+        sumBlue -= padded[j].rgbBlue;
+    }
+}
+
+// Get the slot of source row x in a ring of window rows of sums
+static int *slot(int *ring, int window, int width, int x)
+{
+    return ring + (size_t) ((x % window + window) % window) * width * 3;
+}
+
+// Blur with a box of weights of 1, radius pixels in every direction, averaging the pixels it covers.
+// The box is separable: each source row is summed horizontally once, and those row sums are added up vertically.
+// Both sums slide along with running totals, so a pixel costs the same however large the radius is.
+static int convolve_box(IMAGE *image, const HALO *halo, const OPTIONS *options, int radius)
+{
+    int height = image->height;
+    int width = image->width;
+    int skip = options->border == BORDER_SKIP;
+    SOURCE source = {.image = image, .halo = halo, .options = options, .top = halo != NULL ? -halo->above : 0,
+                     .bottom = height + (halo != NULL ? halo->below : 0), .loaded = 0};
+
+    // Keep the row sums of the 2 * radius + 1 rows around the current row in a ring, and add them up per column
+    // This is all the memory the blur needs (besides a padded copy of the row being summed), so it never copies the
+    // image
+    int window = 2 * radius + 1;
+    int *ring = scratch(SCRATCH_RING, (size_t) window * width * 3 * sizeof(int));
+    int *totals = scratch(SCRATCH_TOTALS, (size_t) width * 3 * sizeof(int));
+    RGBQUAD *padded = scratch(SCRATCH_PADDED, (width + 2 * (size_t) radius) * sizeof(RGBQUAD));
+    if (ring == NULL || totals == NULL || padded == NULL)
+    {
+        return 1;
+    }
+    memset(totals, 0, (size_t) width * 3 * sizeof(int));
+
+    // Every row from radius above the first to radius below the last gets a slot as it enters the box, with the
+    // sums of the row itself or of the row standing in for it past the edge of the picture, or nothing at all,
+    // when those are skipped. Rows past the top only enter before any row is written, but rows past the bottom
+    // stand for rows that may have been written since, so they get a copy of those rows' sums, still in the ring
+    for (int x = -radius; x < height + radius; x++)
+    {
+        int *sums = slot(ring, window, width, x);
+        int inside = x >= source.top && x < source.bottom;
+        if (inside || (!skip && x < source.top))
+        {
+            const RGBQUAD *row = reach(&source, inside ? x : outside(x, source.top, source.bottom, options->border));
+            pad_row(row, width, radius, options->border, padded);
+            sum_row(padded, width, radius, sums);
+        }
+        else if (skip)
+        {
+            memset(sums, 0, (size_t) width * 3 * sizeof(int));
+        }
+        else
+        {
+            memcpy(sums, slot(ring, window, width, outside(x, source.top, source.bottom, options->border)),
+                   (size_t) width * 3 * sizeof(int));
+        }
+        for (int k = 0; k < width * 3; k++)
+        {
+            totals[k] += sums[k];
+        }
+
+        // Once row i's box is complete, average it, and slide the box down a row by removing the row leaving it
+        // at the top (row i is only written after every row it needs has been summed, so it can be blurred in place)
+        int i = x - radius;
+        if (i < 0)
+        {
+            continue;
+        }
+
+        // Count the rows of the box that are inside the picture (all of them, unless the rest are skipped)
+        int rows = !skip ? window : (i + radius < source.bottom ? i + radius : source.bottom - 1) -
+                                    (i - radius > source.top ? i - radius : source.top) + 1;
+
+        RGBQUAD *row = image_row(image, i);
+
+        // Iterate over each column of the image
+        for (int j = 0; j < width; j++)
+        {
+            int columns = !skip ? window : (j + radius < width ? j + radius : width - 1) -
+                                           (j - radius > 0 ? j - radius : 0) + 1;
+            int count = rows * columns;
+
+            // Compute the average color values for the current pixel, rounding halves up
+            // (exactly what rounding the floating-point average would give)
+            row[j].rgbBlue = (totals[3 * j] + count / 2) / count;
+            row[j].rgbGreen = (totals[3 * j + 1] + count / 2) / count;
+            row[j].rgbRed = (totals[3 * j + 2] + count / 2) / count;
+        }
+        store_row(options, row, width);
+
+        const int *leaving = slot(ring, window, width, i - radius);
+        for (int k = 0; k < width * 3; k++)
+        {
+            totals[k] -= leaving[k];
+        }
+    }
+    return 0;
+}
+
+// Convolve one pixel near the edge of the picture, where some of the pixels the kernel covers are missing (in NULL
+// rows, or past the ends of the row, when they are skipped) or stand in for others
+static void convolve_pixel(const RGBTRIPLE *const *rows, int width, int j, const KERNEL *kernel, BORDER border,
+                           RGBTRIPLE *pixel)
+{
+    int size = kernel->size;
+    int radius = size / 2;
+
+    // Find the column that each column of the kernel reads, or -1 where it is skipped, once for every row
+    int columns[MAX_KERNEL];
+    for (int b = 0; b < size; b++)
+    {
+        int y = j - radius + b;
+        columns[b] = y >= 0 && y < width ? y : border == BORDER_SKIP ? -1 : outside(y, 0, width, border);
+    }
+
+    int sums[2][3] = {{0}};
+    int covered = 0;
+    for (int a = 0; a < size; a++)
+    {
+        for (int b = 0; b < size && rows[a] != NULL; b++)
+        {
+            if (columns[b] < 0)
+            {
+                continue;
+            }
+            const RGBTRIPLE *p = &rows[a][columns[b]];
+            for (int g = 0; g <= kernel->gradients; g++)
+            {
+                int weight = kernel->weights[g][a * size + b];
+                sums[g][0] += weight * p->rgbtBlue;
+                sums[g][1] += weight * p->rgbtGreen;
+                sums[g][2] += weight * p->rgbtRed;
+            }
+            covered += kernel->weights[0][a * size + b];
+        }
+    }
+
+    // A kernel that averages divides by the weights that covered pixels which are there
+    if (kernel->gradients)
+    {
+        pixel->rgbtBlue = magnitude(sums[0][0], sums[1][0]);
+        pixel->rgbtGreen = magnitude(sums[0][1], sums[1][1]);
+        pixel->rgbtRed = magnitude(sums[0][2], sums[1][2]);
+    }
+    else
+    {
+        int divisor = kernel->divisor != 0 ? kernel->divisor : covered;
+        pixel->rgbtBlue = scale(sums[0][0], divisor);
+        pixel->rgbtGreen = scale(sums[0][1], divisor);
+        pixel->rgbtRed = scale(sums[0][2], divisor);
+    }
+}
+
+// The interior of a row, every pixel at least the kernel's radius from either end, is convolved as a flat array of
+// bytes: each channel only ever meets the same channel of its neighbours, which sit 3 bytes to either side per
+// column, so there are no bounds to check and no need to pull the channels apart. rows holds the unfiltered rows
+// the kernel covers, and the results go to out, from byte 3 * radius to byte bytes - 3 * radius - 1
+
+// One row of weights times the same channel of the pixels around byte k of a row, for 3 and 5 columns
+#define ROW3(w, row, k) ((w)[0] * (row)[(k) - 3] + (w)[1] * (row)[k] + (w)[2] * (row)[(k) + 3])
+#define ROW5(w, row, k) ((w)[0] * (row)[(k) - 6] + (w)[1] * (row)[(k) - 3] + (w)[2] * (row)[k] + \
+                         (w)[3] * (row)[(k) + 3] + (w)[4] * (row)[(k) + 6])
+
+// A 3x3 kernel with a divisor up to MAX_RECIPROCAL, fully unrolled
+static void interior3(const BYTE *const *rows, BYTE *out, int bytes, const int *w, int divisor)
+{
+    float inverse = 1.0f / divisor;
+    for (int k = 3; k < bytes - 3; k++)
+    {
+        int sum = ROW3(w, rows[0], k) + ROW3(w + 3, rows[1], k) + ROW3(w + 6, rows[2], k);
+        out[k] = divide(sum, divisor, inverse);
+    }
+}
+
+// A 5x5 kernel with a divisor up to MAX_RECIPROCAL, fully unrolled
+static void interior5(const BYTE *const *rows, BYTE *out, int bytes, const int *w, int divisor)
+{
+    float inverse = 1.0f / divisor;
+    for (int k = 6; k < bytes - 6; k++)
+    {
+        int sum = ROW5(w, rows[0], k) + ROW5(w + 5, rows[1], k) + ROW5(w + 10, rows[2], k) +
+                  ROW5(w + 15, rows[3], k) + ROW5(w + 20, rows[4], k);
+        out[k] = divide(sum, divisor, inverse);
+    }
+}
+
+// A 3x3 pair of gradients, fully unrolled, from byte start on
+static void gradients3(const BYTE *const *rows, BYTE *out, int start, int bytes, const KERNEL *kernel)
+{
+    const int *x = kernel->weights[0];
+    const int *y = kernel->weights[1];
+    for (int k = start; k < bytes - 3; k++)
+    {
+        int gx = ROW3(x, rows[0], k) + ROW3(x + 3, rows[1], k) + ROW3(x + 6, rows[2], k);
+        int gy = ROW3(y, rows[0], k) + ROW3(y + 3, rows[1], k) + ROW3(y + 6, rows[2], k);
+        out[k] = magnitude(gx, gy);
+    }
+}
+
+// A kernel of any other size
+static void interior(const BYTE *const *rows, BYTE *out, int bytes, const KERNEL *kernel, int divisor)
+{
+    int size = kernel->size;
+    int reach = 3 * (size / 2);
+    for (int k = reach; k < bytes - reach; k++)
+    {
+        int sums[2] = {0, 0};
+        for (int g = 0; g <= kernel->gradients; g++)
+        {
+            for (int a = 0; a < size; a++)
+            {
+                for (int b = 0; b < size; b++)
+                {
+                    sums[g] += kernel->weights[g][a * size + b] * rows[a][k - reach + 3 * b];
+                }
+            }
+        }
+        out[k] = kernel->gradients ? magnitude(sums[0], sums[1]) : scale(sums[0], divisor);
+    }
+}
+
+// Pack a row of pixels in memory into 3-byte pixels, leaving out the fourth bytes
+static void pack(const RGBQUAD *row, RGBTRIPLE *packed, int width)
+{
+    for (int j = pack_simd(row, (BYTE *) packed, width, 0); j < width; j++)
+    {
+        packed[j] = (RGBTRIPLE) {row[j].rgbBlue, row[j].rgbGreen, row[j].rgbRed};
+    }
+}
+
+// Spread a row of 3-byte pixels back out into a row of pixels in memory
+static void expand(const RGBTRIPLE *packed, RGBQUAD *row, int width)
+{
+    for (int j = expand_simd((const BYTE *) packed, row, width); j < width; j++)
+    {
+        row[j] = (RGBQUAD) {packed[j].rgbtBlue, packed[j].rgbtGreen, packed[j].rgbtRed, 0};
+    }
+}
+
+// Apply any kernel but a box directly, one row at a time
+static int convolve_direct(IMAGE *image, const HALO *halo, const OPTIONS *options, const KERNEL *kernel)
+{
+    int height = image->height;
+    int width = image->width;
+    int size = kernel->size;
+    int radius = size / 2;
+    BORDER border = options->border;
+    SOURCE source = {.image = image, .halo = halo, .options = options, .top = halo != NULL ? -halo->above : 0,
+                     .bottom = height + (halo != NULL ? halo->below : 0), .loaded = 0};
+
+    // The kernels work on rows packed to 3 bytes a pixel, so that the fourth bytes take up none of their work: every
+    // source row is packed once, unfiltered, into a ring of size rows (row x in slot x % size), as it comes within
+    // radius rows of the row being filtered, which is before that row is overwritten. Each row is filtered into a
+    // packed row after them and spread back out, and a row of zeros after that stands in for rows that are skipped,
+    // which add nothing to the sums
+    RGBTRIPLE *ring = scratch(SCRATCH_SAVED, (size_t) (size + 2) * width * sizeof(RGBTRIPLE));
+    if (ring == NULL)
+    {
+        return 1;
+    }
+    RGBTRIPLE *out = ring + (size_t) size * width;
+    RGBTRIPLE *zeros = out + width;
+    memset(zeros, 0, width * sizeof(RGBTRIPLE));
+    int sobel = kernel->gradients && memcmp(kernel->weights, SOBEL_KERNEL.weights, sizeof(kernel->weights)) == 0;
+
+    // Iterate over each row of the image
+    int packed = source.top > -radius ? source.top : -radius;
+    for (int i = 0; i < height; i++)
+    {
+        for (; packed <= i + radius && packed < source.bottom; packed++)
+        {
+            pack(reach(&source, packed), ring + (size_t) ((packed % size + size) % size) * width, width);
+        }
+
+        // Gather the unfiltered rows the kernel covers, if they exist: rows past the edge of the picture are the
+        // rows that stand in for them, which are never more than radius rows from this one either
+        // (and a kernel that averages divides by the weights in the rows that are there)
+        const RGBTRIPLE *rows[MAX_KERNEL];
+        const BYTE *bytes[MAX_KERNEL];
+        int covered = 0;
+        for (int a = 0; a < size; a++)
+        {
+            int x = i - radius + a;
+            if ((x < source.top || x >= source.bottom) && border == BORDER_SKIP)
+            {
+                rows[a] = NULL;
+                bytes[a] = (const BYTE *) zeros;
+                continue;
+            }
+            x = x < source.top || x >= source.bottom ? outside(x, source.top, source.bottom, border) : x;
+            rows[a] = ring + (size_t) ((x % size + size) % size) * width;
+            bytes[a] = (const BYTE *) rows[a];
+            for (int b = 0; b < size; b++)
+            {
+                covered += kernel->weights[0][a * size + b];
+            }
+        }
+        int divisor = kernel->divisor != 0 ? kernel->divisor : covered;
+
+        // Only the first and last radius pixels are border, unless the row is too narrow, or every row of weights
+        // that is there adds up to nothing. The vectorized Sobel operators put the pixels they do, from pixel 1 on,
+        // straight into the row
+        RGBQUAD *row = image_row(image, i);
+        int first = width, last = width, direct = 0;
+        if (width > 2 * radius && divisor > 0)
+        {
+            int length = width * sizeof(RGBTRIPLE);
+            if (size == 3 && kernel->gradients)
+            {
+                direct = sobel ? edges_simd(bytes[0], bytes[1], bytes[2], row, width) : 0;
+                gradients3(bytes, (BYTE *) out, 3 * (1 + direct), length, kernel);
+            }
+            else if (size == 3 && divisor <= MAX_RECIPROCAL)
+            {
+                interior3(bytes, (BYTE *) out, length, kernel->weights[0], divisor);
+            }
+            else if (size == 5 && !kernel->gradients && divisor <= MAX_RECIPROCAL)
+            {
+                interior5(bytes, (BYTE *) out, length, kernel->weights[0], divisor);
+            }
+            else
+            {
+                interior(bytes, (BYTE *) out, length, kernel, divisor);
+            }
+            first = radius;
+            last = width - radius;
+        }
+        for (int j = 0; j < first; j++)
+        {
+            convolve_pixel(rows, width, j, kernel, border, &out[j]);
+        }
+        for (int j = last; j < width; j++)
+        {
+            convolve_pixel(rows, width, j, kernel, border, &out[j]);
+        }
+        expand(out, row, first);
+        expand(out + first + direct, row + first + direct, width - first - direct);
+        store_row(options, row, width);
+    }
+    return 0;
+}
+
+int convolve(IMAGE *image, const HALO *halo, const OPTIONS *options, const KERNEL *kernel)
+{
+    if (kernel->box)
+    {
+        return convolve_box(image, halo, options, kernel->size / 2);
+    }
+    return convolve_direct(image, halo, options, kernel);
+}
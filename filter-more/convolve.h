@@ -0,0 +1,17 @@
+// Convolving an image with a kernel: the engine every filter that weighs a pixel's neighbours runs on
+
+#ifndef CONVOLVE_H
+#define CONVOLVE_H
+
+#include "helpers.h"
+#include "kernel.h"
+
+// Convolve the rows of image with a kernel in place, treating the pixels past the edges of the picture as the
+// options' border mode says; returns 0 on success or 1 if it ran out of memory. halo may be NULL when image is the
+// whole picture, and otherwise must hold the kernel's size / 2 rows either side where the picture has them.
+// A box is summed with running totals, at a cost per pixel that does not depend on its size. Any other kernel is
+// applied directly, with a branch-free interior that is fully unrolled for 3x3 and 5x5 kernels (and vectorized for
+// the Sobel operators), and a careful path for the pixels near the edges
+int convolve(IMAGE *image, const HALO *halo, const OPTIONS *options, const KERNEL *kernel);
+
+#endif
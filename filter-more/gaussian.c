@@ -0,0 +1,519 @@
+#include <math.h>    // For sqrt() and fabs()
+#include "gaussian.h"
+#include "scratch.h"
+#include "simd.h"     // For packing the pixels of each block of columns to 3 bytes apiece
+
+// Columns of pixels the vertical pass runs down together, and that a thread takes at a time: 32 pixels are 96
+// doubles per row, enough to fill whole vectors and cache lines, while a block of even a very tall image stays a
+// few megabytes
+#define BLOCK 32
+
+// Doubles in each row of a block
+#define LANES (3 * BLOCK)
+
+// The recursion that approximates a Gaussian: each output is b times the input plus a[0], a[1] and a[2] times the
+// last three outputs. The weights add up to 1, so a constant input comes out unchanged. For a large sigma they are
+// close to 1 and -1, and floats lose too much to them, so the recursion runs in doubles
+typedef struct
+{
+    double b;
+    double a[3];
+    double ends[3][3];     // What the backward pass starts from at the end of a line (see blur_line())
+    double mirrors[3][4];
+} RECURSION;
+
+// How a line of pixels (a row, or a column) is blurred at its ends
+typedef struct
+{
+    int length;              // Pixels along the line
+    BORDER border;           // What lies past its ends (a line too short to mirror is clamped instead)
+    const double *inverses;  // When the pixels there are skipped, 1 over how much of the Gaussian covers pixels
+                             // that are there, at each place along the line; NULL otherwise
+    double echoes[3][3];     // When they are mirrored, what the outputs of the forward pass before the line leave
+    double settled[3][3];    // at its far end, and how that settles (see measure())
+} ENDS;
+
+// A Gaussian blur of a whole picture, shared out over the threads a row, or a block of columns, at a time
+typedef struct
+{
+    IMAGE *image;
+    const OPTIONS *options;
+    RECURSION recursion;
+    ENDS across;              // The ends of the rows,
+    ENDS down;                // and of the columns
+    int columns_first;        // Whether the columns are blurred before the rows (as a transposed image's rows are)
+    int reverse_rows;         // Whether each row runs from its last pixel,
+    int reverse_columns;      // and each column from its last row
+    _Atomic int failed;       // Set by any thread that runs out of memory
+} PLAN;
+
+// Invert an n by n matrix (n at most 4), row by row, by Gauss-Jordan elimination on the largest pivots
+static void invert(int n, const double *matrix, double *inverse)
+{
+    double work[4][8];
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            work[i][j] = matrix[i * n + j];
+            work[i][n + j] = i == j;
+        }
+    }
+    for (int c = 0; c < n; c++)
+    {
+        int pivot = c;
+        for (int i = c + 1; i < n; i++)
+        {
+            pivot = fabs(work[i][c]) > fabs(work[pivot][c]) ? i : pivot;
+        }
+        for (int j = 0; j < 2 * n; j++)
+        {
+            double swap = work[c][j];
+            work[c][j] = work[pivot][j];
+            work[pivot][j] = swap;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            double factor = i != c ? work[i][c] / work[c][c] : 0;
+            for (int j = 0; j < 2 * n; j++)
+            {
+                work[i][j] -= factor * work[c][j];
+            }
+        }
+    }
+    for (int i = 0; i < n; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            inverse[i * n + j] = work[i][n + j] / work[i][i];
+        }
+    }
+}
+
+// Young and van Vliet's coefficients for a standard deviation of sigma ("Recursive implementation of the Gaussian
+// filter", 1995), and what the backward pass starts from at the end of a line.
+// Past an end that carries on at one level (the edge pixel, when it is clamped, or black, when the pixels past it
+// are skipped), the forward pass would only have settled towards that level, so where it has got to by the end
+// decides everything the backward pass would have seen past it: its outputs at the last place and the two past it
+// are the level plus Triggs and Sdika's matrix times how far the forward pass's last three outputs are from it
+// ("Boundary conditions for Young-van Vliet recursive filtering", 2006). Past a mirrored end, the blurred line is
+// mirrored too (a Gaussian is symmetric), so those outputs are the backward pass's at the last place and the two
+// before it, which the four equations of its last four places give from the forward pass's last four outputs
+static RECURSION coefficients(double sigma)
+{
+    double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1 - 0.26891 * sigma);
+    double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+    double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+    double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+    double b3 = 0.422205 * q * q * q;
+    RECURSION r = {.b = 1 - (b1 + b2 + b3) / b0, .a = {b1 / b0, b2 / b0, b3 / b0}};
+
+    double a1 = r.a[0], a2 = r.a[1], a3 = r.a[2];
+    double scale = r.b / ((1 + a1 - a2 + a3) * (1 - a1 - a2 - a3) * (1 + a2 + (a1 - a3) * a3));
+    double ends[3][3] =
+    {
+        {1 - a2 - a1 * a3 - a3 * a3, (a1 + a3) * (a2 + a1 * a3), a3 * (a1 + a2 * a3)},
+        {a1 + a2 * a3, (1 - a2) * (a2 + a1 * a3), a3 * (1 - a2 - a1 * a3 - a3 * a3)},
+        {a1 * a3 + a2 + a1 * a1 - a2 * a2, a1 * a2 + a3 * a2 * a2 - a1 * a3 * a3 - a3 * a3 * a3 - a2 * a3 + a3,
+         a3 * (a1 + a2 * a3)}
+    };
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            r.ends[i][j] = scale * ends[i][j];
+        }
+    }
+
+    double equations[4][4] = {{1, -a1, -a2, -a3}, {-a1, 1 - a2, -a3, 0}, {-a2, -a1 - a3, 1, 0}, {-a3, -a2, -a1, 1}};
+    double solutions[4][4];
+    invert(4, equations[0], solutions[0]);
+    for (int i = 0; i < 3; i++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            r.mirrors[i][k] = r.b * solutions[i][k];
+        }
+    }
+    return r;
+}
+
+// Run the recursion forwards over steps rows of lanes doubles each, in place, every lane on its own, carrying on
+// from the three rows of outputs before the first (latest first). Every lane of a row only depends on earlier
+// rows, so the lanes vectorize
+static void forward(double *data, int steps, int lanes, const RECURSION *r, const double *before)
+{
+    for (int s = 0; s < steps; s++)
+    {
+        double *w = data + (size_t) s * lanes;
+        const double *w1 = s >= 1 ? w - lanes : before;
+        const double *w2 = s >= 2 ? w - 2 * (size_t) lanes : before + (size_t) (1 - s) * lanes;
+        const double *w3 = s >= 3 ? w - 3 * (size_t) lanes : before + (size_t) (2 - s) * lanes;
+        for (int l = 0; l < lanes; l++)
+        {
+            w[l] = r->b * w[l] + r->a[0] * w1[l] + r->a[1] * w2[l] + r->a[2] * w3[l];
+        }
+    }
+}
+
+// Run the recursion backwards over the same rows, from the last to the first, which makes it symmetric, given
+// its outputs at the last row and the two past it, in that order
+static void backward(double *data, int steps, int lanes, const RECURSION *r, const double *after)
+{
+    double *last = data + (size_t) (steps - 1) * lanes;
+    for (int l = 0; l < lanes; l++)
+    {
+        last[l] = after[l];
+    }
+    for (int s = steps - 2; s >= 0; s--)
+    {
+        double *y = data + (size_t) s * lanes;
+        int rest = steps - 1 - s;
+        const double *y1 = y + lanes;
+        const double *y2 = rest >= 2 ? y + 2 * (size_t) lanes : after + (size_t) (2 - rest) * lanes;
+        const double *y3 = rest >= 3 ? y + 3 * (size_t) lanes : after + (size_t) (3 - rest) * lanes;
+        for (int l = 0; l < lanes; l++)
+        {
+            y[l] = r->b * y[l] + r->a[0] * y1[l] + r->a[1] * y2[l] + r->a[2] * y3[l];
+        }
+    }
+}
+
+// Run the recursion over steps rows of lanes doubles each, step doubles apart (backwards, if it is negative), from
+// nothing before them, without storing it, leaving its last three rows of outputs in last (latest first)
+static void settle(const double *data, int steps, ptrdiff_t step, int lanes, const RECURSION *r, double *last)
+{
+    double rows[3][LANES] = {{0}};
+    double *w1 = rows[0], *w2 = rows[1], *w3 = rows[2];
+    for (int s = 0; s < steps; s++)
+    {
+        const double *x = data + s * step;
+        for (int l = 0; l < lanes; l++)
+        {
+            w3[l] = r->b * x[l] + r->a[0] * w1[l] + r->a[1] * w2[l] + r->a[2] * w3[l];
+        }
+        double *w = w3;
+        w3 = w2;
+        w2 = w1;
+        w1 = w;
+    }
+    for (int l = 0; l < lanes; l++)
+    {
+        last[l] = w1[l];
+        last[lanes + l] = w2[l];
+        last[2 * lanes + l] = w3[l];
+    }
+}
+
+// Blur a line of pixels in place: ends->length rows of lanes doubles each (a channel of each of the pixels it holds,
+// side by side), run forwards and then backwards, each pass starting where the rest of the line past its end would
+// have left it. Before a constant end (see coefficients()), the forward pass has settled on its level. Past a
+// mirrored start, it has been running back over the line itself, from place 1 on, so its three outputs before the
+// line are those of the backward pass at places 1 to 3, which in turn carries on from the forward pass's outputs
+// at the far end of the line, mirrored: each end is the other's echo. Running both from nothing finds what the line
+// itself contributes, and the ends' matrices account for the echoes
+static void blur_line(double *data, int lanes, const ENDS *ends, const RECURSION *r)
+{
+    int steps = ends->length;
+    double *last = data + (size_t) (steps - 1) * lanes;
+    double before[3 * LANES], after[3 * LANES], level[LANES];
+    if (ends->border == BORDER_MIRROR)
+    {
+        double back[3 * LANES], fore[3 * LANES];
+        settle(last, steps - 1, -(ptrdiff_t) lanes, lanes, r, back);
+        settle(data, steps - 1, lanes, lanes, r, fore);
+        for (int l = 0; l < lanes; l++)
+        {
+            double echoed[3];
+            for (int i = 0; i < 3; i++)
+            {
+                echoed[i] = back[i * lanes + l];
+                for (int k = 0; k < 3; k++)
+                {
+                    echoed[i] += ends->echoes[i][k] * fore[k * lanes + l];
+                }
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                before[i * lanes + l] = 0;
+                for (int k = 0; k < 3; k++)
+                {
+                    before[i * lanes + l] += ends->settled[i][k] * echoed[k];
+                }
+            }
+        }
+    }
+    else
+    {
+        for (int l = 0; l < lanes; l++)
+        {
+            before[l] = before[lanes + l] = before[2 * lanes + l] = ends->border == BORDER_SKIP ? 0 : data[l];
+            level[l] = ends->border == BORDER_SKIP ? 0 : last[l];
+        }
+    }
+
+    forward(data, steps, lanes, r, before);
+
+    // The forward pass's last four outputs, counting back from the end (the line may be shorter than that)
+    const double *outputs[4];
+    for (int k = 0; k < 4; k++)
+    {
+        int s = steps - 1 - k;
+        outputs[k] = s >= 0 ? data + (size_t) s * lanes : before + (size_t) (-s - 1) * lanes;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        for (int l = 0; l < lanes; l++)
+        {
+            double sum = 0;
+            if (ends->border == BORDER_MIRROR)
+            {
+                for (int k = 0; k < 4; k++)
+                {
+                    sum += r->mirrors[i][k] * outputs[k][l];
+                }
+            }
+            else
+            {
+                sum = level[l];
+                for (int k = 0; k < 3; k++)
+                {
+                    sum += r->ends[i][k] * (outputs[k][l] - level[l]);
+                }
+            }
+            after[i * lanes + l] = sum;
+        }
+    }
+
+    backward(data, steps, lanes, r, after);
+}
+
+// Work out how lines of length pixels are blurred at their ends, using work, which holds 3 * length doubles (and
+// goes on holding the inverses, when the pixels past the ends are skipped)
+static void measure(ENDS *ends, int length, BORDER border, const RECURSION *r, double *work)
+{
+    *ends = (ENDS) {.length = length, .border = border == BORDER_MIRROR && length < 4 ? BORDER_CLAMP : border};
+    if (ends->border == BORDER_MIRROR)
+    {
+        // Run the forward pass over nothing from each of its three outputs before the line in turn, side by side,
+        // to see how much of each is left at places length - 2 to length - 4; the backward pass leaves just as much
+        // of its outputs past the end at places 1 to 3. What one end sends to the other comes back, and back again,
+        // which adds up to the inverse of 1 less the round trip
+        double identity[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+        for (int s = 0; s < 3 * (length - 1); s++)
+        {
+            work[s] = 0;
+        }
+        forward(work, length - 1, 3, r, identity);
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                ends->echoes[i][j] = work[(size_t) (length - 2 - i) * 3 + j];
+            }
+        }
+        double loop[3][3];
+        for (int i = 0; i < 3; i++)
+        {
+            for (int j = 0; j < 3; j++)
+            {
+                loop[i][j] = i == j;
+                for (int k = 0; k < 3; k++)
+                {
+                    loop[i][j] -= ends->echoes[i][k] * ends->echoes[k][j];
+                }
+            }
+        }
+        invert(3, loop[0], ends->settled[0]);
+    }
+    else if (ends->border == BORDER_SKIP)
+    {
+        // The pixels past the ends count for nothing, so each place is divided by how much of the Gaussian covers
+        // the line, which is what blurring a line of 1s with nothing past it gives
+        for (int s = 0; s < length; s++)
+        {
+            work[s] = 1;
+        }
+        blur_line(work, 1, ends, r);
+        for (int s = 0; s < length; s++)
+        {
+            work[s] = 1 / work[s];
+        }
+        ends->inverses = work;
+    }
+}
+
+// Round a channel's blurred value, divided by how much of the Gaussian covered pixels that are there, and clamp it
+// to 0..255 (the recursion can overshoot a little, either way)
+static inline BYTE level(double value, double inverse)
+{
+    int rounded = (int) (value * inverse + 0.5);
+    return rounded < 0 ? 0 : rounded > 255 ? 255 : rounded;
+}
+
+// Run the point filters fused into the pass on row i, before the columns are blurred first
+static void load_rows(void *arg, int i, int thread)
+{
+    PLAN *plan = arg;
+    load_row(plan->options, image_row(plan->image, i), plan->image->width);
+}
+
+// Run the point filters fused into the pass on row i, once the columns have been blurred last
+static void store_rows(void *arg, int i, int thread)
+{
+    PLAN *plan = arg;
+    store_row(plan->options, image_row(plan->image, i), plan->image->width);
+}
+
+// Blur row i in place through a line of doubles, running the loads fused into the pass on it first if the rows
+// are blurred first, or the stores after it if they are blurred last
+static void blur_row(void *arg, int i, int thread)
+{
+    PLAN *plan = arg;
+    int width = plan->image->width;
+    RGBQUAD *row = image_row(plan->image, i);
+    double *line = scratch(SCRATCH_LINE, 3 * (size_t) width * sizeof(double));
+    if (line == NULL)
+    {
+        plan->failed = 1;
+        return;
+    }
+
+    if (!plan->columns_first)
+    {
+        load_row(plan->options, row, width);
+    }
+    for (int s = 0; s < width; s++)
+    {
+        const RGBQUAD *pixel = &row[plan->reverse_rows ? width - 1 - s : s];
+        line[3 * s] = pixel->rgbBlue;
+        line[3 * s + 1] = pixel->rgbGreen;
+        line[3 * s + 2] = pixel->rgbRed;
+    }
+    blur_line(line, 3, &plan->across, &plan->recursion);
+    for (int s = 0; s < width; s++)
+    {
+        RGBQUAD *pixel = &row[plan->reverse_rows ? width - 1 - s : s];
+        double inverse = plan->across.inverses != NULL ? plan->across.inverses[s] : 1;
+        pixel->rgbBlue = level(line[3 * s], inverse);
+        pixel->rgbGreen = level(line[3 * s + 1], inverse);
+        pixel->rgbRed = level(line[3 * s + 2], inverse);
+    }
+    if (plan->columns_first)
+    {
+        store_row(plan->options, row, width);
+    }
+}
+
+// Pack pixels in memory into 3-byte pixels, leaving out the fourth bytes
+static void pack_pixels(const RGBQUAD *row, BYTE *packed, int width)
+{
+    for (int j = pack_simd(row, packed, width, 0); j < width; j++)
+    {
+        packed[3 * j] = row[j].rgbBlue;
+        packed[3 * j + 1] = row[j].rgbGreen;
+        packed[3 * j + 2] = row[j].rgbRed;
+    }
+}
+
+// Spread 3-byte pixels back out into pixels in memory
+static void expand_pixels(const BYTE *packed, RGBQUAD *row, int width)
+{
+    for (int j = expand_simd(packed, row, width); j < width; j++)
+    {
+        row[j] = (RGBQUAD) {packed[3 * j], packed[3 * j + 1], packed[3 * j + 2], 0};
+    }
+}
+
+// Blur block b of columns in place: gather its pixels from every row, run the recursion down and back up the
+// block, each step updating a whole row of the block at once, and write them back
+static void blur_columns(void *arg, int b, int thread)
+{
+    PLAN *plan = arg;
+    IMAGE *image = plan->image;
+    int height = image->height;
+    int first = b * BLOCK;
+    int pixels = image->width - first < BLOCK ? image->width - first : BLOCK;
+    int lanes = 3 * pixels;
+    double *block = scratch(SCRATCH_BLOCK, (size_t) height * lanes * sizeof(double));
+    if (block == NULL)
+    {
+        plan->failed = 1;
+        return;
+    }
+
+    // Each pixel's three channels take a lane apiece, and the fourth bytes none: the pixels of each row of the
+    // block are packed to 3 bytes apiece, and spread back out once they are blurred
+    BYTE packed[LANES];
+    for (int s = 0; s < height; s++)
+    {
+        const RGBQUAD *row = image_row(image, plan->reverse_columns ? height - 1 - s : s) + first;
+        double *p = block + (size_t) s * lanes;
+        pack_pixels(row, packed, pixels);
+        for (int l = 0; l < lanes; l++)
+        {
+            p[l] = packed[l];
+        }
+    }
+    blur_line(block, lanes, &plan->down, &plan->recursion);
+    for (int s = 0; s < height; s++)
+    {
+        RGBQUAD *row = image_row(image, plan->reverse_columns ? height - 1 - s : s) + first;
+        const double *p = block + (size_t) s * lanes;
+        double inverse = plan->down.inverses != NULL ? plan->down.inverses[s] : 1;
+        for (int l = 0; l < lanes; l++)
+        {
+            packed[l] = level(p[l], inverse);
+        }
+        expand_pixels(packed, row, pixels);
+    }
+}
+
+int recursive_gaussian(IMAGE *image, const OPTIONS *options, POOL *pool)
+{
+    int width = image->width;
+    int height = image->height;
+
+    // The passes run across the image as it is seen once turned (see reorient_gaussian()), and down it as it is
+    // seen, whichever way up its rows are stored
+    const ORIENTATION *turned = &options->turned;
+    PLAN plan = {.image = image, .options = options, .recursion = coefficients(options->sigma),
+                 .columns_first = turned->transpose,
+                 .reverse_rows = turned->transpose ? turned->flip : turned->mirror,
+                 .reverse_columns = (turned->transpose ? turned->mirror : turned->flip) != image->bottom_up,
+                 .failed = 0};
+
+    // Every row has the same ends, and so does every column
+    double *columns = scratch(SCRATCH_COLUMNS, 3 * (size_t) width * sizeof(double));
+    double *rows = scratch(SCRATCH_ROWS, 3 * (size_t) height * sizeof(double));
+    if (columns == NULL || rows == NULL)
+    {
+        return 1;
+    }
+    measure(&plan.across, width, options->border, &plan.recursion, columns);
+    measure(&plan.down, height, options->border, &plan.recursion, rows);
+
+    // Blur every row and then every block of columns, or the other way around, each pass once the one before it
+    // has finished, with the point filters fused into the loads before the first and the stores after the last
+    int blocks = (width + BLOCK - 1) / BLOCK;
+    const FUSION *fusion = options->fusion;
+    if (plan.columns_first)
+    {
+        if (fusion != NULL && fusion->load_count > 0)
+        {
+            pool_run(pool, height, load_rows, &plan);
+        }
+        pool_run(pool, blocks, blur_columns, &plan);
+        pool_run(pool, height, blur_row, &plan);
+    }
+    else
+    {
+        pool_run(pool, height, blur_row, &plan);
+        pool_run(pool, blocks, blur_columns, &plan);
+        if (fusion != NULL && fusion->store_count > 0)
+        {
+            pool_run(pool, height, store_rows, &plan);
+        }
+    }
+    return plan.failed;
+}
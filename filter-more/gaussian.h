@@ -0,0 +1,22 @@
+// Gaussian blurs of any size, by recursive filtering: a pixel costs the same whatever the standard deviation
+
+#ifndef GAUSSIAN_H
+#define GAUSSIAN_H
+
+#include "helpers.h"
+#include "pool.h"
+
+// Smallest and largest standard deviations accepted on the command line, in pixels
+#define MIN_SIGMA 0.5
+#define MAX_SIGMA 100
+
+// Blur the whole picture in image in place with a Gaussian of the options' sigma, treating the pixels past its
+// edges as the options' border mode says; returns 0 on success or 1 if it ran out of memory. The Gaussian is
+// approximated by Young and van Vliet's third-order recursive filter, run forwards and then backwards along every
+// row (which is rounded back into the image), and then down and back up every column, with Triggs and Sdika's
+// boundary conditions at the ends of each, so that nothing past the edges is ever padded in. The rows, and then
+// blocks of columns, are shared out over the pool's threads, and each is blurred the same way whichever thread
+// gets it, so the result does not depend on how many there are
+int recursive_gaussian(IMAGE *image, const OPTIONS *options, POOL *pool);
+
+#endif
@@ -1,182 +1,361 @@
-#include "helpers.h" // Includes the custom header file which likely defines the RGBTRIPLE structure and function prototypes.
-#include <math.h>    // Includes the mathematical functions library, used for mathematical operations such as rounding and square root calculations.
+#define _GNU_SOURCE  // For MADV_HUGEPAGE
+
+#include "helpers.h" // Includes the custom header file which likely defines the RGBQUAD structure and function prototypes.
+#include <stdlib.h>  // Includes strtol(), strtod() and aligned_alloc().
+#include <string.h>  // Includes memcpy() and strrchr(), used to split a border mode off an argument.
+#include <sys/mman.h> // Includes madvise(), to put large images on huge pages.
+
+#include "convolve.h" // Includes the convolution engine that blur and edges run on.
+#include "gaussian.h" // Includes the recursive filter that Gaussian blurs run on.
+
+// Convert one row to grayscale
+static void grayscale_row(RGBQUAD *row, int width, const OPTIONS *options)
+{
+    // Set each pixel's red, green, and blue to the rounded average of the three (see matrix.c).
+    matrix_row(row, width, &GRAYSCALE_MATRIX);
+}
 
 // Convert image to grayscale
 // Converts each pixel of the image to grayscale by averaging its red, green, and blue color values.
 // This is done by setting all color channels to the average value, resulting in a monochromatic image.
-void grayscale(int height, int width, RGBTRIPLE image[height][width])
+int grayscale(IMAGE *image, const HALO *halo, const OPTIONS *options)
 {
     // Iterate over each row of the image
-    for (int i = 0; i < height; i++)
+    for (int i = 0; i < image->height; i++)
     {
-        // Iterate over each column of the image
-        for (int j = 0; j < width; j++)
-        {
-            // Compute the average of the red, green, and blue components for the current pixel.
-            // (Note: Using `3.0` ensures floating-point division for accurate averaging.)
-            int mid_value = round((image[i][j].rgbtRed + image[i][j].rgbtBlue + image[i][j].rgbtGreen) / 3.0);
-            
-            // Set the red, green, and blue components of the current pixel to the computed average value.
-            // This effectively converts the pixel to grayscale.
-            image[i][j].rgbtRed = mid_value;
-            image[i][j].rgbtBlue = mid_value;
-            image[i][j].rgbtGreen = mid_value;
-        }
+        grayscale_row(image_row(image, i), image->width, options);
+    }
+
+    return 0;
+}
+
+// Apply the color matrix chosen on the command line to one row
+static void recolor_row(RGBQUAD *row, int width, const OPTIONS *options)
+{
+    matrix_row(row, width, &options->matrix);
+}
+
+// Apply a color matrix
+// Sets each channel of each pixel to a weighted sum of its red, green, and blue, plus an offset.
+int recolor(IMAGE *image, const HALO *halo, const OPTIONS *options)
+{
+    for (int i = 0; i < image->height; i++)
+    {
+        recolor_row(image_row(image, i), image->width, options);
+    }
+
+    return 0;
+}
+
+// Reflect one row
+static void reflect_row(RGBQUAD *row, int width, const OPTIONS *options)
+{
+    // Initialize two pointers for the start and end of the current row
+    int start = 0;
+    int end = width - 1;
+
+    // Swap pixels from the start and end, moving towards the center of the row
+    while (start < end)
+    {
+        // Temporarily store the pixel at the start position
+        RGBQUAD temp = row[start];
+        
+        // Swap the pixel at the start position with the pixel at the end position
+        row[start] = row[end];
+        row[end] = temp;
+
+        // Move the start pointer right and the end pointer left
+        start++;
+        end--;
     }
 }
 
 // Reflect image horizontally
 // Mirrors the image horizontally by swapping pixels from the left side with those on the right side of each row.
 // This operation creates a mirrored effect along the vertical axis.
-void reflect(int height, int width, RGBTRIPLE image[height][width])
+int reflect(IMAGE *image, const HALO *halo, const OPTIONS *options)
 {
     // Iterate over each row of the image
-    for (int i = 0; i < height; i++)
+    for (int i = 0; i < image->height; i++)
     {
-        // Initialize two pointers for the start and end of the current row
-        int start = 0;
-        int end = width - 1;
+        reflect_row(image_row(image, i), image->width, options);
+    }
+
+    return 0;
+}
 
-        // Swap pixels from the start and end, moving towards the center of the row
-        while (start < end)
-        {
-            // Temporarily store the pixel at the start position
-            RGBTRIPLE temp = image[i][start];
-            
-            // Swap the pixel at the start position with the pixel at the end position
-            image[i][start] = image[i][end];
-            image[i][end] = temp;
+// Bytes in a huge page, which the rows of images at least that large are aligned to
+#define HUGE_PAGE (2 * 1024 * 1024)
 
-            // Move the start pointer right and the end pointer left
-            start++;
-            end--;
-        }
+BYTE *alloc_rows(size_t size)
+{
+    // aligned_alloc() wants a whole number of alignments, and at least one
+    size_t alignment = size >= HUGE_PAGE ? HUGE_PAGE : ROW_ALIGNMENT;
+    size_t rounded = (size + alignment - 1) & ~(alignment - 1);
+    BYTE *rows = aligned_alloc(alignment, rounded > 0 ? rounded : alignment);
+
+    // A large image is read into rows that nothing has touched yet, and on huge pages (where the kernel allows
+    // them) that takes one page fault every 2 MB instead of every 4 KB
+#ifdef MADV_HUGEPAGE
+    if (rows != NULL && alignment == HUGE_PAGE)
+    {
+        madvise(rows, rounded, MADV_HUGEPAGE);
     }
+#endif
+    return rows;
 }
 
-// Blur image
-// Applies a blur effect to the image by averaging the colors of neighboring pixels in a 3x3 grid.
-// This operation smooths out transitions and reduces sharpness in the image.
-void blur(int height, int width, RGBTRIPLE image[height][width])
+void turn(ORIENTATION *orientation, int transpose, int mirror, int flip)
 {
-    // Create a temporary copy of the image to store original pixel values
-    // This prevents modifying pixels while calculating the blur effect.
-    RGBTRIPLE temp[height][width];
-    for (int i = 0; i < height; i++)
+    // Transposing swaps the axes, so a reflection done before it is a flip after it, and the other way around
+    if (transpose)
     {
-        for (int j = 0; j < width; j++)
-        {
-            // Copy each pixel from the original image to the temporary image
-            temp[i][j] = image[i][j];
-        }
+        int mirrored = orientation->mirror;
+        orientation->mirror = orientation->flip;
+        orientation->flip = mirrored;
+        orientation->transpose ^= 1;
     }
+    orientation->mirror ^= mirror;
+    orientation->flip ^= flip;
+}
 
-    // Iterate over each row of the image
-    for (int i = 0; i < height; i++)
-    {
-        // Iterate over each column of the image
-        for (int j = 0; j < width; j++)
-        {
-            // Initialize variables to accumulate the sum of color values and count the number of pixels considered
-            int sumRed = 0, sumGreen = 0, sumBlue = 0;
-            int count = 0;
-
-            // Iterate over the neighboring pixels within a 3x3 grid centered around the current pixel
-            // This covers the pixel itself and its 8 neighbors
-            for (int x = i - 1; x <= i + 1; x++)
-            {
-                for (int y = j - 1; y <= j + 1; y++)
-                {
-                    // Check if the neighboring pixel is within the image boundaries
-                    if (x >= 0 && x < height && y >= 0 && y < width)
-                    {
-                        // Accumulate the color values of the neighboring pixel
-                        sumRed += temp[x][y].rgbtRed;
-                        sumGreen += temp[x][y].rgbtGreen;
-                        sumBlue += temp[x][y].rgbtBlue;
-                        count++;
-                    }
-                }
-            }
-
-            // Compute the average color values for the current pixel and update its color
-            // Casting `count` to `float` ensures accurate division
-            image[i][j].rgbtRed = round((float)sumRed / count);
-            image[i][j].rgbtGreen = round((float)sumGreen / count);
-            image[i][j].rgbtBlue = round((float)sumBlue / count);
-        }
+// How each of the transforms turns an image: reflecting swaps left and right, flipping swaps top and bottom, and
+// rotating clockwise by 90 degrees is transposing and then reflecting (by 270, transposing and then flipping)
+static void orient_reflect(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, 0, 1, 0);
+}
+static void orient_flip(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, 0, 0, 1);
+}
+static void orient_transpose(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, 1, 0, 0);
+}
+static void orient_rotate(ORIENTATION *orientation, const OPTIONS *options)
+{
+    turn(orientation, options->degrees != 180, options->degrees != 270, options->degrees != 90);
+}
+
+// Run a list of fused point filters on a row, in the order they were chained
+static void run_steps(const STEP *const *steps, int count, RGBQUAD *row, int width)
+{
+    for (int k = 0; k < count; k++)
+    {
+        steps[k]->filter->row(row, width, &steps[k]->options);
     }
 }
 
+void load_row(const OPTIONS *options, RGBQUAD *row, int width)
+{
+    if (options->fusion != NULL)
+    {
+        run_steps(options->fusion->loads, options->fusion->load_count, row, width);
+    }
+}
+
+void store_row(const OPTIONS *options, RGBQUAD *row, int width)
+{
+    if (options->fusion != NULL)
+    {
+        run_steps(options->fusion->stores, options->fusion->store_count, row, width);
+    }
+}
+
+// Run only the point filters fused into a pass
+// Every point filter in a chain is applied to one row before moving to the next, while the row is in cache
+int points(IMAGE *image, const HALO *halo, const OPTIONS *options)
+{
+    for (int i = 0; i < image->height; i++)
+    {
+        load_row(options, image_row(image, i), image->width);
+    }
+
+    return 0;
+}
+
+// Blur image
+// Applies a box blur to the image by averaging the colors of neighboring pixels in a square around each pixel,
+// radius pixels in every direction (a 3x3 grid for the default radius of 1): a convolution with a box of 1s
+// (see convolve.c), which costs the same per pixel however large the radius is.
+int blur(IMAGE *image, const HALO *halo, const OPTIONS *options)
+{
+    KERNEL box = {.size = 2 * options->radius + 1, .box = 1};
+    return convolve(image, halo, options, &box);
+}
+
+// Blur image with a Gaussian
+// Weighs the pixels around each pixel by a Gaussian of standard deviation sigma, which can be far wider than any
+// kernel: a recursive filter (see gaussian.c) approximates it, at a cost per pixel that does not depend on sigma.
+int gaussian(IMAGE *image, const OPTIONS *options, POOL *pool)
+{
+    return recursive_gaussian(image, options, pool);
+}
+
 // Detect edges
 // Applies an edge-detection filter to the image by computing gradients in the x and y directions.
 // The gradients are calculated using convolution with Sobel operators, which highlight edges in the image.
-void edges(int height, int width, RGBTRIPLE image[height][width])
+// Pixels on the border of the image take a careful path; everything else takes a branch-free, vectorized path in
+// integers.
+int edges(IMAGE *image, const HALO *halo, const OPTIONS *options)
 {
-    // Create a temporary copy of the image to store original pixel values
-    // This prevents modifying pixels while calculating edge detection.
-    RGBTRIPLE temp[height][width];
+    return convolve(image, halo, options, &SOBEL_KERNEL);
+}
 
-    // Define Sobel operators for edge detection in the x and y directions
-    // These operators are used to compute the gradient of the image
-    int gx[3][3] = {{-1, 0, 1}, {-2, 0, 2}, {-1, 0, 1}};
-    int gy[3][3] = {{-1, -2, -1}, {0, 0, 0}, {1, 2, 1}};
+// Convolve image with the kernel chosen on the command line, which is given as the image is seen, so it is flipped
+// for rows stored bottom to top (a pair of gradients is left alone, since flipping it gives the same magnitudes)
+int convolution(IMAGE *image, const HALO *halo, const OPTIONS *options)
+{
+    if (!image->bottom_up || options->kernel.gradients)
+    {
+        return convolve(image, halo, options, &options->kernel);
+    }
+    KERNEL flipped = options->kernel;
+    turn_kernel(&flipped, 0, 0, 1);
+    return convolve(image, halo, options, &flipped);
+}
+
+// A kernel that is not symmetric runs before the image is turned instead of after it, so it is turned back first:
+// the inverse of transposing, reflecting and flipping is flipping, reflecting and transposing, which is
+// transposing and then reflecting by what was the flip, and flipping by what was the reflection
+static void reorient_kernel(OPTIONS *options, const ORIENTATION *orientation)
+{
+    int transpose = orientation->transpose;
+    turn_kernel(&options->kernel, transpose, transpose ? orientation->flip : orientation->mirror,
+                transpose ? orientation->mirror : orientation->flip);
+}
 
-    // Copy the original image to the temporary image
-    for (int i = 0; i < height; i++)
+// A Gaussian blur that runs before the image is turned runs its passes the way they would go across the turned
+// image: along columns first if it is transposed, and each from the other end if it is reflected that way
+static void reorient_gaussian(OPTIONS *options, const ORIENTATION *orientation)
+{
+    options->turned = *orientation;
+}
+
+// Read the border mode that may end the argument of a filter that weighs neighbours, e.g. the /clamp of
+// -b 5/clamp, returning 0 if there is something else there
+static int parse_suffix(const char *end, OPTIONS *options)
+{
+    return *end == '\0' || (*end == '/' && parse_border(end + 1, &options->border));
+}
+
+// Read the radius of a blur, e.g. the 5 of -b 5 (or of -b 5/mirror)
+static int parse_radius(const char *text, OPTIONS *options)
+{
+    char *end;
+    long radius = strtol(text, &end, 10);
+    if (end == text || radius < 1 || radius > MAX_RADIUS || !parse_suffix(end, options))
     {
-        for (int j = 0; j < width; j++)
-        {
-            temp[i][j] = image[i][j];
-        }
+        return 0;
     }
+    options->radius = radius;
+    return 1;
+}
 
-    // Iterate over each row of the image
-    for (int i = 0; i < height; i++)
-    {
-        // Iterate over each column of the image
-        for (int j = 0; j < width; j++)
-        {
-            // Initialize variables to accumulate the gradients in the x and y directions for red, green, and blue components
-            int gxRed = 0, gxGreen = 0, gxBlue = 0;
-            int gyRed = 0, gyGreen = 0, gyBlue = 0;
-
-            // Iterate over the neighboring pixels within a 3x3 grid centered around the current pixel
-            // Compute gradients by applying Sobel operators
-            for (int x = i - 1; x <= i + 1; x++)
-            {
-                for (int y = j - 1; y <= j + 1; y++)
-                {
-                    // Check if the neighboring pixel is within the image boundaries
-                    if (x >= 0 && x < height && y >= 0 && y < width)
-                    {
-                        // Compute gradient values for each color component
-                        int weightX = gx[x - (i - 1)][y - (j - 1)];
-                        int weightY = gy[x - (i - 1)][y - (j - 1)];
-                        gxRed += temp[x][y].rgbtRed * weightX;
-                        gxGreen += temp[x][y].rgbtGreen * weightX;
-                        gxBlue += temp[x][y].rgbtBlue * weightX;
-                        gyRed += temp[x][y].rgbtRed * weightY;
-                        gyGreen += temp[x][y].rgbtGreen * weightY;
-                        gyBlue += temp[x][y].rgbtBlue * weightY;
-                    }
-                }
-            }
-
-            // Compute the final gradient magnitude for each color component
-            int finalRed = round(sqrt(gxRed * gxRed + gyRed * gyRed));
-            int finalGreen = round(sqrt(gxGreen * gxGreen + gyGreen * gyGreen));
-            int finalBlue = round(sqrt(gxBlue * gxBlue + gyBlue * gyBlue));
-
-            // Clamp the gradient values to ensure they do not exceed the maximum allowed value of 255
-            finalRed = finalRed > 255 ? 255 : finalRed;
-            finalGreen = finalGreen > 255 ? 255 : finalGreen;
-            finalBlue = finalBlue > 255 ? 255 : finalBlue;
-
-            // Set the red, green, and blue components of the current pixel to the computed edge-detected values
-            image[i][j].rgbtRed = finalRed;
-            image[i][j].rgbtGreen = finalGreen;
-            image[i][j].rgbtBlue = finalBlue;
-        }
+// Read the standard deviation of a Gaussian blur, e.g. the 20 of -G 20 (or of -G 2.5/clamp)
+static int parse_sigma(const char *text, OPTIONS *options)
+{
+    char *end;
+    double sigma = strtod(text, &end);
+    if (end == text || !(sigma >= MIN_SIGMA && sigma <= MAX_SIGMA) || !parse_suffix(end, options))
+    {
+        return 0;
+    }
+    options->sigma = sigma;
+    return 1;
+}
+
+// Read the border mode of edges, e.g. the clamp of -e clamp
+static int parse_edges(const char *text, OPTIONS *options)
+{
+    return parse_border(text, &options->border);
+}
+
+// Read a kernel, e.g. the sharpen of -k sharpen (or of -k sharpen/clamp); the border mode comes after the last
+// slash, since a kernel file's path may have slashes of its own
+static int parse_weights(const char *text, OPTIONS *options)
+{
+    BORDER border;
+    const char *slash = strrchr(text, '/');
+    if (slash == NULL || !parse_border(slash + 1, &border))
+    {
+        return parse_kernel(text, &options->kernel);
+    }
+    char kernel[4096];
+    if (slash - text >= (int) sizeof(kernel))
+    {
+        return 0;
     }
+    memcpy(kernel, text, slash - text);
+    kernel[slash - text] = '\0';
+    if (!parse_kernel(kernel, &options->kernel))
+    {
+        return 0;
+    }
+    options->border = border;
+    return 1;
+}
+
+// Read a color matrix, e.g. the sepia of -m sepia
+static int parse_colors(const char *text, OPTIONS *options)
+{
+    return parse_matrix(text, &options->matrix);
 }
+
+// Read the angle of a rotation, which must be a quarter turn (or two, or three)
+static int parse_degrees(const char *text, OPTIONS *options)
+{
+    char *end;
+    long degrees = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || (degrees != 90 && degrees != 180 && degrees != 270))
+    {
+        return 0;
+    }
+    options->degrees = degrees;
+    return 1;
+}
+
+// Blurs need as many rows of context as their radius
+static int radius_halo(const OPTIONS *options)
+{
+    return options->radius;
+}
+
+// Edges need the rows just above and below
+static int one_row(const OPTIONS *options)
+{
+    return 1;
+}
+
+// Convolutions need half their kernel's rows
+static int kernel_halo(const OPTIONS *options)
+{
+    return options->kernel.size / 2;
+}
+
+// Settings used unless the command line says otherwise
+const OPTIONS DEFAULT_OPTIONS = {.radius = 1, .sigma = 2, .matrix = {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}, 1},
+                                 .degrees = 90, .kernel = {.size = 3, .weights = {{1, 2, 1, 2, 4, 2, 1, 2, 1}}},
+                                 .border = BORDER_SKIP};
+
+// The filters, with the arguments they take and the rows of context they need around a band
+// (every one of them commutes with reflecting, flipping, rotating and transposing the image, whatever the border
+// mode: Sobel gradients only change sign or swap with each other, and the rest treat every direction alike, except
+// for a kernel, which is turned to suit, and a Gaussian blur, whose passes are: they round to whole levels in
+// between, so the order and direction they run in shows)
+const FILTER FILTERS[] =
+{
+    {.flag = 'b', .name = "blur", .parse = parse_radius, .halo = radius_halo, .apply = blur, .symmetric = 1},
+    {.flag = 'G', .name = "gaussian", .parse = parse_sigma, .whole = gaussian, .reorient = reorient_gaussian},
+    {.flag = 'e', .name = "edges", .parse = parse_edges, .halo = one_row, .apply = edges, .symmetric = 1},
+    {.flag = 'k', .name = "kernel", .parse = parse_weights, .halo = kernel_halo, .apply = convolution,
+     .reorient = reorient_kernel},
+    {.flag = 'g', .name = "grayscale", .apply = grayscale, .row = grayscale_row, .symmetric = 1},
+    {.flag = 'm', .name = "matrix", .parse = parse_colors, .apply = recolor, .row = recolor_row, .symmetric = 1},
+    {.flag = 'r', .name = "reflect", .apply = reflect, .row = reflect_row, .orient = orient_reflect, .symmetric = 1},
+    {.flag = 't', .name = "transpose", .orient = orient_transpose, .symmetric = 1},
+    {.flag = 'v', .name = "flip", .orient = orient_flip, .symmetric = 1},
+    {.flag = 'R', .name = "rotate", .parse = parse_degrees, .orient = orient_rotate, .symmetric = 1},
+    {0}
+};
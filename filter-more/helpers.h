@@ -1,13 +1,175 @@
+#ifndef HELPERS_H
+#define HELPERS_H
+
+#include <stddef.h>
+
 #include "bmp.h"
+#include "kernel.h"
+#include "matrix.h"
+#include "pool.h"
+
+// A view of an image's rows in memory, which may be separated by padding bytes
+// (e.g., a rectangle cut out of a larger image)
+typedef struct
+{
+    int height;     // Number of rows
+    int width;      // Number of pixels in each row
+    size_t stride;  // Number of bytes from the start of one row to the start of the next
+    BYTE *data;     // First byte of the first row
+    int bottom_up;  // Whether the rows are stored bottom to top, as most BMP files store them
+} IMAGE;
+
+// Bytes that the rows of an image in memory are aligned to: a cache line, so that every row starts on one, and
+// vector loads of whole pixels never straddle two where they need not
+#define ROW_ALIGNMENT 64
+
+// Get the number of bytes from the start of one row of width pixels to the next, padded to ROW_ALIGNMENT
+static inline size_t row_stride(int width)
+{
+    return ((size_t) width * sizeof(RGBQUAD) + ROW_ALIGNMENT - 1) & ~(size_t) (ROW_ALIGNMENT - 1);
+}
+
+// Allocate size bytes of rows, aligned to ROW_ALIGNMENT (and on huge pages, for a large image, where the kernel
+// allows them), returning NULL if there is no memory; free them with free()
+BYTE *alloc_rows(size_t size);
+
+// Get a pointer to the first pixel of row i of an image
+static inline RGBQUAD *image_row(const IMAGE *image, int i)
+{
+    return (RGBQUAD *) (image->data + (size_t) i * image->stride);
+}
+
+// Copies of the unfiltered rows just outside a band of an image, so that the band can be
+// filtered while other threads are changing the rows around it
+typedef struct
+{
+    int above;              // Number of rows above the band (fewer near the top of the image)
+    int below;              // Number of rows below the band (fewer near the bottom of the image)
+    const RGBQUAD *rows;    // The rows above the band, then the rows below it, top to bottom
+} HALO;
+
+// Get unfiltered row x of a band, where rows before the first and past the last come from the halo
+static inline const RGBQUAD *source_row(const IMAGE *image, const HALO *halo, int x)
+{
+    if (x < 0)
+    {
+        return halo->rows + (size_t) (halo->above + x) * image->width;
+    }
+    if (x >= image->height)
+    {
+        return halo->rows + (size_t) (halo->above + x - image->height) * image->width;
+    }
+    return image_row(image, x);
+}
+
+// Largest blur radius accepted on the command line
+#define MAX_RADIUS 1000
+
+// Longest chain of filters that can be applied in one run (e.g., -g -b -r)
+#define MAX_STEPS 16
+
+// Point filters fused into a pass of another filter (see below)
+typedef struct FUSION FUSION;
+
+// How an image is turned, as it is seen (first row at the top): transposed (its rows becoming columns) if
+// transpose is set, then reflected horizontally if mirror is set, then flipped vertically if flip is set. Every
+// rotation and reflection of an image, and every combination of them, is one of these eight
+typedef struct
+{
+    int transpose;
+    int mirror;
+    int flip;
+} ORIENTATION;
+
+// Turn an orientation further: transpose, then reflect, then flip, for each that is set
+void turn(ORIENTATION *orientation, int transpose, int mirror, int flip);
+
+// Settings chosen for a filter on the command line
+typedef struct
+{
+    int radius;            // Pixels in each direction that a blur averages over
+    double sigma;          // Standard deviation of a Gaussian blur, in pixels
+    MATRIX matrix;         // Weights a color matrix combines each pixel's channels with
+    int degrees;           // Degrees clockwise that a rotate turns the image (90, 180 or 270)
+    KERNEL kernel;         // Weights a convolution sums each pixel's neighbours with
+    BORDER border;         // What a filter that weighs neighbours does past the edges of the image
+    ORIENTATION turned;    // How the image a Gaussian blur is given was turned from the one it blurs as seen
+    const FUSION *fusion;  // Point filters to run on rows as the filter loads and stores them, or NULL for none
+} OPTIONS;
+
+// Settings used unless the command line says otherwise
+extern const OPTIONS DEFAULT_OPTIONS;
+
+// A filter that can be applied to any band of rows of an image, given the band's halo
+typedef struct
+{
+    char flag;                                   // Command-line flag that selects the filter
+    const char *name;                            // What the filter is called, for reports
+    int (*parse)(const char *, OPTIONS *);       // Reads an argument given after the flag, or NULL if it takes none
+    int (*halo)(const OPTIONS *);                // Rows of context needed above and below a band, or NULL for none
+    int (*apply)(IMAGE *, const HALO *, const OPTIONS *);  // One of the functions below
+    int (*whole)(IMAGE *, const OPTIONS *, POOL *);        // Instead, for a filter that needs the whole picture
+                                                           // at once, filters it on the pool's threads
+    void (*row)(RGBQUAD *, int, const OPTIONS *);          // Filters one row on its own, or NULL if it needs others
+    void (*orient)(ORIENTATION *, const OPTIONS *);        // Turns an orientation the way the filter moves pixels
+                                                           // around, or NULL if it changes them instead
+    int symmetric;                               // Whether filtering a turned image gives the turned result
+    void (*reorient)(OPTIONS *, const ORIENTATION *);      // Changes a filter that is not symmetric so that it
+                                                           // gives the turned result, or NULL
+} FILTER;
+
+// One filter of a chain, with its own settings
+typedef struct
+{
+    const FILTER *filter;
+    OPTIONS options;
+} STEP;
+
+// Point filters fused into a pass of another filter, so that each row is only brought into cache once:
+// the loads run on every row of the band the first time the filter reads it, and the stores on every row
+// as soon as the filter has written it. Halo rows are copies, and get the loads when they are copied
+struct FUSION
+{
+    const STEP *loads[MAX_STEPS];
+    int load_count;
+    const STEP *stores[MAX_STEPS];
+    int store_count;
+};
+
+// Run the point filters fused into a pass on a row it has just loaded, or on one it has just stored
+void load_row(const OPTIONS *options, RGBQUAD *row, int width);
+void store_row(const OPTIONS *options, RGBQUAD *row, int width);
+
+// The supported filters, ending with one whose flag is 0
+extern const FILTER FILTERS[];
+
+// Each filter changes the rows of image in place, returning 0 on success or 1 if it ran out of memory;
+// halo may be NULL when image is the whole picture. Flips, rotations and transposes have no such function: they
+// only change the orientation that the image is written in (see chain.h)
+
 // Convert image to grayscale
-void grayscale(int height, int width, RGBTRIPLE image[height][width]);
+int grayscale(IMAGE *image, const HALO *halo, const OPTIONS *options);
+
+// Apply a color matrix to image
+int recolor(IMAGE *image, const HALO *halo, const OPTIONS *options);
 
 // Reflect image horizontally
-void reflect(int height, int width, RGBTRIPLE image[height][width]);
+int reflect(IMAGE *image, const HALO *halo, const OPTIONS *options);
+
+// Run only the point filters fused into a pass (the loads) on every row
+int points(IMAGE *image, const HALO *halo, const OPTIONS *options);
 
 // Detect edges
-void edges(int height, int width, RGBTRIPLE image[height][width]);
+int edges(IMAGE *image, const HALO *halo, const OPTIONS *options);
 
 // Blur image
-void blur(int height, int width, RGBTRIPLE image[height][width]);
+int blur(IMAGE *image, const HALO *halo, const OPTIONS *options);
+
+// Blur image with a Gaussian. Every pixel depends on every other, so image must be the whole picture, and the
+// filter shares the work out over the pool itself
+int gaussian(IMAGE *image, const OPTIONS *options, POOL *pool);
+
+// Convolve image with the kernel chosen on the command line
+int convolution(IMAGE *image, const HALO *halo, const OPTIONS *options);
 
+#endif
@@ -0,0 +1,174 @@
+#include <stdio.h>   // For reading kernel files
+#include <stdlib.h>  // For strtol() and labs()
+#include <string.h>  // For strcmp(), strncmp(), strchr() and strcspn()
+
+#include "kernel.h"
+
+// The Sobel operators, weighing the columns to the right minus those to the left, and the rows below minus those
+// above (the middle row and column counting twice)
+const KERNEL SOBEL_KERNEL = {.size = 3, .gradients = 1, .divisor = 1,
+                             .weights = {{-1, 0, 1, -2, 0, 2, -1, 0, 1}, {-1, -2, -1, 0, 0, 0, 1, 2, 1}}};
+
+// The other presets
+static const struct
+{
+    const char *name;
+    KERNEL kernel;
+} PRESETS[] =
+{
+    {"gaussian", {.size = 3, .weights = {{1, 2, 1, 2, 4, 2, 1, 2, 1}}}},
+    {"gaussian5", {.size = 5, .weights = {{1, 4, 6, 4, 1, 4, 16, 24, 16, 4, 6, 24, 36, 24, 6, 4, 16, 24, 16, 4,
+                                           1, 4, 6, 4, 1}}}},
+    {"sharpen", {.size = 3, .divisor = 1, .weights = {{0, -1, 0, -1, 5, -1, 0, -1, 0}}}},
+    {"emboss", {.size = 3, .divisor = 1, .weights = {{-2, -1, 0, -1, 1, 1, 0, 1, 2}}}},
+    {"laplacian", {.size = 3, .divisor = 1, .weights = {{0, -1, 0, -1, 4, -1, 0, -1, 0}}}},
+    {"prewitt", {.size = 3, .gradients = 1, .divisor = 1,
+                 .weights = {{-1, 0, 1, -1, 0, 1, -1, 0, 1}, {-1, -1, -1, 0, 0, 0, 1, 1, 1}}}},
+    {"scharr", {.size = 3, .gradients = 1, .divisor = 1,
+                .weights = {{-3, 0, 3, -10, 0, 10, -3, 0, 3}, {-3, -10, -3, 0, 0, 0, 3, 10, 3}}}}
+};
+
+// Read the weights of a kernel, separated by commas, colons or white space (with # starting a comment that runs to
+// the end of the line, in a file), returning 0 if they are not a square of an odd number of whole numbers
+static int parse_weights(const char *text, KERNEL *kernel)
+{
+    int count = 0;
+    long sum = 0;
+    int negative = 0;
+    const char *next = text;
+    while (1)
+    {
+        // Skip to the next number
+        while (*next == ',' || *next == ':' || *next == ' ' || *next == '\t' || *next == '\r' || *next == '\n' ||
+               *next == '#')
+        {
+            next = *next == '#' ? next + strcspn(next, "\n") : next + 1;
+        }
+        if (*next == '\0')
+        {
+            break;
+        }
+
+        char *end;
+        long weight = strtol(next, &end, 10);
+        if (end == next || count == MAX_KERNEL * MAX_KERNEL || labs(weight) > MAX_KERNEL_WEIGHT ||
+            strchr(",: \t\r\n#", *end) == NULL)
+        {
+            return 0;
+        }
+        kernel->weights[0][count++] = weight;
+        sum += weight;
+        negative |= weight < 0;
+        next = end;
+    }
+
+    int size = 1;
+    while (size * size < count)
+    {
+        size += 2;
+    }
+    if (count == 0 || size * size != count)
+    {
+        return 0;
+    }
+    kernel->size = size;
+    kernel->box = 0;
+    kernel->gradients = 0;
+
+    // A kernel that only averages divides by the weights that are there; anything else by its sum, unless that is
+    // not positive (e.g., a Laplacian, whose weights add up to 0)
+    kernel->divisor = negative ? (sum > 0 ? sum : 1) : 0;
+    return sum > 0 || negative;
+}
+
+// Read a kernel file, returning 0 if it cannot be read or does not hold a kernel
+static int parse_file(const char *path, KERNEL *kernel)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    char text[MAX_KERNEL_FILE + 1];
+    size_t length = fread(text, 1, sizeof(text), file);
+    fclose(file);
+    if (length > MAX_KERNEL_FILE)
+    {
+        return 0;
+    }
+    text[length] = '\0';
+    return strlen(text) == length && parse_weights(text, kernel);
+}
+
+int parse_kernel(const char *text, KERNEL *kernel)
+{
+    // Custom weights are read into a copy, so that the kernel is left alone if they turn out not to be a kernel
+    KERNEL custom = {.size = 0};
+    if (strcmp(text, "sobel") == 0)
+    {
+        *kernel = SOBEL_KERNEL;
+        return 1;
+    }
+    for (size_t p = 0; p < sizeof(PRESETS) / sizeof(PRESETS[0]); p++)
+    {
+        if (strcmp(text, PRESETS[p].name) == 0)
+        {
+            *kernel = PRESETS[p].kernel;
+            return 1;
+        }
+    }
+    int valid = strncmp(text, "file=", 5) == 0 ? parse_file(text + 5, &custom) : parse_weights(text, &custom);
+    if (valid)
+    {
+        *kernel = custom;
+    }
+    return valid;
+}
+
+int parse_border(const char *text, BORDER *border)
+{
+    static const char *const NAMES[] = {"skip", "clamp", "mirror"};
+    for (int b = 0; b < 3; b++)
+    {
+        if (strcmp(text, NAMES[b]) == 0)
+        {
+            *border = b;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int outside(int x, int first, int end, BORDER border)
+{
+    if (border == BORDER_CLAMP || end - first == 1)
+    {
+        return x < first ? first : end - 1;
+    }
+    int period = 2 * (end - first - 1);
+    int offset = (x - first) % period;
+    offset += offset < 0 ? period : 0;
+    return first + (offset < end - first ? offset : period - offset);
+}
+
+void turn_kernel(KERNEL *kernel, int transpose, int mirror, int flip)
+{
+    // Weight (i, j) of the turned kernel comes from the one the turn moves there: a transpose swaps i and j, a
+    // reflection counts j from the other side, and a flip counts i from the other side
+    int size = kernel->size;
+    KERNEL turned = *kernel;
+    for (int g = 0; g < 1 + kernel->gradients; g++)
+    {
+        for (int i = 0; i < size && !kernel->box; i++)
+        {
+            for (int j = 0; j < size; j++)
+            {
+                int row = flip ? size - 1 - i : i;
+                int column = mirror ? size - 1 - j : j;
+                turned.weights[g][i * size + j] = transpose ? kernel->weights[g][column * size + row] :
+                                                              kernel->weights[g][row * size + column];
+            }
+        }
+    }
+    *kernel = turned;
+}
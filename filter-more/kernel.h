@@ -0,0 +1,62 @@
+// Convolution kernels: the weights a filter sums the same channel of the pixels around each pixel with (e.g., a box
+// or Gaussian blur, sharpening, embossing, or a pair of gradients for edge detection)
+
+#ifndef KERNEL_H
+#define KERNEL_H
+
+#include "bmp.h"
+
+// Most rows and columns of weights a kernel may have, and the largest weight, which keeps every sum within 32 bits
+#define MAX_KERNEL 9
+#define MAX_KERNEL_WEIGHT 1000
+
+// Largest kernel file that is read
+#define MAX_KERNEL_FILE 4096
+
+// What a kernel does with the pixels it covers past the edges of the image: leaves them out (as the filters always
+// have), repeats the pixel on the edge, or mirrors the pixels inside the edge (... 2 1 | 0 1 2 ...)
+typedef enum
+{
+    BORDER_SKIP,
+    BORDER_CLAMP,
+    BORDER_MIRROR
+} BORDER;
+
+// Find the row or column that stands in for x, which is past one edge of first to end - 1: the one on the edge,
+// for clamp, or for mirror the one as far inside the edge as x is outside it (bouncing back and forth between
+// the edges when they are closer together than that)
+int outside(int x, int first, int end, BORDER border);
+
+// A square of weights centered on the pixel being filtered, row by row. Each channel becomes the weighted sum of
+// that channel around the pixel, divided by the divisor (rounding halves away from zero) and clamped to 0..255; a
+// divisor of 0 divides by the weights that cover pixels which are there, so that a kernel that averages does not
+// darken the border when it skips them. A pair of gradients is instead combined into the rounded magnitude of the
+// two sums, capped at 255
+typedef struct
+{
+    int size;       // Rows and columns of weights, an odd number up to MAX_KERNEL (any odd number for a box)
+    int box;        // Whether every weight is 1, in which case they are not stored
+    int gradients;  // Whether the kernel is a pair of gradients, rather than just the first set of weights
+    int divisor;
+    int weights[2][MAX_KERNEL * MAX_KERNEL];
+} KERNEL;
+
+// The Sobel operators, exactly as the edges filter has always applied them
+extern const KERNEL SOBEL_KERNEL;
+
+// Read a kernel given on the command line, returning 0 if text is not one. It is either a preset:
+//   gaussian (3x3), gaussian5 (5x5), sharpen, emboss or laplacian, or the gradient pairs sobel, prewitt or scharr,
+// or the weights themselves, row by row, separated by commas (or colons, which --chain lists can hold): 1, 9, 25,
+// 49 or 81 whole numbers, divided by their sum if it is positive (by the weights present, if none is negative),
+// or file=PATH, for a file that holds the weights in the same way, separated by commas or spaces, with # starting
+// a comment that runs to the end of the line
+int parse_kernel(const char *text, KERNEL *kernel);
+
+// Read the name of a border mode (skip, clamp or mirror), returning 0 if text is not one
+int parse_border(const char *text, BORDER *border);
+
+// Turn a kernel the way an image is turned: transposed if transpose is set, then reflected horizontally if mirror
+// is set, then flipped vertically if flip is set
+void turn_kernel(KERNEL *kernel, int transpose, int mirror, int flip);
+
+#endif
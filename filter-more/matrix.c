@@ -0,0 +1,247 @@
+#include <ctype.h>   // For isdigit()
+#include <math.h>    // For round()
+#include <stdlib.h>  // For strtol() and llabs()
+#include <string.h>  // For strcmp() and strncmp()
+
+#include "matrix.h"
+#include "simd.h"    // Vectorized color matrices
+
+// Custom weights are read to this many decimal places, i.e. in ten-thousandths
+#define PLACES 4
+#define SCALE 10000
+
+// Grayscale is round((red + green + blue) / 3.0), and sepia round(0.393 * red + 0.769 * green + 0.189 * blue)
+// and so on, in doubles
+const MATRIX GRAYSCALE_MATRIX = {{{1, 1, 1, 0}, {1, 1, 1, 0}, {1, 1, 1, 0}}, 3, 1};
+const MATRIX SEPIA_MATRIX = {{{393, 769, 189, 0}, {349, 686, 168, 0}, {272, 534, 131, 0}}, 1000, 1};
+const MATRIX IDENTITY_MATRIX = {{{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}}, 1, 0};
+
+// Weights of red, green and blue in a pixel's brightness (Rec. 601), in thousandths, for saturate=F
+static const int LUMA[3] = {299, 587, 114};
+
+// Presets that exchange two channels: the matrix that changes nothing, with two of its rows swapped
+static const struct
+{
+    const char *name;
+    int first, second;
+} SWAPS[] = {{"swap-rg", 0, 1}, {"swap-rb", 0, 2}, {"swap-gb", 1, 2}};
+
+// Read a decimal number with up to PLACES decimal places, as a whole number of ten-thousandths, e.g. -0.5 as
+// -5000; returns a pointer just past it, or NULL if text does not start with one
+static const char *parse_decimal(const char *text, long long *value)
+{
+    int negative = *text == '-';
+    if (*text == '-' || *text == '+')
+    {
+        text++;
+    }
+    if (!isdigit((unsigned char) *text) && !(*text == '.' && isdigit((unsigned char) text[1])))
+    {
+        return NULL;
+    }
+
+    // Stop at absurd sizes, so the number cannot overflow
+    long long whole = 0;
+    for (; isdigit((unsigned char) *text); text++)
+    {
+        whole = 10 * whole + (*text - '0');
+        if (whole > 1000000)
+        {
+            return NULL;
+        }
+    }
+    long long fraction = 0;
+    int places = 0;
+    if (*text == '.')
+    {
+        for (text++; isdigit((unsigned char) *text); text++, places++)
+        {
+            if (places == PLACES)
+            {
+                return NULL;
+            }
+            fraction = 10 * fraction + (*text - '0');
+        }
+    }
+    for (; places < PLACES; places++)
+    {
+        fraction *= 10;
+    }
+
+    *value = (negative ? -1 : 1) * (whole * SCALE + fraction);
+    return text;
+}
+
+// Greatest common divisor of two numbers, at least one of them positive
+static long long gcd(long long a, long long b)
+{
+    a = llabs(a);
+    b = llabs(b);
+    while (b != 0)
+    {
+        long long r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// Set a matrix to numerators over a denominator, reduced to lowest terms (which keeps the vector code's
+// numbers small: e.g., a custom matrix of whole numbers ends up over 1)
+static void reduce(long long numerators[3][4], long long denominator, MATRIX *matrix)
+{
+    long long divisor = denominator;
+    for (int c = 0; c < 3; c++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            divisor = gcd(divisor, numerators[c][k]);
+        }
+    }
+    for (int c = 0; c < 3; c++)
+    {
+        for (int k = 0; k < 4; k++)
+        {
+            matrix->numerators[c][k] = numerators[c][k] / divisor;
+        }
+    }
+    matrix->denominator = denominator / divisor;
+    matrix->doubles = 0;
+}
+
+int parse_matrix(const char *text, MATRIX *matrix)
+{
+    if (strcmp(text, "grayscale") == 0)
+    {
+        *matrix = GRAYSCALE_MATRIX;
+        return 1;
+    }
+    if (strcmp(text, "sepia") == 0)
+    {
+        *matrix = SEPIA_MATRIX;
+        return 1;
+    }
+    for (size_t s = 0; s < sizeof(SWAPS) / sizeof(SWAPS[0]); s++)
+    {
+        if (strcmp(text, SWAPS[s].name) == 0)
+        {
+            *matrix = IDENTITY_MATRIX;
+            memcpy(matrix->numerators[SWAPS[s].first], IDENTITY_MATRIX.numerators[SWAPS[s].second], sizeof(int[4]));
+            memcpy(matrix->numerators[SWAPS[s].second], IDENTITY_MATRIX.numerators[SWAPS[s].first], sizeof(int[4]));
+            return 1;
+        }
+    }
+
+    // Brightness adds the same amount to every channel
+    if (strncmp(text, "brightness=", 11) == 0)
+    {
+        char *end;
+        long amount = strtol(text + 11, &end, 10);
+        if (end == text + 11 || *end != '\0' || amount < -255 || amount > 255)
+        {
+            return 0;
+        }
+        *matrix = IDENTITY_MATRIX;
+        for (int c = 0; c < 3; c++)
+        {
+            matrix->numerators[c][3] = amount;
+        }
+        return 1;
+    }
+
+    // Saturation moves each channel away from the pixel's brightness by a factor F (to 2 decimal places):
+    // new = brightness + F * (old - brightness), in hundred-thousandths
+    if (strncmp(text, "saturate=", 9) == 0)
+    {
+        long long factor;
+        const char *end = parse_decimal(text + 9, &factor);
+        if (end == NULL || *end != '\0' || factor < 0 || factor > 10 * SCALE || factor % (SCALE / 100) != 0)
+        {
+            return 0;
+        }
+        factor /= SCALE / 100;
+        long long numerators[3][4] = {{0}};
+        for (int c = 0; c < 3; c++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                numerators[c][k] = LUMA[k] * (100 - factor) + (c == k ? 1000 * factor : 0);
+            }
+        }
+        reduce(numerators, 100000, matrix);
+        return 1;
+    }
+
+    // Otherwise the 12 numbers of the matrix, row by row, separated by commas (or colons, which --chain
+    // lists can hold)
+    long long numerators[3][4];
+    const char *next = text;
+    for (int i = 0; i < 12; i++)
+    {
+        long long value;
+        next = parse_decimal(next, &value);
+        int limit = i % 4 == 3 ? MAX_OFFSET : MAX_WEIGHT;
+        if (next == NULL || llabs(value) > (long long) limit * SCALE)
+        {
+            return 0;
+        }
+        numerators[i / 4][i % 4] = value;
+        if (i < 11 && *next != ',' && *next != ':')
+        {
+            return 0;
+        }
+        next += i < 11;
+    }
+    if (*next != '\0')
+    {
+        return 0;
+    }
+    reduce(numerators, SCALE, matrix);
+    return 1;
+}
+
+// Round one channel of a pixel, numerators / denominator, halves away from zero (or, if doubles is set, as in
+// doubles), and clamp it to 0..255
+static BYTE channel(const int *numerators, int denominator, int doubles, int red, int green, int blue)
+{
+    // round(n / d) is floor((2n + d) / 2d), for n >= 0; a negative n gives 0 however it rounds
+    long long n = (long long) numerators[0] * red + (long long) numerators[1] * green +
+                  (long long) numerators[2] * blue + numerators[3];
+    long long x = 2 * n + denominator;
+    if (x <= 0)
+    {
+        return 0;
+    }
+
+    // When n / d ends in exactly .5, grayscale and sepia have always used the weights in doubles, where they are
+    // not exact and can land either side of the half, so do the same for them to give the same results
+    if (doubles && x % (2LL * denominator) == 0)
+    {
+        double value = (double) numerators[0] / denominator * red + (double) numerators[1] / denominator * green +
+                       (double) numerators[2] / denominator * blue + (double) numerators[3] / denominator;
+        double rounded = round(value);
+        return rounded < 0 ? 0 : rounded > 255 ? 255 : rounded;
+    }
+
+    long long q = x / (2LL * denominator);
+    return q > 255 ? 255 : q;
+}
+
+void matrix_pixel(RGBQUAD *pixel, const MATRIX *matrix)
+{
+    int red = pixel->rgbRed;
+    int green = pixel->rgbGreen;
+    int blue = pixel->rgbBlue;
+    pixel->rgbRed = channel(matrix->numerators[0], matrix->denominator, matrix->doubles, red, green, blue);
+    pixel->rgbGreen = channel(matrix->numerators[1], matrix->denominator, matrix->doubles, red, green, blue);
+    pixel->rgbBlue = channel(matrix->numerators[2], matrix->denominator, matrix->doubles, red, green, blue);
+}
+
+void matrix_row(RGBQUAD *row, int width, const MATRIX *matrix)
+{
+    // Convert as much of the row as possible with vector instructions, then iterate over the remaining columns
+    for (int j = matrix_simd(row, width, matrix); j < width; j++)
+    {
+        matrix_pixel(&row[j], matrix);
+    }
+}
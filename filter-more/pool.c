@@ -0,0 +1,264 @@
+#define _POSIX_C_SOURCE 200809L  // For sysconf()
+
+#include <pthread.h>    // For threads, mutexes and condition variables
+#include <stdatomic.h>  // For the queues that threads steal from
+#include <stdlib.h>     // For malloc() and free()
+#include <unistd.h>     // For sysconf()
+
+#include "pool.h"
+#include "scratch.h"
+
+// The indices a thread has yet to run in the current run: the range [next, end), packed into one word (next in
+// the high half) so that its owner can take from the front while other threads steal from the back, both with a
+// single compare-and-swap. Each queue has a cache line to itself, so taking from it does not slow the others
+typedef struct
+{
+    _Alignas(64) _Atomic unsigned long long range;
+} QUEUE;
+
+struct POOL
+{
+    int threads;               // Threads that run tasks, including the caller's (thread 0)
+    pthread_t *workers;        // The threads - 1 threads started by the pool
+    QUEUE *queues;             // One queue per thread
+    pthread_mutex_t lock;      // Protects everything below
+    pthread_cond_t wake;       // Signalled when a run starts, or when the pool stops
+    pthread_cond_t finished;   // Signalled when the last task of a run finishes
+    TASK task;                 // The current run's task and its argument
+    void *arg;
+    _Atomic int pending;       // Indices not yet finished (read and written without the lock)
+    unsigned long generation;  // Incremented for every run, so workers can tell runs apart
+    int stopping;              // Set when the pool is being destroyed
+};
+
+// What each worker thread is told when it starts
+typedef struct
+{
+    POOL *pool;
+    int thread;
+} START;
+
+// Pack a range of indices into one word, and unpack it
+static unsigned long long pack(unsigned next, unsigned end)
+{
+    return (unsigned long long) next << 32 | end;
+}
+
+static unsigned first(unsigned long long range)
+{
+    return range >> 32;
+}
+
+static unsigned last(unsigned long long range)
+{
+    return (unsigned) range;
+}
+
+// Take the next index from the front of a thread's own queue, returning -1 if it is empty
+static int take(QUEUE *queue)
+{
+    unsigned long long range = atomic_load(&queue->range);
+    while (first(range) < last(range))
+    {
+        if (atomic_compare_exchange_weak(&queue->range, &range, pack(first(range) + 1, last(range))))
+        {
+            return first(range);
+        }
+    }
+    return -1;
+}
+
+// Steal the back half of another thread's queue into an empty queue of our own, returning the first stolen
+// index to run straight away, or -1 if the victim had nothing left
+static int steal(QUEUE *victim, QUEUE *own)
+{
+    unsigned long long range = atomic_load(&victim->range);
+    while (first(range) < last(range))
+    {
+        unsigned middle = last(range) - (last(range) - first(range) + 1) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &range, pack(first(range), middle)))
+        {
+            atomic_store(&own->range, pack(middle + 1, last(range)));
+            return middle;
+        }
+    }
+    return -1;
+}
+
+// Run indices of the current run until there are none left: first from the thread's own queue, then
+// stolen from the others, starting with the next thread along so that thieves spread out
+static void work(POOL *pool, int thread)
+{
+    QUEUE *own = &pool->queues[thread];
+    while (1)
+    {
+        int index = take(own);
+        for (int i = 1; index < 0 && i < pool->threads; i++)
+        {
+            index = steal(&pool->queues[(thread + i) % pool->threads], own);
+        }
+        if (index < 0)
+        {
+            return;
+        }
+
+        pool->task(pool->arg, index, thread);
+
+        // Whoever finishes the last index wakes the caller
+        if (atomic_fetch_sub(&pool->pending, 1) == 1)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->finished);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+}
+
+// Body of every worker thread: wait for a run, help with it, repeat
+static void *worker(void *arg)
+{
+    START *start = arg;
+    POOL *pool = start->pool;
+    int thread = start->thread;
+    free(start);
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1)
+    {
+        while (!pool->stopping && pool->generation == seen)
+        {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stopping)
+        {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+        work(pool, thread);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    scratch_release();
+    return NULL;
+}
+
+POOL *pool_create(int threads)
+{
+    if (threads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+
+    POOL *pool = calloc(1, sizeof(POOL));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    pool->workers = calloc(threads, sizeof(pthread_t));
+    pool->queues = aligned_alloc(_Alignof(QUEUE), threads * sizeof(QUEUE));
+    if (pool->workers == NULL || pool->queues == NULL)
+    {
+        free(pool->workers);
+        free(pool->queues);
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        atomic_init(&pool->queues[i].range, 0);
+    }
+    atomic_init(&pool->pending, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+
+    // The caller is the first thread, so only threads - 1 more are needed; if some cannot
+    // be started, the pool simply makes do with fewer
+    pool->threads = 1;
+    for (int i = 0; i < threads - 1; i++)
+    {
+        START *start = malloc(sizeof(START));
+        if (start == NULL)
+        {
+            break;
+        }
+        start->pool = pool;
+        start->thread = pool->threads;
+        if (pthread_create(&pool->workers[i], NULL, worker, start) != 0)
+        {
+            free(start);
+            break;
+        }
+        pool->threads++;
+    }
+    return pool;
+}
+
+int pool_threads(const POOL *pool)
+{
+    return pool->threads;
+}
+
+void pool_run(POOL *pool, int count, TASK task, void *arg)
+{
+    // Without workers there is nothing to coordinate
+    if (pool->threads == 1)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            task(arg, i, 0);
+        }
+        return;
+    }
+
+    // Deal the indices out evenly, in contiguous ranges, before waking anyone
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    atomic_store(&pool->pending, count);
+    for (int t = 0; t < pool->threads; t++)
+    {
+        atomic_store(&pool->queues[t].range, pack((long long) count * t / pool->threads,
+                                                  (long long) count * (t + 1) / pool->threads));
+    }
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Help out, then wait for the workers to finish whatever they took
+    work(pool, 0);
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending) > 0)
+    {
+        pthread_cond_wait(&pool->finished, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_destroy(POOL *pool)
+{
+    if (pool == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->threads - 1; i++)
+    {
+        pthread_join(pool->workers[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->finished);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->queues);
+    free(pool->workers);
+    free(pool);
+}
@@ -0,0 +1,137 @@
+#include <limits.h>  // For INT_MAX
+#include <stdlib.h>  // For strtol(), malloc() and free()
+#include <string.h>  // For memcpy()
+
+#include "region.h"
+
+int parse_region(const char *text, REGION *region)
+{
+    // Four whole numbers separated by commas, none negative, and a width and height of at least 1
+    long values[4];
+    const char *next = text;
+    for (int k = 0; k < 4; k++)
+    {
+        char *end;
+        values[k] = strtol(next, &end, 10);
+        if (end == next || values[k] < (k < 2 ? 0 : 1) || values[k] > INT_MAX || *end != (k < 3 ? ',' : '\0'))
+        {
+            return 0;
+        }
+        next = end + 1;
+    }
+    *region = (REGION) {values[0], values[1], values[2], values[3]};
+    return 1;
+}
+
+// Limit a number to low..high
+static long long limit(long long n, long long low, long long high)
+{
+    return n < low ? low : n > high ? high : n;
+}
+
+BMPSTATUS region_filter(FILE *inptr, WRITER *writer, const CHAIN *chain, const REGION *region, POOL *pool,
+                        STATS *stats)
+{
+    // Read the headers
+    BMP bmp;
+    double start = stats_now();
+    BMPSTATUS status = bmp_read_headers(inptr, &bmp);
+    stats_add(stats, STAGE_HEADERS, start, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    int width = bmp.image.width;
+    int height = bmp.image.height;
+    size_t scanline = bmp_scanline(&bmp);
+
+    // Cut the rectangle down to the image, in rows as they are stored (last row first, in a bottom-up file)
+    int left = limit(region->x, 0, width);
+    int right = limit((long long) region->x + region->width, 0, width);
+    int first = limit(region->y, 0, height);
+    int end = limit((long long) region->y + region->height, 0, height);
+    if (bmp.image.bottom_up)
+    {
+        int last = end;
+        end = height - first;
+        first = height - last;
+    }
+
+    // Each pass needs its halo of context around what the next pass filters, so the rectangle needs all of theirs
+    // together, in rows and in columns alike (every filter reaches as far across as it does up and down). Filtering
+    // the context as though it were the whole image only goes wrong near its edges, and never that far inside them.
+    // A pass that needs the whole picture needs all of it as context
+    int context = chain_whole(chain) ? (width > height ? width : height) : 0;
+    for (int p = 0; p < chain->pass_count; p++)
+    {
+        context += pass_halo(&chain->passes[p]);
+    }
+    int empty = left >= right || first >= end;
+    int top = empty ? 0 : limit((long long) first - context, 0, height);
+    int bottom = empty ? 0 : limit((long long) end + context, 0, height);
+    int from = limit((long long) left - context, 0, width);
+    int to = limit((long long) right + context, 0, width);
+    if (stats != NULL)
+    {
+        stats->megapixels = empty ? 0 : (double) (right - left) * (end - first) / 1e6;
+    }
+
+    // Copy the headers, and the rows above the context, straight through
+    start = stats_now();
+    bmp_write_headers(writer, &bmp);
+    int failed = writer_copy(writer, inptr, (size_t) top * scanline);
+    stats_add(stats, STAGE_WRITE, start, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + top * scanline);
+
+    // Read the rows of the rectangle and its context (with their fourth bytes, for a 32-bit file), and make a copy
+    // of just the rectangle and its context to filter
+    IMAGE rows = bmp.image;
+    rows.height = bottom - top;
+    rows.data = alloc_rows(rows.stride * rows.height);
+    BYTE *extra = bmp.bi.biBitCount == 32 ? malloc((size_t) width * rows.height + 1) : NULL;
+    IMAGE patch = {.height = rows.height, .width = to - from, .stride = row_stride(to - from),
+                   .bottom_up = rows.bottom_up};
+    patch.data = alloc_rows(patch.stride * patch.height);
+    if (failed || rows.data == NULL || (bmp.bi.biBitCount == 32 && extra == NULL) || patch.data == NULL)
+    {
+        free(rows.data);
+        free(extra);
+        free(patch.data);
+        return BMP_NO_MEMORY;
+    }
+    start = stats_now();
+    status = bmp_read_rows(inptr, &rows, extra);
+    stats_add(stats, STAGE_READ, start, rows.height * scanline);
+
+    // Filter the copy, and put just the rectangle back
+    if (status == BMP_OK && !empty)
+    {
+        start = stats_now();
+        for (int i = 0; i < patch.height; i++)
+        {
+            memcpy(image_row(&patch, i), image_row(&rows, i) + from, patch.width * sizeof(RGBQUAD));
+        }
+        stats_start_counters(stats);
+        failed = apply_chain(chain, &patch, pool);
+        stats_stop_counters(stats);
+        for (int i = first; i < end; i++)
+        {
+            memcpy(image_row(&rows, i - top) + left, image_row(&patch, i - top) + (left - from),
+                   (right - left) * sizeof(RGBQUAD));
+        }
+        stats_add(stats, STAGE_FILTER, start, patch.stride * patch.height * chain->pass_count);
+    }
+
+    // Write the rows that were read, and copy the rest of the rows straight through
+    if (status == BMP_OK && !failed)
+    {
+        start = stats_now();
+        failed = bmp_write_rows(writer, &rows, extra, 0) ||
+                 writer_copy(writer, inptr, (size_t) (height - bottom) * scanline);
+        stats_add(stats, STAGE_WRITE, start, (size_t) (height - top) * scanline);
+    }
+
+    free(rows.data);
+    free(extra);
+    free(patch.data);
+    return status != BMP_OK ? status : failed ? BMP_NO_MEMORY : BMP_OK;
+}
@@ -0,0 +1,34 @@
+// Filtering just a rectangle of an image (--roi), and passing every pixel outside it through as it was
+
+#ifndef REGION_H
+#define REGION_H
+
+#include <stdio.h>
+
+#include "bmpio.h"
+#include "chain.h"
+#include "pool.h"
+#include "stats.h"
+#include "writer.h"
+
+// A rectangle of an image as it is seen: x columns from the left and y rows from the top, width by height pixels
+typedef struct
+{
+    int x;
+    int y;
+    int width;
+    int height;
+} REGION;
+
+// Read a rectangle given on the command line as x,y,width,height, returning 0 if text is not one
+int parse_region(const char *text, REGION *region);
+
+// Read a BMP file from inptr and write it to writer with the chain applied only inside a rectangle (the part of it
+// that is in the image, which may be none), timing each stage if stats is not NULL. Only the rows of the rectangle
+// and the rows of context the chain needs around it are read into memory, and only the rectangle and the columns of
+// context around it are filtered, as the whole image would be; the rows above and below them are copied through
+// from the input untouched. The chain must not turn the image
+BMPSTATUS region_filter(FILE *inptr, WRITER *writer, const CHAIN *chain, const REGION *region, POOL *pool,
+                        STATS *stats);
+
+#endif
@@ -0,0 +1,316 @@
+#include <limits.h>  // For INT_MAX
+#include <stdint.h>  // For uint64_t
+#include <stdio.h>   // For snprintf(), fopen() and fclose()
+#include <stdlib.h>  // For strtol(), calloc() and free()
+#include <string.h>  // For strlen() and strcmp()
+
+#include "scale.h"
+#include "simd.h"
+
+// One copy of an image, made from the rows of the image (or of the mip level above it) as they come
+typedef struct
+{
+    IMAGE image;         // The copy, filled in a row at a time
+    int width;           // Size of what it is made from
+    int height;
+    int received;        // Rows of that received so far
+    int made;            // Rows of the copy made so far
+    int level;           // Which mip level it is, or 0 for a thumbnail
+    int next;            // The copy made from this one's rows (the next mip level), or -1 for none
+    const BYTE *pending; // For a copy of exactly half the size, the first row of each pair until the second comes
+    uint64_t *line;      // Otherwise, the weighted sums of the latest row across each pixel of the copy,
+    uint64_t *sums[2];   // and of the rows over the two rows of the copy that it can cover
+} COPY;
+
+struct SCALED
+{
+    BITMAPFILEHEADER bf;  // Headers of the image the copies are made from
+    BITMAPINFOHEADER bi;
+    int count;
+    COPY copies[MAX_LEVELS + MAX_THUMBNAILS];
+};
+
+int parse_size(const char *text, int *width, int *height)
+{
+    // Two whole numbers of at least 1, separated by an x
+    char *end;
+    long w = strtol(text, &end, 10);
+    if (end == text || w < 1 || w > INT_MAX || *end != 'x')
+    {
+        return 0;
+    }
+    const char *next = end + 1;
+    long h = strtol(next, &end, 10);
+    if (end == next || h < 1 || h > INT_MAX || *end != '\0')
+    {
+        return 0;
+    }
+    *width = w;
+    *height = h;
+    return 1;
+}
+
+// Set up a copy of width by height pixels of something source_width by source_height, returning 0 if there is no
+// memory for it
+static int add_copy(SCALED *scaled, int width, int height, int source_width, int source_height, int bottom_up,
+                    int level)
+{
+    COPY *copy = &scaled->copies[scaled->count++];
+    copy->image = (IMAGE) {.height = height, .width = width, .stride = row_stride(width), .bottom_up = bottom_up};
+    copy->width = source_width;
+    copy->height = source_height;
+    copy->level = level;
+    copy->next = -1;
+    copy->image.data = alloc_rows(copy->image.stride * height);
+    if (copy->image.data == NULL)
+    {
+        return 0;
+    }
+    if (source_width == 2 * width && source_height == 2 * height)
+    {
+        return 1;
+    }
+    copy->line = calloc(4 * (size_t) width, sizeof(uint64_t));
+    copy->sums[0] = calloc(4 * (size_t) width, sizeof(uint64_t));
+    copy->sums[1] = calloc(4 * (size_t) width, sizeof(uint64_t));
+    return copy->line != NULL && copy->sums[0] != NULL && copy->sums[1] != NULL;
+}
+
+// The smaller of two numbers
+static long long smaller(long long a, long long b)
+{
+    return a < b ? a : b;
+}
+
+// The larger of two numbers
+static long long larger(long long a, long long b)
+{
+    return a > b ? a : b;
+}
+
+static void receive(SCALED *scaled, COPY *copy, const BYTE *row);
+
+// Finish the copy's next row, passing it on to the copy made from it
+static void made_row(SCALED *scaled, COPY *copy)
+{
+    const BYTE *row = (const BYTE *) image_row(&copy->image, copy->made++);
+    if (copy->next >= 0)
+    {
+        receive(scaled, &scaled->copies[copy->next], row);
+    }
+}
+
+// Average the 2x2 blocks of a pair of rows into the copy's next row, byte by byte (the fourth bytes of the pixels
+// are averaged along with the rest, since that costs nothing, and are never written out)
+static void halve_rows(SCALED *scaled, COPY *copy, const BYTE *upper, const BYTE *lower)
+{
+    BYTE *out = (BYTE *) image_row(&copy->image, copy->made);
+    int width = copy->image.width;
+    for (size_t k = 4 * (size_t) halve_simd(upper, lower, out, width); k < 4 * (size_t) width; k++)
+    {
+        size_t c = 2 * k - k % 4;
+        out[k] = (upper[c] + upper[c + 4] + lower[c] + lower[c + 4] + 2) >> 2;
+    }
+    made_row(scaled, copy);
+}
+
+// Add a row into the copy's rows that it covers, finishing each of them that it is the last row of. The copy's
+// pixels and rows are measured in units of 1/width and 1/height of the source's, so that pixel x of the copy covers
+// x * width to (x + 1) * width and pixel i of the source covers i * copy width to (i + 1) * copy width, and each is
+// weighted by how much of the copy's pixel it covers. A copy's row is the sum of its weighted rows, divided by the
+// total weight (width * height), rounded. Only halving has SIMD kernels (see halve_rows()): this is the plain C
+// path for thumbnails and odd-sized mip levels, whose weights change from pixel to pixel
+static void average_row(SCALED *scaled, COPY *copy, const BYTE *row)
+{
+    int width = copy->image.width;
+    int height = copy->image.height;
+
+    // The row's weighted sums across each pixel of the copy
+    for (int x = 0; x < width; x++)
+    {
+        long long from = (long long) x * copy->width;
+        long long to = from + copy->width;
+        uint64_t blue = 0, green = 0, red = 0;
+        for (long long i = from / width; i * width < to; i++)
+        {
+            uint64_t weight = smaller(to, (i + 1) * width) - larger(from, i * width);
+            blue += weight * row[4 * i];
+            green += weight * row[4 * i + 1];
+            red += weight * row[4 * i + 2];
+        }
+        copy->line[4 * x] = blue;
+        copy->line[4 * x + 1] = green;
+        copy->line[4 * x + 2] = red;
+    }
+
+    // No copy is larger than its source, so the row covers at most two of the copy's rows
+    long long top = (long long) copy->received * height;
+    long long bottom = top + height;
+    uint64_t total = (uint64_t) copy->width * copy->height;
+    for (long long y = top / copy->height; y < height && y * copy->height < bottom; y++)
+    {
+        uint64_t weight = smaller(bottom, (y + 1) * copy->height) - larger(top, y * copy->height);
+        uint64_t *sums = copy->sums[y % 2];
+        for (size_t k = 0; k < 4 * (size_t) width; k++)
+        {
+            sums[k] += weight * copy->line[k];
+        }
+        if ((y + 1) * copy->height <= bottom)
+        {
+            BYTE *out = (BYTE *) image_row(&copy->image, y);
+            for (size_t k = 0; k < 4 * (size_t) width; k++)
+            {
+                out[k] = (sums[k] + total / 2) / total;
+                sums[k] = 0;
+            }
+            made_row(scaled, copy);
+        }
+    }
+}
+
+// Give a copy the next row of what it is made from
+static void receive(SCALED *scaled, COPY *copy, const BYTE *row)
+{
+    if (copy->line == NULL && copy->received % 2 == 0)
+    {
+        copy->pending = row;
+    }
+    else if (copy->line == NULL)
+    {
+        halve_rows(scaled, copy, copy->pending, row);
+    }
+    else
+    {
+        average_row(scaled, copy, row);
+    }
+    copy->received++;
+}
+
+SCALED *downscale(const BMP *bmp, const SIZES *sizes, const ORIENTATION *orientation)
+{
+    SCALED *scaled = calloc(1, sizeof(SCALED));
+    if (scaled == NULL)
+    {
+        return NULL;
+    }
+    scaled->bf = bmp->bf;
+    scaled->bi = bmp->bi;
+    int width = bmp->image.width;
+    int height = bmp->image.height;
+    int bottom_up = bmp->image.bottom_up;
+
+    // The mip chain, each level made from the one above it, until the level above is 1 by 1. Halving (rounding
+    // down) looks the same whichever way the image is turned, but the size of a thumbnail is as the image is seen,
+    // which is the other way around for a transposed image
+    int ok = 1;
+    int w = width, h = height;
+    for (int level = 1; level <= sizes->levels && ok && (w > 1 || h > 1); level++)
+    {
+        int above = scaled->count - 1;
+        ok = add_copy(scaled, w > 1 ? w / 2 : 1, h > 1 ? h / 2 : 1, w, h, bottom_up, level);
+        w = scaled->copies[above + 1].image.width;
+        h = scaled->copies[above + 1].image.height;
+        if (above >= 0)
+        {
+            scaled->copies[above].next = above + 1;
+        }
+    }
+    int first = scaled->count > 0 ? 0 : -1;
+    for (int t = 0; t < sizes->count && ok; t++)
+    {
+        w = orientation->transpose ? sizes->heights[t] : sizes->widths[t];
+        h = orientation->transpose ? sizes->widths[t] : sizes->heights[t];
+        ok = add_copy(scaled, w < width ? w : width, h < height ? h : height, width, height, bottom_up, 0);
+    }
+    if (!ok)
+    {
+        free_scaled(scaled);
+        return NULL;
+    }
+
+    // Read each row of the image once, giving it to each copy made straight from the image
+    for (int i = 0; i < height; i++)
+    {
+        const BYTE *row = (const BYTE *) image_row(&bmp->image, i);
+        for (int c = 0; c < scaled->count; c++)
+        {
+            if (c == first || scaled->copies[c].level == 0)
+            {
+                receive(scaled, &scaled->copies[c], row);
+            }
+        }
+    }
+    return scaled;
+}
+
+int write_scaled(SCALED *scaled, const char *outfile, const ORIENTATION *orientation, int async, char *name,
+                 size_t size)
+{
+    // Name the copies after the output file, before its .bmp if it has one
+    size_t length = strlen(outfile);
+    int extension = length >= 4 && strcmp(outfile + length - 4, ".bmp") == 0;
+    int stem = extension ? length - 4 : length;
+
+    for (int c = 0; c < scaled->count; c++)
+    {
+        // The headers of a 24-bit file of the copy's size, stored the same way up as the image
+        COPY *copy = &scaled->copies[c];
+        BMP bmp = {.bf = scaled->bf, .bi = scaled->bi, .image = copy->image};
+        bmp.bi.biWidth = copy->image.width;
+        bmp.bi.biHeight = copy->image.bottom_up ? copy->image.height : -copy->image.height;
+        bmp.bi.biBitCount = 24;
+        size_t bytes = bmp_scanline(&bmp) * copy->image.height;
+        bmp.bi.biSizeImage = bytes;
+        bmp.bf.bfSize = bmp.bf.bfOffBits + bytes;
+
+        if (copy->level > 0)
+        {
+            snprintf(name, size, "%.*s-%d%s", stem, outfile, copy->level, extension ? ".bmp" : "");
+        }
+        else
+        {
+            int transpose = orientation->transpose;
+            snprintf(name, size, "%.*s-%dx%d%s", stem, outfile, transpose ? copy->image.height : copy->image.width,
+                     transpose ? copy->image.width : copy->image.height, extension ? ".bmp" : "");
+        }
+
+        FILE *outptr = fopen(name, "w");
+        if (outptr == NULL)
+        {
+            return 1;
+        }
+        WRITER *writer = writer_open(outptr, async);
+        if (writer == NULL)
+        {
+            fclose(outptr);
+            return 2;
+        }
+        int failed = bmp_write(writer, &bmp, orientation);
+        int unwritten = writer_close(writer);
+        if (fclose(outptr) != 0 || unwritten)
+        {
+            return 1;
+        }
+        if (failed)
+        {
+            return 2;
+        }
+    }
+    return 0;
+}
+
+void free_scaled(SCALED *scaled)
+{
+    if (scaled == NULL)
+    {
+        return;
+    }
+    for (int c = 0; c < scaled->count; c++)
+    {
+        free(scaled->copies[c].image.data);
+        free(scaled->copies[c].line);
+        free(scaled->copies[c].sums[0]);
+        free(scaled->copies[c].sums[1]);
+    }
+    free(scaled);
+}
@@ -0,0 +1,50 @@
+// Smaller copies of a filtered image: a mip chain (each level half the size of the one above it) and thumbnails of
+// any size, all made in one pass over the image's rows
+
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <stddef.h>
+
+#include "bmpio.h"
+
+// Most mip levels an image can have: halving it 31 times takes even the largest down to 1 by 1
+#define MAX_LEVELS 31
+
+// Most thumbnails one run can make
+#define MAX_THUMBNAILS 8
+
+// The copies asked for on the command line
+typedef struct
+{
+    int levels;                  // Mip levels below the image (stopping early at 1 by 1)
+    int count;                   // Thumbnails
+    int widths[MAX_THUMBNAILS];  // Size of each thumbnail, as the image is seen once written
+    int heights[MAX_THUMBNAILS];
+} SIZES;
+
+// Read a thumbnail size given on the command line as WIDTHxHEIGHT (e.g., 160x120), returning 0 if text is not one
+int parse_size(const char *text, int *width, int *height);
+
+// The copies of an image, kept in memory until they are written
+typedef struct SCALED SCALED;
+
+// Make the copies of a (filtered) BMP file that sizes asks for, reading each of its rows only once for all of them:
+// every row goes to each thumbnail and to the first mip level, whose rows go on to the next level as soon as they
+// are made, and so on down the chain. Each pixel of a copy is the average of the area of the image it covers,
+// rounded, which for a level of even size is each 2x2 block of the level above (the only case with SIMD kernels).
+// A thumbnail is never larger than the image. The sizes are as the image is seen once turned by orientation.
+// Returns NULL if there is no memory
+SCALED *downscale(const BMP *bmp, const SIZES *sizes, const ORIENTATION *orientation);
+
+// Write each copy as a 24-bit BMP file of its own, with headers for its size, turned by orientation: for an outfile
+// of out.bmp, the mip levels go to out-1.bmp (half size), out-2.bmp (quarter size) and so on, and a thumbnail goes
+// to out-160x120.bmp, say. Returns 0 on success, 1 if a file could not be created or written (its name is left in
+// name, which holds size bytes), or 2 if there was no memory to turn a copy
+int write_scaled(SCALED *scaled, const char *outfile, const ORIENTATION *orientation, int async, char *name,
+                 size_t size);
+
+// Release the copies
+void free_scaled(SCALED *scaled);
+
+#endif
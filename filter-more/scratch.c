@@ -0,0 +1,31 @@
+#include <stdlib.h>  // For malloc() and free()
+
+#include "scratch.h"
+
+// The buffers of the thread that is running
+static _Thread_local struct
+{
+    void *data;
+    size_t size;
+} buffers[SCRATCH_SLOTS];
+
+void *scratch(SCRATCH slot, size_t size)
+{
+    if (buffers[slot].size < size || buffers[slot].data == NULL)
+    {
+        free(buffers[slot].data);
+        buffers[slot].data = malloc(size > 0 ? size : 1);
+        buffers[slot].size = buffers[slot].data != NULL ? size : 0;
+    }
+    return buffers[slot].data;
+}
+
+void scratch_release(void)
+{
+    for (int s = 0; s < SCRATCH_SLOTS; s++)
+    {
+        free(buffers[s].data);
+        buffers[s].data = NULL;
+        buffers[s].size = 0;
+    }
+}
@@ -0,0 +1,298 @@
+#define _POSIX_C_SOURCE 200809L  // For fdopen(), lstat(), chmod(), sigwait() and sysconf()
+
+#include <errno.h>       // For EINTR and ECONNABORTED
+#include <pthread.h>     // For the worker threads
+#include <signal.h>      // For waiting for SIGINT and SIGTERM
+#include <stdio.h>       // For file operations
+#include <stdlib.h>      // For aligned_alloc() and free()
+#include <string.h>      // For strlen(), strcpy() and snprintf()
+#include <sys/socket.h>  // For the socket, and the file descriptors passed over it
+#include <sys/stat.h>    // For lstat() and chmod()
+#include <sys/un.h>      // For struct sockaddr_un
+#include <unistd.h>      // For close(), unlink() and sysconf()
+
+#include "bmpio.h"
+#include "chain.h"
+#include "scratch.h"
+#include "service.h"
+
+// Everything the threads share while serving
+typedef struct
+{
+    int listener;  // The listening socket, shut down to stop the threads
+    int async;     // Whether to queue each job's writes on an io_uring
+    POOL *serial;  // A pool of one thread, so that each image is filtered on the thread that took its job
+} SERVICE;
+
+// What each thread keeps from one job to the next, on a cache line of its own
+typedef struct
+{
+    _Alignas(64) BYTE *pixels;  // Buffer the images are read into
+    size_t size;                // Its size
+    SERVICE *service;
+    pthread_t thread;
+} WORKER;
+
+// Receive a job on a connection, along with up to two file descriptors attached to it (any more are closed);
+// returns 0 on success
+static int receive(int connection, JOB *job, int fds[2], int *count)
+{
+    union
+    {
+        char buffer[CMSG_SPACE(4 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec piece = {job, sizeof(JOB)};
+    struct msghdr message = {.msg_iov = &piece, .msg_iovlen = 1, .msg_control = control.buffer,
+                             .msg_controllen = sizeof(control.buffer)};
+    ssize_t got;
+    do
+    {
+        got = recvmsg(connection, &message, 0);
+    }
+    while (got < 0 && errno == EINTR);
+
+    *count = 0;
+    for (struct cmsghdr *c = got > 0 ? CMSG_FIRSTHDR(&message) : NULL; c != NULL; c = CMSG_NXTHDR(&message, c))
+    {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+        const int *received = (const int *) CMSG_DATA(c);
+        for (size_t k = 0; k < (c->cmsg_len - CMSG_LEN(0)) / sizeof(int); k++)
+        {
+            if (*count < 2)
+            {
+                fds[(*count)++] = received[k];
+            }
+            else
+            {
+                close(received[k]);
+            }
+        }
+    }
+
+    // The paths need not end in the bytes sent, so make sure they end somewhere
+    job->chain[CHAIN_BYTES - 1] = '\0';
+    job->input[PATH_BYTES - 1] = '\0';
+    job->output[PATH_BYTES - 1] = '\0';
+    return got != sizeof(JOB) || (message.msg_flags & (MSG_TRUNC | MSG_CTRUNC));
+}
+
+// Filter the image of a job, just as filter would on its own, but into the thread's own buffer; the file
+// descriptors stand in for the empty paths, in order, and are closed along with the files
+static void run(WORKER *worker, const JOB *job, int fds[2], int count, REPLY *reply)
+{
+    const char *infile = job->input[0] != '\0' ? job->input : "-";
+    const char *outfile = job->output[0] != '\0' ? job->output : "-";
+    int used = 0;
+    int infd = job->input[0] == '\0' && used < count ? fds[used++] : -1;
+    int outfd = job->output[0] == '\0' && used < count ? fds[used++] : -1;
+
+    // An empty chain copies the image as it is
+    CHAIN chain = {.step_count = 0};
+    int invalid = job->chain[0] != '\0' ? chain_parse(job->chain, &chain) : 0;
+    chain_compile(&chain);
+
+    // Open the input and output files, just as for a single image
+    FILE *inptr = invalid ? NULL : infd >= 0 ? fdopen(infd, "r") :
+                  job->input[0] != '\0' ? fopen(infile, "r") : NULL;
+    FILE *outptr = inptr == NULL ? NULL : outfd >= 0 ? fdopen(outfd, "w") :
+                   job->output[0] != '\0' ? fopen(outfile, "w") : NULL;
+    WRITER *writer = outptr != NULL ? writer_open(outptr, worker->service->async) : NULL;
+    BMPSTATUS status = BMP_OK;
+    if (invalid)
+    {
+        reply->code = invalid;
+        const char *problem = invalid == 1 ? "Invalid filter." : "Too many filters.";
+        snprintf(reply->message, sizeof(reply->message), "%s", problem);
+    }
+    else if (inptr == NULL)
+    {
+        reply->code = 4;
+        snprintf(reply->message, sizeof(reply->message), "Could not open %s.", infile);
+    }
+    else if (outptr == NULL)
+    {
+        reply->code = 5;
+        snprintf(reply->message, sizeof(reply->message), "Could not create %s.", outfile);
+    }
+    else if (writer == NULL)
+    {
+        status = BMP_NO_MEMORY;
+    }
+    else
+    {
+        // Read the image into this thread's buffer, filter it and write it out
+        BMP bmp;
+        status = bmp_read_into(inptr, &bmp, &worker->pixels, &worker->size);
+        if (status == BMP_OK && apply_chain(&chain, &bmp.image, worker->service->serial) != 0)
+        {
+            status = BMP_NO_MEMORY;
+        }
+        if (status == BMP_OK && bmp_write(writer, &bmp, &chain.orientation) != 0)
+        {
+            status = BMP_NO_MEMORY;
+        }
+    }
+
+    if (status == BMP_UNSUPPORTED)
+    {
+        reply->code = 6;
+        snprintf(reply->message, sizeof(reply->message), "Unsupported file format.");
+    }
+    else if (status == BMP_NO_MEMORY)
+    {
+        reply->code = 7;
+        snprintf(reply->message, sizeof(reply->message), "Not enough memory to store image.");
+    }
+
+    // Whatever was not handed to a file is closed on its own. A write that failed (to a full disk, say) only
+    // shows up as the output is closed
+    int unwritten = writer != NULL && writer_close(writer) != 0;
+    if (outptr != NULL)
+    {
+        if ((fclose(outptr) != 0 || unwritten) && reply->code == 0)
+        {
+            reply->code = 5;
+            snprintf(reply->message, sizeof(reply->message), "Could not write %s.", outfile);
+        }
+    }
+    else if (outfd >= 0)
+    {
+        close(outfd);
+    }
+    if (inptr != NULL)
+    {
+        fclose(inptr);
+    }
+    else if (infd >= 0)
+    {
+        close(infd);
+    }
+    for (int k = used; k < count; k++)
+    {
+        close(fds[k]);
+    }
+}
+
+// Take jobs one at a time until the listening socket is shut down
+static void *work(void *arg)
+{
+    WORKER *worker = arg;
+    while (1)
+    {
+        int connection = accept(worker->service->listener, NULL, NULL);
+        if (connection < 0 && (errno == EINTR || errno == ECONNABORTED))
+        {
+            continue;
+        }
+        if (connection < 0)
+        {
+            scratch_release();
+            return NULL;
+        }
+
+        // A job that arrives garbled gets no answer, and the client sees the connection close
+        JOB job;
+        int fds[2];
+        int count;
+        if (receive(connection, &job, fds, &count) == 0)
+        {
+            REPLY reply = {.code = 0, .message = ""};
+            run(worker, &job, fds, count, &reply);
+            send(connection, &reply, sizeof(reply), MSG_NOSIGNAL);
+        }
+        else
+        {
+            for (int k = 0; k < count; k++)
+            {
+                close(fds[k]);
+            }
+        }
+        close(connection);
+    }
+}
+
+int serve(const char *path, int threads, int async)
+{
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        printf("Socket path too long: %s.\n", path);
+        return 5;
+    }
+    strcpy(address.sun_path, path);
+
+    // Replace a socket left behind by a service that was killed, but never anything else
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(path);
+    }
+
+    // Each connection carries one job, as one message, and then its reply. The socket is closed to every user but
+    // the service's own (see service.h) before it listens, since nobody can connect to it until then
+    int listener = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        chmod(path, S_IRUSR | S_IWUSR) != 0 || listen(listener, SOMAXCONN) != 0)
+    {
+        printf("Could not listen on %s.\n", path);
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        return 5;
+    }
+
+    // Only this thread takes the signals that stop the service, so block them before starting the others
+    sigset_t stopping;
+    sigemptyset(&stopping);
+    sigaddset(&stopping, SIGINT);
+    sigaddset(&stopping, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopping, NULL);
+
+    if (threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? cpus : 1;
+    }
+    SERVICE service = {.listener = listener, .async = async, .serial = pool_create(1)};
+    WORKER *workers = aligned_alloc(_Alignof(WORKER), threads * sizeof(WORKER));
+    int started = 0;
+    while (service.serial != NULL && workers != NULL && started < threads)
+    {
+        workers[started] = (WORKER) {.pixels = NULL, .size = 0, .service = &service};
+        if (pthread_create(&workers[started].thread, NULL, work, &workers[started]) != 0)
+        {
+            break;
+        }
+        started++;
+    }
+
+    // Serve until told to stop; shutting the socket down wakes every thread waiting for a job, and a thread
+    // filtering an image finishes it first
+    if (started > 0)
+    {
+        printf("Serving on %s with %d threads.\n", path, started);
+        fflush(stdout);
+        int signal;
+        sigwait(&stopping, &signal);
+    }
+    else
+    {
+        printf("Not enough memory to start threads.\n");
+    }
+    shutdown(listener, SHUT_RDWR);
+    for (int t = 0; t < started; t++)
+    {
+        pthread_join(workers[t].thread, NULL);
+        free(workers[t].pixels);
+    }
+    free(workers);
+    pool_destroy(service.serial);
+    close(listener);
+    unlink(path);
+    return started > 0 ? 0 : 7;
+}
@@ -0,0 +1,39 @@
+// A long-running filter service on a local Unix socket, so that filtering an image costs a message rather than
+// starting a process: threads wait for jobs with their buffers already allocated
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+// Where the service listens unless told otherwise
+#define SOCKET_PATH "/tmp/filter.sock"
+
+// Longest --chain list and file paths a job can carry
+#define CHAIN_BYTES 1024
+#define PATH_BYTES 4096
+
+// A job, sent as a single message. A path left empty stands for a file descriptor attached to the message
+// instead (the input's first, then the output's), e.g. a memfd holding the image, or the client's stdout
+typedef struct
+{
+    char chain[CHAIN_BYTES];   // The filters, as a --chain list
+    char input[PATH_BYTES];    // Absolute path of the image to filter, or empty
+    char output[PATH_BYTES];   // Absolute path of the file to write, or empty
+} JOB;
+
+// The answer to a job, sent once its output is written
+typedef struct
+{
+    int code;                       // The exit code filter would have given for the same image
+    char message[PATH_BYTES + 32];  // What filter would have printed, or empty
+} REPLY;
+
+// Listen on a Unix socket at path (replacing any socket already there) and filter jobs on the given number of
+// threads (0 means one per CPU), each taking the next job as soon as it is free and reading every image into a
+// buffer it keeps from one job to the next. With async set, each job's writes are queued on an io_uring (see
+// writer.h). Runs until SIGINT or SIGTERM, then removes the socket; returns 0 then, or filter's exit code for
+// failing to start. Jobs name files that the service opens with its own rights, so the socket is made readable
+// and writable by its owner alone (mode 0600) before anyone can connect: other users cannot reach the service, even
+// at the default path in the shared /tmp
+int serve(const char *path, int threads, int async);
+
+#endif
@@ -0,0 +1,613 @@
+#include <stdint.h>  // For fixed-width integer types
+#include <string.h>  // For memcmp()
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>  // For SSE4.1 and AVX2 intrinsics
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+// Pixels are 4 bytes apiece, so 4 of them fill a 128-bit register. These masks spread one channel
+// of those 4 pixels into four 32-bit lanes (bytes with the high bit set are zeroed), and put the
+// low byte of each lane back into its channel's position (zeroing the fourth bytes)
+#define CHANNEL(c) c, -1, -1, -1, c + 4, -1, -1, -1, c + 8, -1, -1, -1, c + 12, -1, -1, -1
+#define PACK(c)                                                                                 \
+    (c) == 0 ? 0 : -1, (c) == 1 ? 0 : -1, (c) == 2 ? 0 : -1, -1, (c) == 0 ? 4 : -1, (c) == 1 ? 4 : -1, \
+    (c) == 2 ? 4 : -1, -1, (c) == 0 ? 8 : -1, (c) == 1 ? 8 : -1, (c) == 2 ? 8 : -1, -1,               \
+    (c) == 0 ? 12 : -1, (c) == 1 ? 12 : -1, (c) == 2 ? 12 : -1, -1
+
+// Pixels of a 24-bit scanline that a vector step touches: 4 pixels are loaded (or stored) with a 16-byte
+// load, and 8 pixels with two of them 12 bytes apart, so a step never goes past the end of its own scanline
+#define SSE_PIXELS 6   // ceil(16 / 3)
+#define AVX2_PIXELS 10 // ceil(28 / 3)
+
+// Load 8 pixels of a 24-bit scanline, 4 into each 128-bit half of a 256-bit register
+AVX2 static inline __m256i load24(const BYTE *p)
+{
+    __m128i low = _mm_loadu_si128((const __m128i *) p);
+    __m128i high = _mm_loadu_si128((const __m128i *) (p + 12));
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(low), high, 1);
+}
+
+// Store 8 pixels of a 24-bit scanline from the first 12 bytes of each 128-bit half of v, and 4 bytes of whatever
+// follows them in v after those, which the next store (or the caller) overwrites
+AVX2 static inline void store24(BYTE *p, __m256i v)
+{
+    _mm_storeu_si128((__m128i *) p, _mm256_castsi256_si128(v));
+    _mm_storeu_si128((__m128i *) (p + 12), _mm256_extracti128_si256(v, 1));
+}
+
+// A matrix in the form the vector code uses. Each 32-bit lane computes x = 2n + denominator for a channel's
+// numerator n, with _mm_madd_epi16 on pairs of 16-bit numbers: (red, green) times the channel's red and green
+// weights, plus (blue, 1) times its blue weight and offset, all doubled (with the denominator added to the
+// offset). The channel is then round(n / denominator) = floor(x / (2 * denominator)). Clamping x to low..high
+// keeps that within 0..255, and small enough for the division to be ((x >> shift) * multiplier) >> bits
+typedef struct
+{
+    int red_green[3];    // Pairs of weights for each channel, red in the low half
+    int blue_offset[3];  // Blue weight and offset for each channel, blue in the low half
+    int low, high;       // The range x is clamped to
+    int shift;           // Trailing zero bits of the divisor
+    int multiplier;      // Reciprocal of the rest of the divisor, in fixed point
+    int bits;            // Fraction bits of the multiplier
+    int divisor;         // 2 * denominator, for spotting channels that land exactly halfway
+    int ties;            // Whether any can (only possible with an even denominator), and must be rounded in doubles
+    int uniform;         // Whether all three channels are the same (e.g., grayscale)
+} FIXED;
+
+// Work out the vector form of a matrix, returning 0 if its numbers are too large for it
+static int fixed_matrix(const MATRIX *matrix, FIXED *fixed)
+{
+    int denominator = matrix->denominator;
+    for (int c = 0; c < 3; c++)
+    {
+        const int *n = matrix->numerators[c];
+        long long pairs[4] = {2LL * n[0], 2LL * n[1], 2LL * n[2], 2LL * n[3] + denominator};
+        for (int k = 0; k < 4; k++)
+        {
+            if (pairs[k] < INT16_MIN || pairs[k] > INT16_MAX)
+            {
+                return 0;
+            }
+        }
+        fixed->red_green[c] = (int) ((uint32_t) (uint16_t) pairs[1] << 16 | (uint16_t) pairs[0]);
+        fixed->blue_offset[c] = (int) ((uint32_t) (uint16_t) pairs[3] << 16 | (uint16_t) pairs[2]);
+    }
+
+    // x up to the denominator gives 0 and x from 511 times it gives 255, and neither end looks like a tie
+    fixed->low = denominator;
+    fixed->high = 511 * denominator;
+    fixed->divisor = 2 * denominator;
+    fixed->ties = matrix->doubles && denominator % 2 == 0;
+    fixed->uniform = memcmp(matrix->numerators[0], matrix->numerators[1], sizeof(int[4])) == 0 &&
+                     memcmp(matrix->numerators[0], matrix->numerators[2], sizeof(int[4])) == 0;
+
+    // y / odd is (y * m) >> bits exactly, where m = ceil(2^bits / odd), for every y up to top whose product with
+    // the error m * odd - 2^bits stays below 2^bits; the product y * m must also fit in 32 bits
+    fixed->shift = __builtin_ctz(fixed->divisor);
+    unsigned long long odd = fixed->divisor >> fixed->shift;
+    unsigned long long top = fixed->high >> fixed->shift;
+    for (int bits = 31; bits >= 0; bits--)
+    {
+        unsigned long long m = ((1ULL << bits) + odd - 1) / odd;
+        if (top * m <= UINT32_MAX && (m * odd - (1ULL << bits)) * top < (1ULL << bits))
+        {
+            fixed->multiplier = (int) m;
+            fixed->bits = bits;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Spread red and green into the low and high halves of each 32-bit lane, and blue into the low half
+#define RED_GREEN 2, -1, 1, -1, 6, -1, 5, -1, 10, -1, 9, -1, 14, -1, 13, -1
+#define BLUE_ONLY CHANNEL(0)
+
+// Copy the low byte of each lane into all three channels of its pixel
+#define SPREAD 0, 0, 0, -1, 4, 4, 4, -1, 8, 8, 8, -1, 12, 12, 12, -1
+
+// A FIXED matrix broadcast into vector registers, ready for a loop over a row
+typedef struct
+{
+    __m128i red_green[3], blue_offset[3];
+    __m128i low, high, multiplier, divisor;
+    __m128i shift, bits;  // Shift counts, in the low 64 bits
+} FIXED128;
+
+typedef struct
+{
+    __m256i red_green[3], blue_offset[3];
+    __m256i low, high, multiplier, divisor;
+    __m128i shift, bits;
+} FIXED256;
+
+// Compute channel c of 4 pixels from their (red, green) and (blue, 1) pairs, flagging lanes that land exactly
+// halfway if ties are possible
+SSE41 static inline __m128i channel_sse41(__m128i rg, __m128i b1, const FIXED128 *f, int c, int ties_possible,
+                                          __m128i *ties)
+{
+    __m128i x = _mm_add_epi32(_mm_madd_epi16(rg, f->red_green[c]), _mm_madd_epi16(b1, f->blue_offset[c]));
+    x = _mm_min_epi32(_mm_max_epi32(x, f->low), f->high);
+    __m128i q = _mm_srl_epi32(_mm_mullo_epi32(_mm_srl_epi32(x, f->shift), f->multiplier), f->bits);
+    if (ties_possible)
+    {
+        *ties = _mm_or_si128(*ties, _mm_cmpeq_epi32(x, _mm_mullo_epi32(q, f->divisor)));
+    }
+    return q;
+}
+
+SSE41 static int matrix_sse41(RGBQUAD *row, int width, const MATRIX *matrix, const FIXED *fixed)
+{
+    const __m128i spread_rg = _mm_setr_epi8(RED_GREEN);
+    const __m128i spread_b = _mm_setr_epi8(BLUE_ONLY);
+    const __m128i one = _mm_set1_epi32(1 << 16);
+    const __m128i spread = _mm_setr_epi8(SPREAD);
+    const __m128i pack_b = _mm_setr_epi8(PACK(0));
+    const __m128i pack_g = _mm_setr_epi8(PACK(1));
+    const __m128i pack_r = _mm_setr_epi8(PACK(2));
+    FIXED128 f;
+    for (int c = 0; c < 3; c++)
+    {
+        f.red_green[c] = _mm_set1_epi32(fixed->red_green[c]);
+        f.blue_offset[c] = _mm_set1_epi32(fixed->blue_offset[c]);
+    }
+    f.low = _mm_set1_epi32(fixed->low);
+    f.high = _mm_set1_epi32(fixed->high);
+    f.multiplier = _mm_set1_epi32(fixed->multiplier);
+    f.divisor = _mm_set1_epi32(fixed->divisor);
+    f.shift = _mm_cvtsi32_si128(fixed->shift);
+    f.bits = _mm_cvtsi32_si128(fixed->bits);
+    int ties_possible = fixed->ties;
+    int uniform = fixed->uniform;
+
+    int j = 0;
+    for (; j + 4 <= width; j += 4)
+    {
+        __m128i *p = (__m128i *) (row + j);
+        __m128i v = _mm_loadu_si128(p);
+        __m128i rg = _mm_shuffle_epi8(v, spread_rg);
+        __m128i b1 = _mm_or_si128(_mm_shuffle_epi8(v, spread_b), one);
+
+        // A matrix whose channels are all the same only needs computing once per pixel
+        __m128i ties = _mm_setzero_si128();
+        __m128i out;
+        if (uniform)
+        {
+            out = _mm_shuffle_epi8(channel_sse41(rg, b1, &f, 0, ties_possible, &ties), spread);
+        }
+        else
+        {
+            __m128i red = channel_sse41(rg, b1, &f, 0, ties_possible, &ties);
+            __m128i green = channel_sse41(rg, b1, &f, 1, ties_possible, &ties);
+            __m128i blue = channel_sse41(rg, b1, &f, 2, ties_possible, &ties);
+            out = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(blue, pack_b), _mm_shuffle_epi8(green, pack_g)),
+                               _mm_shuffle_epi8(red, pack_r));
+        }
+
+        // Pixels with a channel exactly halfway are converted with the scalar code, which rounds them as it always has
+        if (!_mm_testz_si128(ties, ties))
+        {
+            for (int k = 0; k < 4; k++)
+            {
+                matrix_pixel(&row[j + k], matrix);
+            }
+            continue;
+        }
+        _mm_storeu_si128(p, out);
+    }
+    return j;
+}
+
+AVX2 static inline __m256i channel_avx2(__m256i rg, __m256i b1, const FIXED256 *f, int c, int ties_possible,
+                                        __m256i *ties)
+{
+    __m256i x = _mm256_add_epi32(_mm256_madd_epi16(rg, f->red_green[c]), _mm256_madd_epi16(b1, f->blue_offset[c]));
+    x = _mm256_min_epi32(_mm256_max_epi32(x, f->low), f->high);
+    __m256i q = _mm256_srl_epi32(_mm256_mullo_epi32(_mm256_srl_epi32(x, f->shift), f->multiplier), f->bits);
+    if (ties_possible)
+    {
+        *ties = _mm256_or_si256(*ties, _mm256_cmpeq_epi32(x, _mm256_mullo_epi32(q, f->divisor)));
+    }
+    return q;
+}
+
+AVX2 static int matrix_avx2(RGBQUAD *row, int width, const MATRIX *matrix, const FIXED *fixed)
+{
+    const __m256i spread_rg = _mm256_setr_epi8(RED_GREEN, RED_GREEN);
+    const __m256i spread_b = _mm256_setr_epi8(BLUE_ONLY, BLUE_ONLY);
+    const __m256i one = _mm256_set1_epi32(1 << 16);
+    const __m256i spread = _mm256_setr_epi8(SPREAD, SPREAD);
+    const __m256i pack_b = _mm256_setr_epi8(PACK(0), PACK(0));
+    const __m256i pack_g = _mm256_setr_epi8(PACK(1), PACK(1));
+    const __m256i pack_r = _mm256_setr_epi8(PACK(2), PACK(2));
+    FIXED256 f;
+    for (int c = 0; c < 3; c++)
+    {
+        f.red_green[c] = _mm256_set1_epi32(fixed->red_green[c]);
+        f.blue_offset[c] = _mm256_set1_epi32(fixed->blue_offset[c]);
+    }
+    f.low = _mm256_set1_epi32(fixed->low);
+    f.high = _mm256_set1_epi32(fixed->high);
+    f.multiplier = _mm256_set1_epi32(fixed->multiplier);
+    f.divisor = _mm256_set1_epi32(fixed->divisor);
+    f.shift = _mm_cvtsi32_si128(fixed->shift);
+    f.bits = _mm_cvtsi32_si128(fixed->bits);
+    int ties_possible = fixed->ties;
+    int uniform = fixed->uniform;
+
+    int j = 0;
+    for (; j + 8 <= width; j += 8)
+    {
+        __m256i *p = (__m256i *) (row + j);
+        __m256i v = _mm256_loadu_si256(p);
+        __m256i rg = _mm256_shuffle_epi8(v, spread_rg);
+        __m256i b1 = _mm256_or_si256(_mm256_shuffle_epi8(v, spread_b), one);
+
+        __m256i ties = _mm256_setzero_si256();
+        __m256i out;
+        if (uniform)
+        {
+            out = _mm256_shuffle_epi8(channel_avx2(rg, b1, &f, 0, ties_possible, &ties), spread);
+        }
+        else
+        {
+            __m256i red = channel_avx2(rg, b1, &f, 0, ties_possible, &ties);
+            __m256i green = channel_avx2(rg, b1, &f, 1, ties_possible, &ties);
+            __m256i blue = channel_avx2(rg, b1, &f, 2, ties_possible, &ties);
+            out = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(blue, pack_b), _mm256_shuffle_epi8(green, pack_g)),
+                                  _mm256_shuffle_epi8(red, pack_r));
+        }
+
+        if (!_mm256_testz_si256(ties, ties))
+        {
+            for (int k = 0; k < 8; k++)
+            {
+                matrix_pixel(&row[j + k], matrix);
+            }
+            continue;
+        }
+        _mm256_storeu_si256(p, out);
+    }
+    return j + matrix_sse41(row + j, width - j, matrix, fixed);
+}
+
+// Halving adds the two rows in 16-bit lanes, each 128-bit half of a register holding two pixels: interleaving the
+// 64-bit halves of two such registers lines each even pixel up with the odd pixel to its right, and their sums,
+// rounded and packed back to bytes, are pixels of the output
+
+// Sum two pairs of pixels of each of two rows, widened to 16-bit lanes, into one pair of output pixels (whose
+// fourth bytes are the same sums of the fourth bytes), still to be rounded
+SSE41 static inline __m128i halve_pairs_sse41(__m128i upper, __m128i lower)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i left = _mm_add_epi16(_mm_unpacklo_epi8(upper, zero), _mm_unpacklo_epi8(lower, zero));
+    __m128i right = _mm_add_epi16(_mm_unpackhi_epi8(upper, zero), _mm_unpackhi_epi8(lower, zero));
+    return _mm_add_epi16(_mm_unpacklo_epi64(left, right), _mm_unpackhi_epi64(left, right));
+}
+
+SSE41 static int halve_sse41(const BYTE *upper, const BYTE *lower, BYTE *out, int width)
+{
+    // Each step reads 8 pixels of each row and writes 4
+    __m128i two = _mm_set1_epi16(2);
+    int j = 0;
+    for (; j + 4 <= width; j += 4)
+    {
+        const __m128i *u = (const __m128i *) (upper + 8 * (size_t) j);
+        const __m128i *l = (const __m128i *) (lower + 8 * (size_t) j);
+        __m128i first = halve_pairs_sse41(_mm_loadu_si128(u), _mm_loadu_si128(l));
+        __m128i second = halve_pairs_sse41(_mm_loadu_si128(u + 1), _mm_loadu_si128(l + 1));
+        first = _mm_srli_epi16(_mm_add_epi16(first, two), 2);
+        second = _mm_srli_epi16(_mm_add_epi16(second, two), 2);
+        _mm_storeu_si128((__m128i *) (out + 4 * (size_t) j), _mm_packus_epi16(first, second));
+    }
+    return j;
+}
+
+// The same, with two halving steps side by side, one in each 128-bit half
+AVX2 static inline __m256i halve_pairs_avx2(__m256i upper, __m256i lower)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i left = _mm256_add_epi16(_mm256_unpacklo_epi8(upper, zero), _mm256_unpacklo_epi8(lower, zero));
+    __m256i right = _mm256_add_epi16(_mm256_unpackhi_epi8(upper, zero), _mm256_unpackhi_epi8(lower, zero));
+    return _mm256_add_epi16(_mm256_unpacklo_epi64(left, right), _mm256_unpackhi_epi64(left, right));
+}
+
+AVX2 static int halve_avx2(const BYTE *upper, const BYTE *lower, BYTE *out, int width)
+{
+    // Each step reads 16 pixels of each row and writes 8. Packing works within 128-bit halves, so it leaves the
+    // output pixels in the order 0, 1, 4, 5, 2, 3, 6, 7, and a permute of 64-bit pieces puts them back in order
+    __m256i two = _mm256_set1_epi16(2);
+    int j = 0;
+    for (; j + 8 <= width; j += 8)
+    {
+        const __m256i *u = (const __m256i *) (upper + 8 * (size_t) j);
+        const __m256i *l = (const __m256i *) (lower + 8 * (size_t) j);
+        __m256i first = halve_pairs_avx2(_mm256_loadu_si256(u), _mm256_loadu_si256(l));
+        __m256i second = halve_pairs_avx2(_mm256_loadu_si256(u + 1), _mm256_loadu_si256(l + 1));
+        first = _mm256_srli_epi16(_mm256_add_epi16(first, two), 2);
+        second = _mm256_srli_epi16(_mm256_add_epi16(second, two), 2);
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(first, second), 0xd8);
+        _mm256_storeu_si256((__m256i *) (out + 4 * (size_t) j), packed);
+    }
+    return j + halve_sse41(upper + 8 * (size_t) j, lower + 8 * (size_t) j, out + 4 * (size_t) j, width - j);
+}
+
+// Converting between 24-bit scanlines and pixels in memory only moves bytes about: 4 pixels of a scanline are
+// spread over a register with a zero byte after each, or the fourth bytes of 4 pixels in memory are dropped
+#define EXPAND 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+#define SQUEEZE 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+
+// Reverse the order of the 32-bit lanes of a 256-bit register
+#define BACKWARDS 7, 6, 5, 4, 3, 2, 1, 0
+
+SSE41 static int expand_sse41(const BYTE *in, RGBQUAD *out, int width)
+{
+    __m128i expand = _mm_setr_epi8(EXPAND);
+    int j = 0;
+    for (; j + SSE_PIXELS <= width; j += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + 3 * (size_t) j));
+        _mm_storeu_si128((__m128i *) (out + j), _mm_shuffle_epi8(v, expand));
+    }
+    return j;
+}
+
+AVX2 static int expand_avx2(const BYTE *in, RGBQUAD *out, int width)
+{
+    __m256i expand = _mm256_setr_epi8(EXPAND, EXPAND);
+    int j = 0;
+    for (; j + AVX2_PIXELS <= width; j += 8)
+    {
+        _mm256_storeu_si256((__m256i *) (out + j), _mm256_shuffle_epi8(load24(in + 3 * (size_t) j), expand));
+    }
+    return j + expand_sse41(in + 3 * (size_t) j, out + j, width - j);
+}
+
+SSE41 static int pack_sse41(const RGBQUAD *in, BYTE *out, int width, int mirror)
+{
+    // Reflected, the 4 pixels written come from the other end of the row, last first. Each step stores 16 bytes,
+    // the last 4 of which the next step overwrites
+    __m128i squeeze = _mm_setr_epi8(SQUEEZE);
+    int j = 0;
+    for (; j + SSE_PIXELS <= width; j += 4)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + (mirror ? width - 4 - j : j)));
+        v = mirror ? _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 1, 2, 3)) : v;
+        _mm_storeu_si128((__m128i *) (out + 3 * (size_t) j), _mm_shuffle_epi8(v, squeeze));
+    }
+    return j;
+}
+
+AVX2 static int pack_avx2(const RGBQUAD *in, BYTE *out, int width, int mirror)
+{
+    __m256i squeeze = _mm256_setr_epi8(SQUEEZE, SQUEEZE);
+    __m256i backwards = _mm256_setr_epi32(BACKWARDS);
+    int j = 0;
+    for (; j + AVX2_PIXELS <= width; j += 8)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (in + (mirror ? width - 8 - j : j)));
+        v = mirror ? _mm256_permutevar8x32_epi32(v, backwards) : v;
+        store24(out + 3 * (size_t) j, _mm256_shuffle_epi8(v, squeeze));
+    }
+    return j + pack_sse41(mirror ? in : in + j, out + 3 * (size_t) j, width - j, mirror);
+}
+
+// Edges use the Sobel operators on each channel byte of rows of 3-byte pixels, so that no lanes go to the fourth
+// bytes. Gradients of 8-bit values fit in 16-bit lanes, and _mm_madd_epi16 on interleaved (gx, gy) pairs gives
+// gx * gx + gy * gy in 32-bit lanes. Capped at 255 * 256, that converts to float exactly, and a float square root
+// rounds the same way as the scalar code's. The results are spread out into pixels in memory as they are stored
+
+// The magnitudes of 4 pairs of gradients in 32-bit lanes, capped at 255
+SSE41 static inline __m128i magnitude_sse41(__m128i pairs)
+{
+    __m128i squared = _mm_min_epi32(_mm_madd_epi16(pairs, pairs), _mm_set1_epi32(255 * 255 + 255));
+    __m128 root = _mm_add_ps(_mm_sqrt_ps(_mm_cvtepi32_ps(squared)), _mm_set1_ps(0.5f));
+    return _mm_cvttps_epi32(root);
+}
+
+// The edges of the 8 channel bytes of the middle row from k on, in the low half of a register
+SSE41 static inline __m128i edges8_sse41(const BYTE *above, const BYTE *middle, const BYTE *below, size_t k)
+{
+    __m128i aboveLeft = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (above + k - 3)));
+    __m128i aboveCenter = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (above + k)));
+    __m128i aboveRight = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (above + k + 3)));
+    __m128i middleLeft = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (middle + k - 3)));
+    __m128i middleRight = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (middle + k + 3)));
+    __m128i belowLeft = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (below + k - 3)));
+    __m128i belowCenter = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (below + k)));
+    __m128i belowRight = _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i *) (below + k + 3)));
+
+    __m128i gx = _mm_add_epi16(_mm_add_epi16(_mm_sub_epi16(aboveRight, aboveLeft), _mm_sub_epi16(belowRight, belowLeft)),
+                               _mm_slli_epi16(_mm_sub_epi16(middleRight, middleLeft), 1));
+    __m128i gy = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(belowLeft, belowRight), _mm_slli_epi16(belowCenter, 1)),
+                               _mm_add_epi16(_mm_add_epi16(aboveLeft, aboveRight), _mm_slli_epi16(aboveCenter, 1)));
+
+    __m128i low = magnitude_sse41(_mm_unpacklo_epi16(gx, gy));
+    __m128i high = magnitude_sse41(_mm_unpackhi_epi16(gx, gy));
+    return _mm_packus_epi16(_mm_packus_epi32(low, high), _mm_setzero_si128());
+}
+
+// The edges of 8 pixels of the middle row from pixel j on, written to out
+SSE41 static inline void edges_step_sse41(const BYTE *above, const BYTE *middle, const BYTE *below, RGBQUAD *out,
+                                          int j)
+{
+    __m128i expand = _mm_setr_epi8(EXPAND);
+    size_t k = 3 * (size_t) j;
+    __m128i first = _mm_unpacklo_epi64(edges8_sse41(above, middle, below, k),
+                                       edges8_sse41(above, middle, below, k + 8));
+    __m128i last = edges8_sse41(above, middle, below, k + 16);
+    _mm_storeu_si128((__m128i *) (out + j), _mm_shuffle_epi8(first, expand));
+    _mm_storeu_si128((__m128i *) (out + j + 4), _mm_shuffle_epi8(_mm_alignr_epi8(last, first, 12), expand));
+}
+
+SSE41 static int edges_sse41(const BYTE *above, const BYTE *middle, const BYTE *below, RGBQUAD *out, int width,
+                             int j)
+{
+    // Each step does 8 pixels, 24 channel bytes, from pixel j on, and reads a pixel either side of them, so it
+    // stops a pixel short of the end of the row. The rows it reads are not the one it writes, so the last step can
+    // go back over pixels that are done, ending on the last but one pixel
+    for (; j + 9 <= width; j += 8)
+    {
+        edges_step_sse41(above, middle, below, out, j);
+    }
+    if (width >= 10 && j < width - 1)
+    {
+        edges_step_sse41(above, middle, below, out, width - 9);
+        j = width - 1;
+    }
+    return j - 1;
+}
+
+// The magnitudes of 8 pairs of gradients in 32-bit lanes, capped at 255
+AVX2 static inline __m256i magnitude_avx2(__m256i pairs)
+{
+    __m256i squared = _mm256_min_epi32(_mm256_madd_epi16(pairs, pairs), _mm256_set1_epi32(255 * 255 + 255));
+    __m256 root = _mm256_add_ps(_mm256_sqrt_ps(_mm256_cvtepi32_ps(squared)), _mm256_set1_ps(0.5f));
+    return _mm256_cvttps_epi32(root);
+}
+
+// 16 channel bytes widened to 16-bit lanes
+AVX2 static inline __m256i load16(const BYTE *p)
+{
+    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+}
+
+// The edges of the 16 channel bytes of the middle row from k on
+AVX2 static inline __m128i edges16_avx2(const BYTE *above, const BYTE *middle, const BYTE *below, size_t k)
+{
+    __m256i aboveLeft = load16(above + k - 3), aboveCenter = load16(above + k), aboveRight = load16(above + k + 3);
+    __m256i middleLeft = load16(middle + k - 3), middleRight = load16(middle + k + 3);
+    __m256i belowLeft = load16(below + k - 3), belowCenter = load16(below + k), belowRight = load16(below + k + 3);
+
+    __m256i gx = _mm256_add_epi16(_mm256_add_epi16(_mm256_sub_epi16(aboveRight, aboveLeft), _mm256_sub_epi16(belowRight, belowLeft)),
+                                  _mm256_slli_epi16(_mm256_sub_epi16(middleRight, middleLeft), 1));
+    __m256i gy = _mm256_sub_epi16(_mm256_add_epi16(_mm256_add_epi16(belowLeft, belowRight), _mm256_slli_epi16(belowCenter, 1)),
+                                  _mm256_add_epi16(_mm256_add_epi16(aboveLeft, aboveRight), _mm256_slli_epi16(aboveCenter, 1)));
+
+    // Unpacking and packing both work within 128-bit halves, so the bytes come back out in order
+    __m256i low = magnitude_avx2(_mm256_unpacklo_epi16(gx, gy));
+    __m256i high = magnitude_avx2(_mm256_unpackhi_epi16(gx, gy));
+    __m256i words = _mm256_packus_epi32(low, high);
+    return _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+}
+
+AVX2 static int edges_avx2(const BYTE *above, const BYTE *middle, const BYTE *below, RGBQUAD *out, int width)
+{
+    // Each step does 16 pixels, 48 channel bytes, and reads a pixel either side of them, so it stops a pixel short
+    // of the end of the row
+    __m128i expand = _mm_setr_epi8(EXPAND);
+    int j = 1;
+    for (; j + 17 <= width; j += 16)
+    {
+        size_t k = 3 * (size_t) j;
+        __m128i first = edges16_avx2(above, middle, below, k);
+        __m128i second = edges16_avx2(above, middle, below, k + 16);
+        __m128i third = edges16_avx2(above, middle, below, k + 32);
+        _mm_storeu_si128((__m128i *) (out + j), _mm_shuffle_epi8(first, expand));
+        _mm_storeu_si128((__m128i *) (out + j + 4), _mm_shuffle_epi8(_mm_alignr_epi8(second, first, 12), expand));
+        _mm_storeu_si128((__m128i *) (out + j + 8), _mm_shuffle_epi8(_mm_alignr_epi8(third, second, 8), expand));
+        _mm_storeu_si128((__m128i *) (out + j + 12), _mm_shuffle_epi8(_mm_srli_si128(third, 4), expand));
+    }
+    return edges_sse41(above, middle, below, out, width, j);
+}
+
+int matrix_simd(RGBQUAD *row, int width, const MATRIX *matrix)
+{
+    FIXED fixed;
+    if (!__builtin_cpu_supports("sse4.1") || !fixed_matrix(matrix, &fixed))
+    {
+        return 0;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return matrix_avx2(row, width, matrix, &fixed);
+    }
+    return matrix_sse41(row, width, matrix, &fixed);
+}
+
+int edges_simd(const BYTE *above, const BYTE *middle, const BYTE *below, RGBQUAD *out, int width)
+{
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return edges_avx2(above, middle, below, out, width);
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return edges_sse41(above, middle, below, out, width, 1);
+    }
+    return 0;
+}
+
+int halve_simd(const BYTE *upper, const BYTE *lower, BYTE *out, int width)
+{
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return halve_avx2(upper, lower, out, width);
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return halve_sse41(upper, lower, out, width);
+    }
+    return 0;
+}
+
+int expand_simd(const BYTE *in, RGBQUAD *out, int width)
+{
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return expand_avx2(in, out, width);
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return expand_sse41(in, out, width);
+    }
+    return 0;
+}
+
+int pack_simd(const RGBQUAD *in, BYTE *out, int width, int mirror)
+{
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return pack_avx2(in, out, width, mirror);
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return pack_sse41(in, out, width, mirror);
+    }
+    return 0;
+}
+
+#else
+
+// Other architectures use the scalar code for every pixel
+
+int matrix_simd(RGBQUAD *row, int width, const MATRIX *matrix)
+{
+    return 0;
+}
+
+int edges_simd(const BYTE *above, const BYTE *middle, const BYTE *below, RGBQUAD *out, int width)
+{
+    return 0;
+}
+
+int halve_simd(const BYTE *upper, const BYTE *lower, BYTE *out, int width)
+{
+    return 0;
+}
+
+int expand_simd(const BYTE *in, RGBQUAD *out, int width)
+{
+    return 0;
+}
+
+int pack_simd(const RGBQUAD *in, BYTE *out, int width, int mirror)
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,176 @@
+#define _GNU_SOURCE  // For syscall()
+
+#include <stdio.h>      // For printing the statistics
+#include <string.h>     // For memset()
+#include <time.h>       // For clock_gettime()
+#include <unistd.h>     // For read(), close() and syscall()
+
+#ifdef __linux__
+#include <linux/perf_event.h>  // For the hardware counters
+#include <sys/ioctl.h>         // For starting and stopping them
+#include <sys/syscall.h>       // For SYS_perf_event_open
+#endif
+
+#include "stats.h"
+
+// What the stages and counters are called in reports
+static const char *const STAGE_NAMES[STAGES] = {"open", "headers", "read", "filter", "write", "close"};
+static const char *const COUNTER_NAMES[COUNTERS] = {"cycles", "instructions", "llc_misses"};
+
+double stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Open one hardware counter, stopped, for this thread and the threads it goes on to create; -1 if not allowed
+static int open_counter(COUNTER counter)
+{
+#ifdef __linux__
+    static const unsigned long long configs[COUNTERS] =
+    {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES  // Usually the LLC's
+    };
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[counter];
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;  // Unprivileged users may only count their own code
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+void stats_init(STATS *stats)
+{
+    memset(stats, 0, sizeof(STATS));
+    stats->start = stats_now();
+    for (int c = 0; c < COUNTERS; c++)
+    {
+        stats->fds[c] = open_counter(c);
+    }
+}
+
+void stats_start_counters(STATS *stats)
+{
+#ifdef __linux__
+    for (int c = 0; stats != NULL && c < COUNTERS; c++)
+    {
+        if (stats->fds[c] >= 0)
+        {
+            ioctl(stats->fds[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+void stats_stop_counters(STATS *stats)
+{
+#ifdef __linux__
+    for (int c = 0; stats != NULL && c < COUNTERS; c++)
+    {
+        if (stats->fds[c] >= 0)
+        {
+            ioctl(stats->fds[c], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(stats->fds[c], &stats->counts[c], sizeof(long long)) != sizeof(long long))
+            {
+                close(stats->fds[c]);
+                stats->fds[c] = -1;
+            }
+        }
+    }
+#endif
+}
+
+void stats_add(STATS *stats, STAGE stage, double start, size_t bytes)
+{
+    if (stats != NULL)
+    {
+        stats->seconds[stage] += stats_now() - start;
+        stats->bytes[stage] += bytes;
+    }
+}
+
+// Megabytes (or megapixels) per second, or 0 for a stage too quick to time
+static double rate(double amount, double seconds)
+{
+    return seconds > 0 ? amount / 1e6 / seconds : 0;
+}
+
+void stats_print(STATS *stats, int json)
+{
+    double total = stats_now() - stats->start;
+    double filtering = stats->seconds[STAGE_FILTER];
+    int counted = 1;
+    for (int c = 0; c < COUNTERS; c++)
+    {
+        counted &= stats->fds[c] >= 0;
+    }
+
+    if (json)
+    {
+        printf("{\n  \"stages\": {\n");
+        for (int s = 0; s < STAGES; s++)
+        {
+            printf("    \"%s\": {\"seconds\": %.6f, \"bytes\": %zu, \"mb_per_s\": %.1f}%s\n", STAGE_NAMES[s],
+                   stats->seconds[s], stats->bytes[s], rate(stats->bytes[s], stats->seconds[s]), s + 1 < STAGES ? "," : "");
+        }
+        printf("  },\n  \"total_seconds\": %.6f,\n  \"streamed\": %s,\n  \"megapixels\": %.3f,\n"
+               "  \"megapixels_per_s\": %.1f,\n  \"counters\": ",
+               total, stats->streamed ? "true" : "false", stats->megapixels, rate(stats->megapixels * 1e6, filtering));
+        if (counted)
+        {
+            printf("{");
+            for (int c = 0; c < COUNTERS; c++)
+            {
+                printf("\"%s\": %lld%s", COUNTER_NAMES[c], stats->counts[c], c + 1 < COUNTERS ? ", " : "");
+            }
+            printf("}\n}\n");
+        }
+        else
+        {
+            printf("null\n}\n");
+        }
+    }
+    else
+    {
+        printf("%-10s %12s %14s %10s\n", "Stage", "Seconds", "Bytes", "MB/s");
+        for (int s = 0; s < STAGES; s++)
+        {
+            printf("%-10s %12.6f %14zu %10.1f\n", STAGE_NAMES[s], stats->seconds[s], stats->bytes[s],
+                   rate(stats->bytes[s], stats->seconds[s]));
+        }
+        printf("%-10s %12.6f\n", "total", total);
+        if (stats->streamed)
+        {
+            printf("(Streamed: reading, filtering and writing overlapped.)\n");
+        }
+        printf("Filtered %.3f MP at %.1f MP/s.\n", stats->megapixels, rate(stats->megapixels * 1e6, filtering));
+        if (counted)
+        {
+            long long cycles = stats->counts[COUNTER_CYCLES];
+            long long instructions = stats->counts[COUNTER_INSTRUCTIONS];
+            printf("Filter stage: %lld cycles, %lld instructions (%.2f per cycle), %lld LLC misses.\n", cycles,
+                   instructions, cycles > 0 ? (double) instructions / cycles : 0, stats->counts[COUNTER_LLC_MISSES]);
+        }
+        else
+        {
+            printf("Hardware counters are not available.\n");
+        }
+    }
+
+    for (int c = 0; c < COUNTERS; c++)
+    {
+        if (stats->fds[c] >= 0)
+        {
+            close(stats->fds[c]);
+            stats->fds[c] = -1;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+// Timing each stage of a run, and counting what the CPU did while filtering, for --stats
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+// The stages of a run, in order
+typedef enum
+{
+    STAGE_OPEN,     // Opening the input and output files
+    STAGE_HEADERS,  // Reading and checking the headers
+    STAGE_READ,     // Reading (or mapping) the pixels and converting them into rows in memory
+    STAGE_FILTER,   // Running the filters
+    STAGE_WRITE,    // Writing the headers and pixels
+    STAGE_CLOSE,    // Closing the files
+    STAGES
+} STAGE;
+
+// Hardware counters read with perf_event_open, where the kernel allows it
+typedef enum
+{
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_LLC_MISSES,
+    COUNTERS
+} COUNTER;
+
+typedef struct
+{
+    double start;                  // When the run started
+    double seconds[STAGES];        // Time spent in each stage (streamed stages overlap, so may add to more than the run)
+    size_t bytes[STAGES];          // Bytes each stage moved
+    double megapixels;             // Size of the image
+    int streamed;                  // Whether the read, filter and write stages ran at the same time
+    int fds[COUNTERS];             // The counters' file descriptors, or -1 for those not available
+    long long counts[COUNTERS];    // What the counters counted during the filter stage
+} STATS;
+
+// Seconds since some fixed point, for timing stages
+double stats_now(void);
+
+// Start a run's statistics, opening (but not yet starting) the hardware counters for this thread and every
+// thread it creates from now on, so that the filter stage is counted on all of the pool's threads
+void stats_init(STATS *stats);
+
+// Start and stop the counters around the filter stage (stats may be NULL, when nothing is being recorded)
+void stats_start_counters(STATS *stats);
+void stats_stop_counters(STATS *stats);
+
+// Add the time since start, and bytes moved, to a stage (stats may be NULL)
+void stats_add(STATS *stats, STAGE stage, double start, size_t bytes);
+
+// Print a run's statistics to stdout as a table or as JSON, and close the counters
+void stats_print(STATS *stats, int json);
+
+#endif
@@ -0,0 +1,255 @@
+#include <pthread.h>  // For the reading and writing threads
+#include <stdlib.h>   // For malloc() and free()
+#include <string.h>   // For memcpy()
+
+#include "bands.h"
+#include "stream.h"
+
+// Strips in flight: one being written, one being filtered by each pass of the chain, the next one
+// (whose first rows are the halo of the strip in the first pass), and one being read
+#define STRIPS (MAX_STEPS + 3)
+
+// What has happened to the strip in a buffer so far
+typedef enum
+{
+    EMPTY,    // Free for the reader
+    READ,     // Holds unfiltered rows
+    FILTERED  // Ready for the writer
+} STATE;
+
+// Everything the reading, filtering and writing threads share
+typedef struct
+{
+    FILE *inptr;
+    WRITER *output;
+    IMAGE strips[STRIPS];   // Buffer k % buffers holds strip k
+    BYTE *extras[STRIPS];   // The fourth bytes of a 32-bit strip's pixels, or NULL for a 24-bit file
+    STATE states[STRIPS];
+    int buffers;            // Number of buffers in use
+    int count;              // Number of strips in the image
+    int rows;               // Rows in every strip but (maybe) the last
+    int height;             // Rows in the image
+    int mirror;             // Whether to write the rows reflected
+    STATS *stats;           // Where to time the reading and writing, or NULL
+    size_t scanline;        // Bytes in each scanline of the file
+    int failed;             // Whether the reader or writer ran out of memory converting rows
+    pthread_mutex_t lock;   // Protects states
+    pthread_cond_t changed; // Signalled whenever a state changes
+} STREAM;
+
+// Wait until strip k's buffer is in the given state, then return it
+static IMAGE *wait_for(STREAM *stream, int k, STATE state)
+{
+    pthread_mutex_lock(&stream->lock);
+    while (stream->states[k % stream->buffers] != state)
+    {
+        pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return &stream->strips[k % stream->buffers];
+}
+
+// Hand strip k's buffer on to the next thread
+static void set_state(STREAM *stream, int k, STATE state)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->states[k % stream->buffers] = state;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Read the strips in order, each into the next free buffer
+static void *reader(void *arg)
+{
+    STREAM *stream = arg;
+    for (int k = 0; k < stream->count; k++)
+    {
+        IMAGE *strip = wait_for(stream, k, EMPTY);
+        int start = k * stream->rows;
+        strip->height = stream->height - start < stream->rows ? stream->height - start : stream->rows;
+
+        // Read the strip's scanlines; missing rows are left black
+        double started = stats_now();
+        if (bmp_read_rows(stream->inptr, strip, stream->extras[k % stream->buffers]) != BMP_OK)
+        {
+            stream->failed = 1;
+        }
+        stats_add(stream->stats, STAGE_READ, started, stream->scanline * strip->height);
+
+        set_state(stream, k, READ);
+    }
+    return NULL;
+}
+
+// Write the strips in order as soon as they are filtered
+static void *writer(void *arg)
+{
+    STREAM *stream = arg;
+    for (int k = 0; k < stream->count; k++)
+    {
+        IMAGE *strip = wait_for(stream, k, FILTERED);
+
+        double started = stats_now();
+        if (bmp_write_rows(stream->output, strip, stream->extras[k % stream->buffers], stream->mirror) != 0)
+        {
+            stream->failed = 1;
+        }
+        stats_add(stream->stats, STAGE_WRITE, started, stream->scanline * strip->height);
+
+        set_state(stream, k, EMPTY);
+    }
+    return NULL;
+}
+
+// Run a pass of the chain over strip k, whose neighbours are in the buffers around it: the strip above has
+// been through the pass already, so its last rows were saved (with the pass's loads) in one of the pass's
+// two halos, while the strip below has not, so its first rows can be copied now
+static int filter_strip(STREAM *stream, const PASS *pass, RGBQUAD *halos, int halo, int k, POOL *pool)
+{
+    IMAGE *strip = &stream->strips[k % stream->buffers];
+    int width = strip->width;
+    RGBQUAD *rows_above = halos + (size_t) (k % 2) * 2 * halo * width;
+    RGBQUAD *rows_next = halos + (size_t) ((k + 1) % 2) * 2 * halo * width;
+
+    // The rows above the strip were saved from the previous strip before this pass changed it
+    HALO around = {.above = k * stream->rows < halo ? k * stream->rows : halo, .below = 0, .rows = rows_above};
+
+    // The rows below it are the first rows of the next strip, which this pass has not reached yet
+    if (k + 1 < stream->count)
+    {
+        IMAGE *next = &stream->strips[(k + 1) % stream->buffers];
+        around.below = next->height < halo ? next->height : halo;
+        for (int i = 0; i < around.below; i++)
+        {
+            RGBQUAD *copy = rows_above + (size_t) (around.above + i) * width;
+            memcpy(copy, image_row(next, i), width * sizeof(RGBQUAD));
+            load_row(&pass->options, copy, width);
+        }
+    }
+
+    // Save this strip's last rows for the next strip's halo, before they are changed
+    for (int i = 0; i < halo && k + 1 < stream->count; i++)
+    {
+        RGBQUAD *copy = rows_next + (size_t) i * width;
+        memcpy(copy, image_row(strip, strip->height - halo + i), width * sizeof(RGBQUAD));
+        load_row(&pass->options, copy, width);
+    }
+
+    return apply_filter(pass->filter, &pass->options, strip, &around, pool);
+}
+
+BMPSTATUS stream_filter(FILE *inptr, WRITER *output, const CHAIN *chain, int rows, POOL *pool, STATS *stats)
+{
+    // Only the headers are read up front; they can go straight out, since filters do not change them
+    BMP bmp;
+    double start = stats_now();
+    BMPSTATUS status = bmp_read_headers(inptr, &bmp);
+    stats_add(stats, STAGE_HEADERS, start, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+    if (status != BMP_OK)
+    {
+        return status;
+    }
+    start = stats_now();
+    bmp_write_headers(output, &bmp);
+    stats_add(stats, STAGE_WRITE, start, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+    if (stats != NULL)
+    {
+        stats->streamed = 1;
+        stats->megapixels = (double) bmp.image.width * bmp.image.height / 1e6;
+    }
+
+    // A strip must be at least as tall as the halo any pass needs, so that its halo comes from its neighbors only
+    int width = bmp.image.width;
+    int passes = chain->pass_count;
+    int halos[MAX_STEPS];
+    size_t total = 0;
+    for (int p = 0; p < passes; p++)
+    {
+        halos[p] = pass_halo(&chain->passes[p]);
+        total += (size_t) 2 * 2 * halos[p] * width;
+        if (rows < halos[p])
+        {
+            rows = halos[p];
+        }
+    }
+    if (rows > bmp.image.height)
+    {
+        rows = bmp.image.height > 0 ? bmp.image.height : 1;
+    }
+
+    STREAM stream = {.inptr = inptr, .output = output, .rows = rows, .height = bmp.image.height,
+                     .scanline = bmp_scanline(&bmp)};
+    stream.count = (bmp.image.height + rows - 1) / rows;
+    stream.buffers = passes + 3;
+    stream.mirror = chain->orientation.mirror;
+    stream.stats = stats;
+
+    // Allocate the strip buffers, plus two halos per pass that take turns: while one strip goes through the pass
+    // with its halo, the last rows of that strip are saved as the top of the next strip's halo
+    // (and, for a 32-bit file, room in each strip for the fourth bytes of its pixels)
+    BYTE *buffers = alloc_rows((size_t) stream.buffers * rows * bmp.image.stride);
+    BYTE *extras = bmp.bi.biBitCount == 32 ? malloc((size_t) stream.buffers * rows * width) : NULL;
+    RGBQUAD *carries = total > 0 ? malloc(total * sizeof(RGBQUAD)) : NULL;
+    if (buffers == NULL || (bmp.bi.biBitCount == 32 && extras == NULL) || (total > 0 && carries == NULL))
+    {
+        free(buffers);
+        free(extras);
+        free(carries);
+        return BMP_NO_MEMORY;
+    }
+    for (int b = 0; b < stream.buffers; b++)
+    {
+        stream.strips[b] = bmp.image;
+        stream.strips[b].data = buffers + (size_t) b * rows * bmp.image.stride;
+        stream.extras[b] = extras != NULL ? extras + (size_t) b * rows * width : NULL;
+        stream.states[b] = EMPTY;
+    }
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+
+    // The counters run for the whole stream, since reading and writing overlap with filtering
+    stats_start_counters(stats);
+    pthread_t reading, writing;
+    pthread_create(&reading, NULL, reader, &stream);
+    pthread_create(&writing, NULL, writer, &stream);
+
+    // Once strip n has been read, pass p (counting from 1) filters strip n - p: the strip below it has just
+    // been through pass p - 1, and no pass has reached it yet. Each strip leaves the last pass for the writer
+    int failed = 0;
+    for (int n = 0; n < stream.count + passes; n++)
+    {
+        if (n < stream.count)
+        {
+            wait_for(&stream, n, READ);
+        }
+
+        RGBQUAD *halo = carries;
+        for (int p = 1; p <= passes; p++)
+        {
+            int k = n - p;
+            if (k >= 0 && k < stream.count)
+            {
+                IMAGE *strip = &stream.strips[k % stream.buffers];
+                start = stats_now();
+                failed |= filter_strip(&stream, &chain->passes[p - 1], halo, halos[p - 1], k, pool);
+                stats_add(stats, STAGE_FILTER, start, strip->stride * strip->height);
+            }
+            halo += (size_t) 2 * 2 * halos[p - 1] * width;
+        }
+
+        if (n - passes >= 0 && n - passes < stream.count)
+        {
+            set_state(&stream, n - passes, FILTERED);
+        }
+    }
+
+    pthread_join(reading, NULL);
+    pthread_join(writing, NULL);
+    stats_stop_counters(stats);
+    pthread_cond_destroy(&stream.changed);
+    pthread_mutex_destroy(&stream.lock);
+    free(buffers);
+    free(extras);
+    free(carries);
+    return failed || stream.failed ? BMP_NO_MEMORY : BMP_OK;
+}
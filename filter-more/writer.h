@@ -0,0 +1,41 @@
+// Writing an output file in large blocks, each with a single positioned write system call, either there and then
+// or queued on an io_uring so that the writes proceed while the caller gets on with other work
+
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <stdio.h>
+#include <sys/uio.h>  // For struct iovec
+
+// Most pieces one write may gather (e.g., the two headers and the pixels, or the rows of a flipped image)
+#define MAX_PIECES 64
+
+typedef struct WRITER WRITER;
+
+// Start writing to outptr at its current position, bypassing its stdio buffer (which is flushed first). With
+// async set, writes are queued on an io_uring where the kernel allows it (they are made there and then
+// otherwise, and always for outputs like pipes that cannot be written at an offset). Returns NULL if there is
+// no memory
+WRITER *writer_open(FILE *outptr, int async);
+
+// Whether writes are being queued rather than made there and then
+int writer_async(const WRITER *writer);
+
+// Write count pieces of memory next in the file, as one write, returning a ticket for it; in async mode, the
+// memory must not change until writer_wait() has been called with that ticket
+long writer_write(WRITER *writer, const struct iovec *pieces, int count);
+
+// Wait until the write with the given ticket, and every write before it, is done
+void writer_wait(WRITER *writer, long ticket);
+
+// Copy the next length bytes of inptr next in the file, and wait until they are written; returns 0 on success, or 1
+// if there was no memory for a buffer (writer_close() reports failed writes). Between regular files the kernel copies
+// them itself, with copy_file_range(), without bringing them into memory; anything else goes through a buffer. Bytes
+// past the end of the input are written as zeros
+int writer_copy(WRITER *writer, FILE *inptr, size_t length);
+
+// Wait for every write, leave outptr positioned after them and free the writer; returns 0 if every write
+// succeeded
+int writer_close(WRITER *writer);
+
+#endif
@@ -0,0 +1,405 @@
+#include <math.h>    // For fabs(), sqrt() and log10()
+#include <stdlib.h>  // For calloc() and free()
+#include <string.h>  // For memcpy()
+
+#include "analyze.h"
+
+// Samples read at a time when scanning a stream
+#define BLOCK_SAMPLES (64 * 1024)
+
+// Full scale of each format, in its units (8-bit samples are centred on 0 first)
+static const double FULL_SCALE[] = {128.0, 32768.0, 8388608.0, 2147483648.0, 1.0};
+
+// A scanner: adds count samples to the totals, starting at a lane, and returns the lane after the last one
+typedef int (*SCAN)(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane);
+
+// Add one sample to the totals of its lane
+static inline void add_lane(ANALYSIS *analysis, int lane, double value)
+{
+    double magnitude = fabs(value);
+    if (magnitude > analysis->peaks[lane])
+    {
+        analysis->peaks[lane] = magnitude;
+    }
+    analysis->squares[lane] += value * value;
+}
+
+// The scalar scanners, which the vector ones use for the samples at the end of a block
+
+static int scan_u8(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    for (size_t i = 0; i < count; i++, lane = lane + 1 == analysis->period ? 0 : lane + 1)
+    {
+        add_lane(analysis, lane, bytes[i] - 128);
+    }
+    return lane;
+}
+
+static int scan_s16(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    for (size_t i = 0; i < count; i++, lane = lane + 1 == analysis->period ? 0 : lane + 1)
+    {
+        int16_t sample;
+        memcpy(&sample, bytes + 2 * i, sizeof(sample));
+        add_lane(analysis, lane, sample);
+    }
+    return lane;
+}
+
+static int scan_s24(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    for (size_t i = 0; i < count; i++, lane = lane + 1 == analysis->period ? 0 : lane + 1)
+    {
+        // Put the 3 bytes at the top of 32 bits, then shift them down to extend the sign
+        const uint8_t *p = bytes + 3 * i;
+        int32_t sample = (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24) >> 8;
+        add_lane(analysis, lane, sample);
+    }
+    return lane;
+}
+
+static int scan_s32(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    for (size_t i = 0; i < count; i++, lane = lane + 1 == analysis->period ? 0 : lane + 1)
+    {
+        int32_t sample;
+        memcpy(&sample, bytes + 4 * i, sizeof(sample));
+        add_lane(analysis, lane, sample);
+    }
+    return lane;
+}
+
+static int scan_f32(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    for (size_t i = 0; i < count; i++, lane = lane + 1 == analysis->period ? 0 : lane + 1)
+    {
+        float sample;
+        memcpy(&sample, bytes + 4 * i, sizeof(sample));
+        add_lane(analysis, lane, sample);
+    }
+    return lane;
+}
+
+static const SCAN SCALAR[] = {scan_u8, scan_s16, scan_s24, scan_s32, scan_f32};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>  // For SSE4.1 and AVX2 intrinsics
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+// Spread 4 packed 24-bit samples over the top 3 bytes of four 32-bit lanes (bytes with the high bit set are zeroed)
+#define SPREAD24 -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+
+// Samples a 24-bit step needs room for, since it loads 16 bytes to get 12
+#define S24_SAMPLES 6  // ceil(16 / 3)
+
+// Load 4 integer samples of each format into 32-bit lanes
+
+SSE41 static inline __m128i load_u8(const uint8_t *p)
+{
+    uint32_t in;
+    memcpy(&in, p, sizeof(in));
+    return _mm_sub_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(in)), _mm_set1_epi32(128));
+}
+
+SSE41 static inline __m128i load_s16(const uint8_t *p)
+{
+    return _mm_cvtepi16_epi32(_mm_loadl_epi64((const __m128i *) p));
+}
+
+SSE41 static inline __m128i load_s24(const uint8_t *p)
+{
+    __m128i in = _mm_loadu_si128((const __m128i *) p);
+    return _mm_srai_epi32(_mm_shuffle_epi8(in, _mm_setr_epi8(SPREAD24)), 8);
+}
+
+SSE41 static inline __m128i load_s32(const uint8_t *p)
+{
+    return _mm_loadu_si128((const __m128i *) p);
+}
+
+// Add 4 samples to the totals of 4 lanes, starting at a multiple of 4, and return the lane after them
+
+SSE41 static inline int add_sse41(ANALYSIS *analysis, int lane, __m128d low, __m128d high)
+{
+    __m128d sign = _mm_set1_pd(-0.0);
+    double *peaks = analysis->peaks + lane;
+    double *squares = analysis->squares + lane;
+    _mm_storeu_pd(peaks, _mm_max_pd(_mm_loadu_pd(peaks), _mm_andnot_pd(sign, low)));
+    _mm_storeu_pd(peaks + 2, _mm_max_pd(_mm_loadu_pd(peaks + 2), _mm_andnot_pd(sign, high)));
+    _mm_storeu_pd(squares, _mm_add_pd(_mm_loadu_pd(squares), _mm_mul_pd(low, low)));
+    _mm_storeu_pd(squares + 2, _mm_add_pd(_mm_loadu_pd(squares + 2), _mm_mul_pd(high, high)));
+    return lane + 4 == analysis->period ? 0 : lane + 4;
+}
+
+AVX2 static inline int add_avx2(ANALYSIS *analysis, int lane, __m256d values)
+{
+    double *peaks = analysis->peaks + lane;
+    double *squares = analysis->squares + lane;
+    __m256d magnitude = _mm256_andnot_pd(_mm256_set1_pd(-0.0), values);
+    _mm256_storeu_pd(peaks, _mm256_max_pd(_mm256_loadu_pd(peaks), magnitude));
+    _mm256_storeu_pd(squares, _mm256_add_pd(_mm256_loadu_pd(squares), _mm256_mul_pd(values, values)));
+    return lane + 4 == analysis->period ? 0 : lane + 4;
+}
+
+// Split 4 samples in 32-bit lanes into two pairs of doubles
+SSE41 static inline int add_ints_sse41(ANALYSIS *analysis, int lane, __m128i samples)
+{
+    return add_sse41(analysis, lane, _mm_cvtepi32_pd(samples), _mm_cvtepi32_pd(_mm_srli_si128(samples, 8)));
+}
+
+// The vector scanners, 4 samples at a time, starting at a lane that is a multiple of 4
+
+SSE41 static int scan_u8_sse41(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        lane = add_ints_sse41(analysis, lane, load_u8(bytes + i));
+    }
+    return scan_u8(analysis, bytes + i, count - i, lane);
+}
+
+AVX2 static int scan_u8_avx2(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        lane = add_avx2(analysis, lane, _mm256_cvtepi32_pd(load_u8(bytes + i)));
+    }
+    return scan_u8(analysis, bytes + i, count - i, lane);
+}
+
+SSE41 static int scan_s16_sse41(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        lane = add_ints_sse41(analysis, lane, load_s16(bytes + 2 * i));
+    }
+    return scan_s16(analysis, bytes + 2 * i, count - i, lane);
+}
+
+AVX2 static int scan_s16_avx2(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        lane = add_avx2(analysis, lane, _mm256_cvtepi32_pd(load_s16(bytes + 2 * i)));
+    }
+    return scan_s16(analysis, bytes + 2 * i, count - i, lane);
+}
+
+SSE41 static int scan_s24_sse41(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + S24_SAMPLES <= count; i += 4)
+    {
+        lane = add_ints_sse41(analysis, lane, load_s24(bytes + 3 * i));
+    }
+    return scan_s24(analysis, bytes + 3 * i, count - i, lane);
+}
+
+AVX2 static int scan_s24_avx2(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + S24_SAMPLES <= count; i += 4)
+    {
+        lane = add_avx2(analysis, lane, _mm256_cvtepi32_pd(load_s24(bytes + 3 * i)));
+    }
+    return scan_s24(analysis, bytes + 3 * i, count - i, lane);
+}
+
+SSE41 static int scan_s32_sse41(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        lane = add_ints_sse41(analysis, lane, load_s32(bytes + 4 * i));
+    }
+    return scan_s32(analysis, bytes + 4 * i, count - i, lane);
+}
+
+AVX2 static int scan_s32_avx2(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        lane = add_avx2(analysis, lane, _mm256_cvtepi32_pd(load_s32(bytes + 4 * i)));
+    }
+    return scan_s32(analysis, bytes + 4 * i, count - i, lane);
+}
+
+SSE41 static int scan_f32_sse41(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 samples = _mm_loadu_ps((const float *) (bytes + 4 * i));
+        lane = add_sse41(analysis, lane, _mm_cvtps_pd(samples), _mm_cvtps_pd(_mm_movehl_ps(samples, samples)));
+    }
+    return scan_f32(analysis, bytes + 4 * i, count - i, lane);
+}
+
+AVX2 static int scan_f32_avx2(ANALYSIS *analysis, const uint8_t *bytes, size_t count, int lane)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        lane = add_avx2(analysis, lane, _mm256_cvtps_pd(_mm_loadu_ps((const float *) (bytes + 4 * i))));
+    }
+    return scan_f32(analysis, bytes + 4 * i, count - i, lane);
+}
+
+static const SCAN SSE41_SCANS[] = {scan_u8_sse41, scan_s16_sse41, scan_s24_sse41, scan_s32_sse41, scan_f32_sse41};
+static const SCAN AVX2_SCANS[] = {scan_u8_avx2, scan_s16_avx2, scan_s24_avx2, scan_s32_avx2, scan_f32_avx2};
+
+// The fastest scanner for a format on this CPU
+static SCAN scanner(FORMAT format)
+{
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return AVX2_SCANS[format];
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return SSE41_SCANS[format];
+    }
+    return SCALAR[format];
+}
+
+#else
+
+// Other architectures use the scalar scanners
+static SCAN scanner(FORMAT format)
+{
+    return SCALAR[format];
+}
+
+#endif
+
+int analysis_init(ANALYSIS *analysis, FORMAT format, int channels)
+{
+    // The least common multiple of channels and 8
+    int a = channels, b = 8;
+    while (b != 0)
+    {
+        int r = a % b;
+        a = b;
+        b = r;
+    }
+    *analysis = (ANALYSIS) {.format = format, .channels = channels, .period = channels / a * 8};
+    analysis->peaks = calloc(analysis->period, sizeof(double));
+    analysis->squares = calloc(analysis->period, sizeof(double));
+    if (analysis->peaks == NULL || analysis->squares == NULL)
+    {
+        analysis_free(analysis);
+        return 1;
+    }
+    return 0;
+}
+
+void analysis_add(ANALYSIS *analysis, const void *samples, size_t count, uint64_t first)
+{
+    // The vector scanners start at a lane that is a multiple of 4 (which the period is too), so the first few
+    // samples may need the scalar one
+    const uint8_t *bytes = samples;
+    int lane = first % analysis->period;
+    size_t lead = (4 - lane % 4) % 4;
+    lead = lead < count ? lead : count;
+    lane = SCALAR[analysis->format](analysis, bytes, lead, lane);
+    scanner(analysis->format)(analysis, bytes + lead * format_bytes(analysis->format), count - lead, lane);
+    analysis->samples += count;
+}
+
+void analysis_merge(ANALYSIS *into, const ANALYSIS *from)
+{
+    for (int l = 0; l < into->period; l++)
+    {
+        into->peaks[l] = from->peaks[l] > into->peaks[l] ? from->peaks[l] : into->peaks[l];
+        into->squares[l] += from->squares[l];
+    }
+    into->samples += from->samples;
+}
+
+double analysis_peak(const ANALYSIS *analysis, int channel)
+{
+    double peak = 0;
+    for (int l = 0; l < analysis->period; l++)
+    {
+        if ((channel < 0 || l % analysis->channels == channel) && analysis->peaks[l] > peak)
+        {
+            peak = analysis->peaks[l];
+        }
+    }
+    return peak / FULL_SCALE[analysis->format];
+}
+
+double analysis_rms(const ANALYSIS *analysis, int channel)
+{
+    // Samples are numbered from the start of the data, so channel c has every channels-th one from number c
+    double sum = 0;
+    for (int l = 0; l < analysis->period; l++)
+    {
+        if (channel < 0 || l % analysis->channels == channel)
+        {
+            sum += analysis->squares[l];
+        }
+    }
+    uint64_t samples = analysis->samples;
+    if (channel >= 0)
+    {
+        samples = samples > (uint64_t) channel ? (samples - channel - 1) / analysis->channels + 1 : 0;
+    }
+    return samples > 0 ? sqrt(sum / samples) / FULL_SCALE[analysis->format] : 0;
+}
+
+int analyze_stream(FILE *input, const WAV *wav, ANALYSIS *analysis)
+{
+    int bytes = format_bytes(wav->format);
+    size_t block = (size_t) BLOCK_SAMPLES * bytes;
+    uint8_t *buffer = malloc(block);
+    if (buffer == NULL)
+    {
+        return 1;
+    }
+
+    // A partial sample at the end, if the data chunk has one, is left out
+    uint64_t remaining = wav->length;
+    uint64_t first = 0;
+    size_t count;
+    while (remaining > 0 && (count = fread(buffer, 1, remaining < block ? remaining : block, input)) > 0)
+    {
+        analysis_add(analysis, buffer, count / bytes, first);
+        first += count / bytes;
+        remaining -= count;
+    }
+    free(buffer);
+    return 0;
+}
+
+// A level in decibels relative to full scale (-inf for silence)
+static double dbfs(double level)
+{
+    return 20 * log10(level);
+}
+
+void analysis_print(const ANALYSIS *analysis)
+{
+    printf("%-10s %12s %12s\n", "Channel", "Peak (dBFS)", "RMS (dBFS)");
+    for (int c = 0; c < analysis->channels; c++)
+    {
+        printf("%-10d %12.2f %12.2f\n", c + 1, dbfs(analysis_peak(analysis, c)), dbfs(analysis_rms(analysis, c)));
+    }
+    printf("%-10s %12.2f %12.2f\n", "all", dbfs(analysis_peak(analysis, -1)), dbfs(analysis_rms(analysis, -1)));
+}
+
+void analysis_free(ANALYSIS *analysis)
+{
+    free(analysis->peaks);
+    free(analysis->squares);
+    analysis->peaks = NULL;
+    analysis->squares = NULL;
+}
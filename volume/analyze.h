@@ -0,0 +1,49 @@
+// Measuring the peak and RMS level of each channel of a WAV file's samples, for --stats and normalization
+
+#ifndef ANALYZE_H
+#define ANALYZE_H
+
+#include <stddef.h>  // For size_t
+#include <stdint.h>  // For fixed-width integer types
+#include <stdio.h>   // For FILE
+
+#include "wav.h"
+
+// Running totals of a scan. Samples are interleaved a frame at a time, so the totals are kept in lanes, one per
+// sample of a period that is a whole number of frames and of vectors: lane l belongs to channel l % channels
+typedef struct
+{
+    FORMAT format;
+    int channels;
+    int period;          // Lanes, the least common multiple of channels and 8
+    double *peaks;       // Largest magnitude seen in each lane, in the format's units
+    double *squares;     // Sum of squares in each lane
+    uint64_t samples;    // Samples scanned
+} ANALYSIS;
+
+// Start a scan of samples in a format with the given number of channels; returns 0 on success, or 1 if there
+// is not enough memory
+int analysis_init(ANALYSIS *analysis, FORMAT format, int channels);
+
+// Scan count samples, the first of which is sample number first of the data (so that scans of separate
+// ranges on separate threads can be merged)
+void analysis_add(ANALYSIS *analysis, const void *samples, size_t count, uint64_t first);
+
+// Add the totals of one scan of the same data to another's
+void analysis_merge(ANALYSIS *into, const ANALYSIS *from);
+
+// Peak and RMS level of a channel, or of all of them if channel is -1, as a fraction of full scale
+double analysis_peak(const ANALYSIS *analysis, int channel);
+double analysis_rms(const ANALYSIS *analysis, int channel);
+
+// Scan the sample data of a WAV file a block at a time from input, which must be at the first sample; returns 0
+// on success, or 1 if there is not enough memory
+int analyze_stream(FILE *input, const WAV *wav, ANALYSIS *analysis);
+
+// Print the peak and RMS level of each channel, and of them all, in dBFS
+void analysis_print(const ANALYSIS *analysis);
+
+// Release a scan's totals
+void analysis_free(ANALYSIS *analysis);
+
+#endif
@@ -0,0 +1,371 @@
+#include <stdint.h>  // For fixed-width integer types
+#include <string.h>  // For memcpy()
+
+#include "gain.h"
+
+// Range of each integer format's samples; products are clamped to it before they are converted, so that no
+// conversion can overflow (8-bit samples are centred on 0 first)
+#define U8_LOWEST -128.0f
+#define U8_HIGHEST 127.0f
+#define S16_LOWEST -32768.0f
+#define S16_HIGHEST 32767.0f
+#define S24_LOWEST -8388608.0
+#define S24_HIGHEST 8388607.0
+#define S32_LOWEST -2147483648.0
+#define S32_HIGHEST 2147483647.0
+
+static const int BYTES[] = {1, 2, 3, 4, 4};
+
+int format_bytes(FORMAT format)
+{
+    return BYTES[format];
+}
+
+// Clamp a product to a range and truncate it toward zero
+static inline int32_t clamp_float(float product, float lowest, float highest)
+{
+    return product > highest ? highest : product < lowest ? lowest : (int32_t) product;
+}
+static inline int32_t clamp_double(double product, double lowest, double highest)
+{
+    return product > highest ? highest : product < lowest ? lowest : (int32_t) product;
+}
+
+// The scalar kernels, which the vector ones use for the samples at the end of a block. Samples are copied in
+// and out with memcpy(), since a mapped file's sample data need not be aligned
+
+static void gain_u8(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    float scale = factor;
+    for (size_t i = 0; i < count; i++)
+    {
+        bytes[i] = 128 + clamp_float((float) (bytes[i] - 128) * scale, U8_LOWEST, U8_HIGHEST);
+    }
+}
+
+static void gain_s16(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    float scale = factor;
+    for (size_t i = 0; i < count; i++)
+    {
+        int16_t sample;
+        memcpy(&sample, bytes + 2 * i, sizeof(sample));
+        sample = clamp_float((float) sample * scale, S16_LOWEST, S16_HIGHEST);
+        memcpy(bytes + 2 * i, &sample, sizeof(sample));
+    }
+}
+
+static void gain_s24(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    for (size_t i = 0; i < count; i++)
+    {
+        // Put the 3 bytes at the top of 32 bits, then shift them down to extend the sign
+        uint8_t *p = bytes + 3 * i;
+        int32_t sample = (int32_t) ((uint32_t) p[0] << 8 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 24) >> 8;
+        sample = clamp_double((double) sample * factor, S24_LOWEST, S24_HIGHEST);
+        p[0] = sample;
+        p[1] = sample >> 8;
+        p[2] = sample >> 16;
+    }
+}
+
+static void gain_s32(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    for (size_t i = 0; i < count; i++)
+    {
+        int32_t sample;
+        memcpy(&sample, bytes + 4 * i, sizeof(sample));
+        sample = clamp_double((double) sample * factor, S32_LOWEST, S32_HIGHEST);
+        memcpy(bytes + 4 * i, &sample, sizeof(sample));
+    }
+}
+
+static void gain_f32(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    float scale = factor;
+    for (size_t i = 0; i < count; i++)
+    {
+        float sample;
+        memcpy(&sample, bytes + 4 * i, sizeof(sample));
+        sample *= scale;
+        memcpy(bytes + 4 * i, &sample, sizeof(sample));
+    }
+}
+
+static const GAIN SCALAR[] = {gain_u8, gain_s16, gain_s24, gain_s32, gain_f32};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>  // For SSE4.1 and AVX2 intrinsics
+
+#define SSE41 __attribute__((target("sse4.1")))
+#define AVX2 __attribute__((target("avx2")))
+
+// Spread 4 packed 24-bit samples over the top 3 bytes of four 32-bit lanes (bytes with the high bit set are
+// zeroed), and gather them back from the bottom 3 bytes
+#define SPREAD24 -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11
+#define GATHER24 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1
+
+// Samples a 24-bit vector step needs room for: 4 are loaded with a 16-byte load, and 8 with two of them 12 bytes
+// apart, so a step never reads past the end of the block
+#define S24_SSE_SAMPLES 6   // ceil(16 / 3)
+#define S24_AVX2_SAMPLES 10 // ceil(28 / 3)
+
+// Store the first 12 bytes of v, leaving the bytes after them alone
+SSE41 static inline void store12(uint8_t *p, __m128i v)
+{
+    _mm_storel_epi64((__m128i *) p, v);
+    uint32_t last = _mm_extract_epi32(v, 2);
+    memcpy(p + 8, &last, sizeof(last));
+}
+
+// Scale 4 samples in 32-bit lanes in single precision, the way clamp_float() does
+SSE41 static inline __m128i scale_ps128(__m128i samples, __m128 factor, __m128 lowest, __m128 highest)
+{
+    __m128 product = _mm_mul_ps(_mm_cvtepi32_ps(samples), factor);
+    return _mm_cvttps_epi32(_mm_max_ps(_mm_min_ps(product, highest), lowest));
+}
+
+// Scale 4 samples in 32-bit lanes in double precision, the way clamp_double() does
+SSE41 static inline __m128i scale_pd128(__m128i samples, __m128d factor, __m128d lowest, __m128d highest)
+{
+    __m128d low = _mm_mul_pd(_mm_cvtepi32_pd(samples), factor);
+    __m128d high = _mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(samples, 8)), factor);
+    low = _mm_max_pd(_mm_min_pd(low, highest), lowest);
+    high = _mm_max_pd(_mm_min_pd(high, highest), lowest);
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(low), _mm_cvttpd_epi32(high));
+}
+
+// Scale 8 samples in 32-bit lanes in single precision
+AVX2 static inline __m256i scale_ps256(__m256i samples, __m256 factor, __m256 lowest, __m256 highest)
+{
+    __m256 product = _mm256_mul_ps(_mm256_cvtepi32_ps(samples), factor);
+    return _mm256_cvttps_epi32(_mm256_max_ps(_mm256_min_ps(product, highest), lowest));
+}
+
+// Scale 8 samples in 32-bit lanes in double precision
+AVX2 static inline __m256i scale_pd256(__m256i samples, __m256d factor, __m256d lowest, __m256d highest)
+{
+    __m256d low = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_castsi256_si128(samples)), factor);
+    __m256d high = _mm256_mul_pd(_mm256_cvtepi32_pd(_mm256_extracti128_si256(samples, 1)), factor);
+    low = _mm256_max_pd(_mm256_min_pd(low, highest), lowest);
+    high = _mm256_max_pd(_mm256_min_pd(high, highest), lowest);
+    __m256i result = _mm256_castsi128_si256(_mm256_cvttpd_epi32(low));
+    return _mm256_inserti128_si256(result, _mm256_cvttpd_epi32(high), 1);
+}
+
+// 8-bit samples, 4 at a time with SSE4.1 and 8 at a time with AVX2
+
+SSE41 static void gain_u8_sse41(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    __m128 scale = _mm_set1_ps(factor);
+    __m128 lowest = _mm_set1_ps(U8_LOWEST);
+    __m128 highest = _mm_set1_ps(U8_HIGHEST);
+    __m128i centre = _mm_set1_epi32(128);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        uint32_t in;
+        memcpy(&in, bytes + i, sizeof(in));
+        __m128i centred = _mm_sub_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(in)), centre);
+        __m128i out = _mm_add_epi32(scale_ps128(centred, scale, lowest, highest), centre);
+        uint32_t packed = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(out, out), out));
+        memcpy(bytes + i, &packed, sizeof(packed));
+    }
+    gain_u8(bytes + i, count - i, factor);
+}
+
+AVX2 static void gain_u8_avx2(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    __m256 scale = _mm256_set1_ps(factor);
+    __m256 lowest = _mm256_set1_ps(U8_LOWEST);
+    __m256 highest = _mm256_set1_ps(U8_HIGHEST);
+    __m256i centre = _mm256_set1_epi32(128);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i in = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (bytes + i)));
+        __m256i out = _mm256_add_epi32(scale_ps256(_mm256_sub_epi32(in, centre), scale, lowest, highest), centre);
+
+        // Packing works within each 128-bit half, leaving 4 bytes at the start of each
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(out, out), out);
+        __m128i both = _mm_unpacklo_epi32(_mm256_castsi256_si128(packed), _mm256_extracti128_si256(packed, 1));
+        _mm_storel_epi64((__m128i *) (bytes + i), both);
+    }
+    gain_u8_sse41(bytes + i, count - i, factor);
+}
+
+// 16-bit samples, 8 at a time with SSE4.1 and 16 at a time with AVX2
+
+SSE41 static void gain_s16_sse41(void *samples, size_t count, double factor)
+{
+    int16_t *words = samples;
+    __m128 scale = _mm_set1_ps(factor);
+    __m128 lowest = _mm_set1_ps(S16_LOWEST);
+    __m128 highest = _mm_set1_ps(S16_HIGHEST);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *) (words + i));
+        __m128i low = scale_ps128(_mm_cvtepi16_epi32(in), scale, lowest, highest);
+        __m128i high = scale_ps128(_mm_cvtepi16_epi32(_mm_srli_si128(in, 8)), scale, lowest, highest);
+        _mm_storeu_si128((__m128i *) (words + i), _mm_packs_epi32(low, high));
+    }
+    gain_s16(words + i, count - i, factor);
+}
+
+AVX2 static void gain_s16_avx2(void *samples, size_t count, double factor)
+{
+    int16_t *words = samples;
+    __m256 scale = _mm256_set1_ps(factor);
+    __m256 lowest = _mm256_set1_ps(S16_LOWEST);
+    __m256 highest = _mm256_set1_ps(S16_HIGHEST);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i first = _mm_loadu_si128((const __m128i *) (words + i));
+        __m128i second = _mm_loadu_si128((const __m128i *) (words + i + 8));
+        __m256i low = scale_ps256(_mm256_cvtepi16_epi32(first), scale, lowest, highest);
+        __m256i high = scale_ps256(_mm256_cvtepi16_epi32(second), scale, lowest, highest);
+
+        // Packing works within each 128-bit half, so put the halves back in order afterwards
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xd8);
+        _mm256_storeu_si256((__m256i *) (words + i), packed);
+    }
+    gain_s16_sse41(words + i, count - i, factor);
+}
+
+// 24-bit samples, 4 at a time with SSE4.1 and 8 at a time with AVX2
+
+SSE41 static void gain_s24_sse41(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    __m128d scale = _mm_set1_pd(factor);
+    __m128d lowest = _mm_set1_pd(S24_LOWEST);
+    __m128d highest = _mm_set1_pd(S24_HIGHEST);
+    __m128i spread = _mm_setr_epi8(SPREAD24);
+    __m128i gather = _mm_setr_epi8(GATHER24);
+    size_t i = 0;
+    for (; i + S24_SSE_SAMPLES <= count; i += 4)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *) (bytes + 3 * i));
+        __m128i out = scale_pd128(_mm_srai_epi32(_mm_shuffle_epi8(in, spread), 8), scale, lowest, highest);
+        store12(bytes + 3 * i, _mm_shuffle_epi8(out, gather));
+    }
+    gain_s24(bytes + 3 * i, count - i, factor);
+}
+
+AVX2 static void gain_s24_avx2(void *samples, size_t count, double factor)
+{
+    uint8_t *bytes = samples;
+    __m256d scale = _mm256_set1_pd(factor);
+    __m256d lowest = _mm256_set1_pd(S24_LOWEST);
+    __m256d highest = _mm256_set1_pd(S24_HIGHEST);
+    __m256i spread = _mm256_setr_epi8(SPREAD24, SPREAD24);
+    __m256i gather = _mm256_setr_epi8(GATHER24, GATHER24);
+    size_t i = 0;
+    for (; i + S24_AVX2_SAMPLES <= count; i += 8)
+    {
+        // 4 samples in each 128-bit half
+        uint8_t *p = bytes + 3 * i;
+        __m128i first = _mm_loadu_si128((const __m128i *) p);
+        __m128i second = _mm_loadu_si128((const __m128i *) (p + 12));
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(first), second, 1);
+        __m256i out = scale_pd256(_mm256_srai_epi32(_mm256_shuffle_epi8(in, spread), 8), scale, lowest, highest);
+        out = _mm256_shuffle_epi8(out, gather);
+        store12(p, _mm256_castsi256_si128(out));
+        store12(p + 12, _mm256_extracti128_si256(out, 1));
+    }
+    gain_s24_sse41(bytes + 3 * i, count - i, factor);
+}
+
+// 32-bit integer samples, 4 at a time with SSE4.1 and 8 at a time with AVX2
+
+SSE41 static void gain_s32_sse41(void *samples, size_t count, double factor)
+{
+    int32_t *words = samples;
+    __m128d scale = _mm_set1_pd(factor);
+    __m128d lowest = _mm_set1_pd(S32_LOWEST);
+    __m128d highest = _mm_set1_pd(S32_HIGHEST);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *) (words + i));
+        _mm_storeu_si128((__m128i *) (words + i), scale_pd128(in, scale, lowest, highest));
+    }
+    gain_s32(words + i, count - i, factor);
+}
+
+AVX2 static void gain_s32_avx2(void *samples, size_t count, double factor)
+{
+    int32_t *words = samples;
+    __m256d scale = _mm256_set1_pd(factor);
+    __m256d lowest = _mm256_set1_pd(S32_LOWEST);
+    __m256d highest = _mm256_set1_pd(S32_HIGHEST);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256i in = _mm256_loadu_si256((const __m256i *) (words + i));
+        _mm256_storeu_si256((__m256i *) (words + i), scale_pd256(in, scale, lowest, highest));
+    }
+    gain_s32_sse41(words + i, count - i, factor);
+}
+
+// 32-bit float samples, 4 at a time with SSE4.1 and 8 at a time with AVX2
+
+SSE41 static void gain_f32_sse41(void *samples, size_t count, double factor)
+{
+    float *floats = samples;
+    __m128 scale = _mm_set1_ps(factor);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(floats + i, _mm_mul_ps(_mm_loadu_ps(floats + i), scale));
+    }
+    gain_f32(floats + i, count - i, factor);
+}
+
+AVX2 static void gain_f32_avx2(void *samples, size_t count, double factor)
+{
+    float *floats = samples;
+    __m256 scale = _mm256_set1_ps(factor);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        _mm256_storeu_ps(floats + i, _mm256_mul_ps(_mm256_loadu_ps(floats + i), scale));
+    }
+    gain_f32_sse41(floats + i, count - i, factor);
+}
+
+static const GAIN SSE41_KERNELS[] = {gain_u8_sse41, gain_s16_sse41, gain_s24_sse41, gain_s32_sse41, gain_f32_sse41};
+static const GAIN AVX2_KERNELS[] = {gain_u8_avx2, gain_s16_avx2, gain_s24_avx2, gain_s32_avx2, gain_f32_avx2};
+
+GAIN gain_kernel(FORMAT format)
+{
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return AVX2_KERNELS[format];
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return SSE41_KERNELS[format];
+    }
+    return SCALAR[format];
+}
+
+#else
+
+// Other architectures use the scalar kernels
+GAIN gain_kernel(FORMAT format)
+{
+    return SCALAR[format];
+}
+
+#endif
@@ -0,0 +1,31 @@
+// Scaling blocks of audio samples by a gain, with a kernel specialised for each sample format and vectorized
+// where the CPU supports it
+
+#ifndef GAIN_H
+#define GAIN_H
+
+#include <stddef.h>  // For size_t
+
+// Sample formats of uncompressed WAV files, all little-endian
+typedef enum
+{
+    FORMAT_U8,   // 8-bit unsigned integers, with silence at 128
+    FORMAT_S16,  // 16-bit signed integers
+    FORMAT_S24,  // 24-bit signed integers, packed 3 bytes apiece
+    FORMAT_S32,  // 32-bit signed integers
+    FORMAT_F32   // 32-bit floats, with full scale at 1.0
+} FORMAT;
+
+// Bytes in one sample of a format
+int format_bytes(FORMAT format);
+
+// A gain kernel: scales count samples of one format in place by factor. Integer samples are multiplied in single
+// precision (8-bit and 16-bit samples, as volume always has) or double precision (wider ones, which single
+// precision cannot hold exactly), truncated toward zero, and saturated to their format's range rather than
+// wrapped around. Float samples are simply multiplied, since they may go beyond full scale
+typedef void (*GAIN)(void *samples, size_t count, double factor);
+
+// The fastest kernel for a format on this CPU, chosen once so that the sample loop has no decisions to make
+GAIN gain_kernel(FORMAT format);
+
+#endif
@@ -0,0 +1,183 @@
+#define _POSIX_C_SOURCE 200809L  // For fileno(), ftruncate(), posix_fallocate() and mmap()
+
+#include <errno.h>     // For errno, EOPNOTSUPP and EINVAL
+#include <fcntl.h>     // For posix_fallocate()
+#include <stdint.h>    // For fixed-width integer types
+#include <stdlib.h>    // For calloc() and free()
+#include <string.h>    // For memcpy()
+#include <sys/mman.h>  // For mmap(), munmap() and posix_madvise()
+#include <sys/stat.h>  // For fstat()
+#include <unistd.h>    // For ftruncate()
+
+#include "gain.h"
+#include "mapped.h"
+
+// Bytes of sample data in each range a thread takes at a time, and in each piece of a range that is copied and
+// then scaled while it is still in the cache
+#define RANGE_BYTES (1024 * 1024)
+#define PIECE_BYTES (64 * 1024)
+
+// Everything the threads share while scaling the sample data
+typedef struct
+{
+    const uint8_t *in;  // The sample data in the input map
+    uint8_t *out;       // Where it goes in the output map
+    uint64_t length;    // Bytes of sample data
+    size_t range;       // Bytes in every range but (maybe) the last, in whole frames
+    size_t piece;       // Bytes in every piece but (maybe) the last of a range, in whole samples
+    GAIN gain;
+    int bytes;          // Bytes in each sample
+    double factor;
+} JOB;
+
+// Copy one range of the sample data to the output and scale it there
+static void scale_range(void *arg, int index, int thread)
+{
+    const JOB *job = arg;
+    uint64_t start = (uint64_t) index * job->range;
+    size_t length = job->length - start < job->range ? job->length - start : job->range;
+    for (size_t done = 0; done < length; done += job->piece)
+    {
+        // A partial sample at the very end is copied as it is
+        size_t size = length - done < job->piece ? length - done : job->piece;
+        memcpy(job->out + start + done, job->in + start + done, size);
+        job->gain(job->out + start + done, size / job->bytes, job->factor);
+    }
+}
+
+// Map the whole of a regular file for reading, giving its size; returns NULL if it cannot be mapped
+static const uint8_t *map_input(FILE *input, const WAV *wav, size_t *size)
+{
+    // The map starts at the start of the file, so the WAV file must too (which it need not, e.g. on stdin)
+    struct stat st;
+    if (fstat(fileno(input), &st) != 0 || !S_ISREG(st.st_mode) || (uint64_t) st.st_size < wav->header_size ||
+        ftello(input) != (off_t) wav->header_size)
+    {
+        return NULL;
+    }
+    const uint8_t *in = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fileno(input), 0);
+    if (in == MAP_FAILED)
+    {
+        return NULL;
+    }
+    posix_madvise((void *) in, st.st_size, POSIX_MADV_SEQUENTIAL);
+    *size = st.st_size;
+    return in;
+}
+
+// The sample data runs from the end of the header for as long as the data chunk says, or as much of that as
+// the file holds; it is split into ranges of whole frames
+static uint64_t data_length(const WAV *wav, size_t size)
+{
+    return size - wav->header_size < wav->length ? size - wav->header_size : wav->length;
+}
+static size_t range_bytes(const WAV *wav)
+{
+    return RANGE_BYTES > wav->frame ? (size_t) (RANGE_BYTES / wav->frame) * wav->frame : wav->frame;
+}
+
+int scale_mapped(FILE *input, FILE *output, const WAV *wav, double factor, POOL *pool)
+{
+    // Only regular files can be mapped, and only from their start; the output is the same size as the input
+    int fd = fileno(output);
+    struct stat out;
+    if (fstat(fd, &out) != 0 || !S_ISREG(out.st_mode) || ftello(output) != 0)
+    {
+        return 1;
+    }
+    size_t size;
+    const uint8_t *in = map_input(input, wav, &size);
+    if (in == NULL)
+    {
+        return 1;
+    }
+
+    // Reserve the output's blocks now, so that running out of disk is an error here rather than a fault when a
+    // thread writes to the map. Only a file system that cannot reserve blocks at all gets a file that is merely
+    // set to its size; any other failure (no space, a file too large, an I/O error) leaves the file to be written
+    // a block at a time, which reports it
+    int reserved = posix_fallocate(fd, 0, size);
+    if (reserved == EOPNOTSUPP || reserved == EINVAL)
+    {
+        reserved = ftruncate(fd, size) == 0 ? 0 : errno;
+    }
+    uint8_t *out_map = reserved == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (out_map == MAP_FAILED)
+    {
+        munmap((void *) in, size);
+        return 1;
+    }
+
+    // Split the sample data into ranges, and those into pieces of whole samples
+    size_t start = wav->header_size;
+    uint64_t length = data_length(wav, size);
+    JOB job = {.in = in + start, .out = out_map + start, .length = length, .range = range_bytes(wav),
+               .gain = gain_kernel(wav->format), .bytes = format_bytes(wav->format), .factor = factor};
+    job.piece = (size_t) (PIECE_BYTES / job.bytes) * job.bytes;
+
+    // Everything around the sample data is copied as it is
+    memcpy(out_map, in, start);
+    memcpy(out_map + start + length, in + start + length, size - start - length);
+    pool_run(pool, (length + job.range - 1) / job.range, scale_range, &job);
+
+    munmap((void *) in, size);
+    munmap(out_map, size);
+    return 0;
+}
+
+// Everything the threads share while scanning the sample data
+typedef struct
+{
+    const uint8_t *in;     // The sample data in the input map
+    uint64_t length;       // Bytes of sample data
+    size_t range;          // Bytes in every range but (maybe) the last, in whole frames
+    int bytes;             // Bytes in each sample
+    ANALYSIS *analyses;    // One scan for each thread
+} SCANJOB;
+
+// Scan one range of the sample data into the totals of the thread that took it
+static void scan_range(void *arg, int index, int thread)
+{
+    const SCANJOB *job = arg;
+    uint64_t start = (uint64_t) index * job->range;
+    size_t length = job->length - start < job->range ? job->length - start : job->range;
+    analysis_add(&job->analyses[thread], job->in + start, length / job->bytes, start / job->bytes);
+}
+
+int analyze_mapped(FILE *input, const WAV *wav, ANALYSIS *analysis, POOL *pool)
+{
+    size_t size;
+    const uint8_t *in = map_input(input, wav, &size);
+    if (in == NULL)
+    {
+        return 1;
+    }
+
+    // Each thread keeps its own totals, which are added up at the end
+    int threads = pool_threads(pool);
+    SCANJOB job = {.in = in + wav->header_size, .length = data_length(wav, size), .range = range_bytes(wav),
+                   .bytes = format_bytes(wav->format), .analyses = calloc(threads, sizeof(ANALYSIS))};
+    int failed = job.analyses == NULL;
+    int ready = 0;
+    while (!failed && ready < threads)
+    {
+        failed = analysis_init(&job.analyses[ready], wav->format, wav->channels);
+        ready += !failed;
+    }
+    if (!failed)
+    {
+        pool_run(pool, (job.length + job.range - 1) / job.range, scan_range, &job);
+        for (int t = 0; t < threads; t++)
+        {
+            analysis_merge(analysis, &job.analyses[t]);
+        }
+    }
+
+    for (int t = 0; t < ready; t++)
+    {
+        analysis_free(&job.analyses[t]);
+    }
+    free(job.analyses);
+    munmap((void *) in, size);
+    return failed;
+}
@@ -0,0 +1,25 @@
+// Scaling or scanning the samples of a large WAV file on many threads at once, through memory maps of the input
+// and output
+
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include <stdio.h>  // For FILE
+
+#include "analyze.h"
+#include "pool.h"
+#include "wav.h"
+
+// Map the whole of input (whose header has been read into wav) and of output (sized to match up front), copy
+// everything but the sample data across as it is, and scale the sample data by factor in frame-aligned ranges
+// spread over the pool's threads, each writing its own part of the output map. Returns 0 on success, or 1 if
+// either file cannot be mapped (e.g., a pipe), in which case nothing has been written through output's stream
+// and the caller can scale the file a block at a time instead
+int scale_mapped(FILE *input, FILE *output, const WAV *wav, double factor, POOL *pool);
+
+// Map the whole of input and scan its sample data into analysis in frame-aligned ranges spread over the pool's
+// threads, each adding to totals of its own that are merged at the end. Returns 0 on success, or 1 if input
+// cannot be mapped or there is not enough memory, in which case input is still at the first sample
+int analyze_mapped(FILE *input, const WAV *wav, ANALYSIS *analysis, POOL *pool);
+
+#endif
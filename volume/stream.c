@@ -0,0 +1,156 @@
+#include <pthread.h>  // For the reading and writing threads
+#include <stdint.h>   // For fixed-width integer types
+#include <stdlib.h>   // For malloc() and free()
+
+#include "gain.h"
+#include "stream.h"
+
+// Number of samples read, scaled and written at a time
+#define BLOCK_SAMPLES (64 * 1024)
+
+// Buffers in the ring: one being read, one being scaled and one being written
+#define BUFFERS 3
+
+// What has happened to the block in a buffer so far
+typedef enum
+{
+    EMPTY,   // Free for the reader
+    READ,    // Holds bytes as they were read
+    SCALED   // Ready for the writer
+} STATE;
+
+// Everything the reading, scaling and writing threads share
+typedef struct
+{
+    FILE *input;
+    FILE *output;
+    uint8_t *buffers[BUFFERS];  // Buffer k % BUFFERS holds block k
+    size_t lengths[BUFFERS];    // Bytes in each block; an empty block marks the end of the file
+    int samples[BUFFERS];       // Whether each block holds sample data, rather than what follows it
+    STATE states[BUFFERS];
+    size_t block;               // Bytes in a full block, a whole number of samples
+    uint64_t length;            // Bytes of sample data
+    pthread_mutex_t lock;       // Protects states
+    pthread_cond_t changed;     // Signalled whenever a state changes
+} STREAM;
+
+// Wait until block k's buffer is in the given state, then return its index
+static int wait_for(STREAM *stream, long k, STATE state)
+{
+    pthread_mutex_lock(&stream->lock);
+    while (stream->states[k % BUFFERS] != state)
+    {
+        pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return k % BUFFERS;
+}
+
+// Hand block k's buffer on to the next thread
+static void set_state(STREAM *stream, long k, STATE state)
+{
+    pthread_mutex_lock(&stream->lock);
+    stream->states[k % BUFFERS] = state;
+    pthread_cond_broadcast(&stream->changed);
+    pthread_mutex_unlock(&stream->lock);
+}
+
+// Read the sample data and then whatever follows it, a block at a time into the next free buffer, ending with an
+// empty block
+static void *reader(void *arg)
+{
+    STREAM *stream = arg;
+    uint64_t remaining = stream->length;
+    for (long k = 0; ; k++)
+    {
+        int b = wait_for(stream, k, EMPTY);
+        size_t wanted = remaining > 0 && remaining < stream->block ? remaining : stream->block;
+        stream->samples[b] = remaining > 0;
+        stream->lengths[b] = fread(stream->buffers[b], 1, wanted, stream->input);
+
+        // Sample data that ends early is simply followed by nothing
+        if (stream->samples[b])
+        {
+            remaining = stream->lengths[b] == wanted ? remaining - wanted : 0;
+        }
+        int last = stream->lengths[b] == 0 && !stream->samples[b];
+        set_state(stream, k, READ);
+        if (last)
+        {
+            return NULL;
+        }
+    }
+}
+
+// Write the blocks in order as soon as they are scaled, until the empty one. Once a write has failed (e.g., the disk
+// is full) the rest are only passed over, so that the ring keeps moving
+static void *writer(void *arg)
+{
+    STREAM *stream = arg;
+    for (long k = 0; ; k++)
+    {
+        int b = wait_for(stream, k, SCALED);
+        if (stream->lengths[b] == 0 && !stream->samples[b])
+        {
+            return NULL;
+        }
+        if (!ferror(stream->output))
+        {
+            fwrite(stream->buffers[b], 1, stream->lengths[b], stream->output);
+        }
+        set_state(stream, k, EMPTY);
+    }
+}
+
+int scale_stream(FILE *input, FILE *output, const WAV *wav, double factor)
+{
+    // Choose the gain kernel for the samples' format once, so that the loop below has no decisions to make
+    GAIN gain = gain_kernel(wav->format);
+    int bytes = format_bytes(wav->format);
+    STREAM stream = {.input = input, .output = output, .block = (size_t) BLOCK_SAMPLES * bytes,
+                     .length = wav->length};
+    uint8_t *buffers = malloc(BUFFERS * stream.block);
+    if (buffers == NULL)
+    {
+        return 1;
+    }
+    for (int b = 0; b < BUFFERS; b++)
+    {
+        stream.buffers[b] = buffers + b * stream.block;
+        stream.states[b] = EMPTY;
+    }
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.changed, NULL);
+
+    // Copy everything before the sample data to the output file as it is
+    fwrite(wav->header, 1, wav->header_size, output);
+
+    pthread_t reading, writing;
+    pthread_create(&reading, NULL, reader, &stream);
+    pthread_create(&writing, NULL, writer, &stream);
+
+    // Scale each block of samples as soon as it has been read, saturating rather than wrapping around where they
+    // would clip (a partial sample at the end, if the data chunk has one, is copied as it is, and so is
+    // everything after the sample data, e.g. a padding byte or LIST chunk)
+    for (long k = 0; ; k++)
+    {
+        int b = wait_for(&stream, k, READ);
+        if (stream.samples[b])
+        {
+            gain(stream.buffers[b], stream.lengths[b] / bytes, factor);
+        }
+        int last = stream.lengths[b] == 0 && !stream.samples[b];
+        set_state(&stream, k, SCALED);
+        if (last)
+        {
+            break;
+        }
+    }
+
+    pthread_join(reading, NULL);
+    pthread_join(writing, NULL);
+    pthread_cond_destroy(&stream.changed);
+    pthread_mutex_destroy(&stream.lock);
+    free(buffers);
+    return ferror(output) ? 2 : 0;
+}
@@ -0,0 +1,18 @@
+// Scaling the samples of a WAV file a block at a time as they arrive, for inputs and outputs that cannot be mapped
+// (e.g., pipes)
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>  // For FILE
+
+#include "wav.h"
+
+// Write the header, then read the sample data from input (which must be at the first sample) a block at a time,
+// scale it by factor and write it to output, and copy whatever follows it as it is. Reading and writing run on
+// threads of their own, passing blocks around a ring of buffers, so that a block can be read while the one
+// before it is scaled and the one before that is written. Returns 0 on success, 1 if there is not enough memory, or 2
+// if the output could not be written
+int scale_stream(FILE *input, FILE *output, const WAV *wav, double factor);
+
+#endif
@@ -1,61 +1,270 @@
 // Modifies the volume of an audio file
 
+#define _POSIX_C_SOURCE 200809L  // For fseeko(), fdopen() and dup()
+
+#include <getopt.h>  // For command-line option parsing
+#include <math.h>    // For isfinite() and pow()
 #include <stdint.h>  // For fixed-width integer types
 #include <stdio.h>   // For file operations and standard I/O functions
 #include <stdlib.h>  // For memory allocation and utility functions
+#include <string.h>  // For strcmp()
+#include <unistd.h>  // For dup() and dup2()
+
+#include "analyze.h" // For measuring the levels of the samples
+#include "gain.h"    // For scaling blocks of samples
+#include "mapped.h"  // For scaling large files on many threads
+#include "pool.h"    // For the threads
+#include "stream.h"  // For scaling files a block at a time as they are read
+#include "wav.h"     // For finding the samples in a WAV file
+
+// Values getopt_long returns for options that only have a long form
+enum
+{
+    NORMALIZE_PEAK = 256,
+    NORMALIZE_RMS,
+    STATS_REPORT
+};
+
+// What to do with the samples: scale them by a factor, scale them so that their peak or RMS level comes out at a
+// target, or only report their levels
+typedef enum
+{
+    FIXED,
+    PEAK,
+    RMS,
+    STATS
+} MODE;
+
+// Parse a number that must be finite (as a float, too, since that is what 8- and 16-bit samples are scaled in);
+// returns 0 on success
+static int parse_number(const char *text, double *number)
+{
+    char *end;
+    *number = strtod(text, &end);
+    return end == text || *end != '\0' || !isfinite((float) *number);
+}
 
-// Number of bytes in .wav header
-const int HEADER_SIZE = 44;
+// Print how to run the program
+static void usage(void)
+{
+    printf("Usage: ./volume [-j threads] input.wav output.wav factor\n"
+           "       ./volume [-j threads] --normalize-peak dBFS|--normalize-rms dBFS input.wav output.wav\n"
+           "       ./volume [-j threads] --stats input.wav\n");
+}
+
+// Open the file named on the command line for reading, where - means stdin
+static FILE *open_input(const char *name)
+{
+    return strcmp(name, "-") == 0 ? stdin : fopen(name, "rb");
+}
+
+// Open the file named on the command line for writing, where - means stdout; anything printed from then on goes to
+// stderr instead, so that it cannot end up in the middle of the samples
+static FILE *open_output(const char *name)
+{
+    if (strcmp(name, "-") != 0)
+    {
+        return fopen(name, "wb");
+    }
+    fflush(stdout);
+    int fd = dup(STDOUT_FILENO);
+    if (fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+    {
+        return NULL;
+    }
+    return fdopen(fd, "wb");
+}
+
+// Measure the levels of the samples, on many threads through a memory map if there is a pool (or a block at a
+// time otherwise, or if the file cannot be mapped); returns 0 on success, or 1 if there is not enough memory
+static int analyze(FILE *input, const WAV *wav, ANALYSIS *analysis, POOL *pool)
+{
+    if (analysis_init(analysis, wav->format, wav->channels) != 0)
+    {
+        return 1;
+    }
+    if ((pool == NULL || analyze_mapped(input, wav, analysis, pool) != 0) && analyze_stream(input, wav, analysis) != 0)
+    {
+        analysis_free(analysis);
+        return 1;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    // Parse options: -j threads scales the file on that many threads through memory maps (0 means one per CPU);
+    // --normalize-peak and --normalize-rms take a target level in dBFS instead of a factor, and --stats only
+    // reports the levels. Options stop at the first other argument, so that a negative factor is not taken for one
+    static const struct option long_options[] =
+    {
+        {"normalize-peak", required_argument, NULL, NORMALIZE_PEAK},
+        {"normalize-rms", required_argument, NULL, NORMALIZE_RMS},
+        {"stats", no_argument, NULL, STATS_REPORT},
+        {NULL, 0, NULL, 0}
+    };
+    int threads = -1;
+    MODE mode = FIXED;
+    double target = 0;
+    int option;
+    while ((option = getopt_long(argc, argv, "+j:", long_options, NULL)) != -1)
+    {
+        if (option == 'j')
+        {
+            char *end;
+            threads = strtol(optarg, &end, 10);
+            if (*end != '\0' || threads < 0)
+            {
+                printf("Invalid option.\n");
+                return 1;  // Exit with error code 1 for an invalid option
+            }
+        }
+        else if ((option == NORMALIZE_PEAK || option == NORMALIZE_RMS) && mode == FIXED)
+        {
+            mode = option == NORMALIZE_PEAK ? PEAK : RMS;
+            if (parse_number(optarg, &target) != 0)
+            {
+                printf("Invalid level.\n");
+                return 1;  // Exit with error code 1 for an invalid target level
+            }
+        }
+        else if (option == STATS_REPORT && mode == FIXED)
+        {
+            mode = STATS;
+        }
+        else
+        {
+            printf("Invalid option.\n");
+            return 1;  // Exit with error code 1 for an invalid (or a second) mode
+        }
+    }
+
     // Check command-line arguments
-    // argc should be 4: program name, input file, output file, and volume factor
-    if (argc != 4)
+    // There should be 3 more (input file, output file, and volume factor), or 2 when normalizing, or just the input
+    // file for --stats. Either file may be -, for stdin or stdout
+    if (argc != optind + (mode == FIXED ? 3 : mode == STATS ? 1 : 2))
     {
-        printf("Usage: ./volume input.wav output.wav factor\n");
+        usage();
         return 1;  // Exit with error code 1 for incorrect usage
     }
+    char *infile = argv[optind];
+    char *outfile = mode == STATS ? NULL : argv[optind + 1];
+
+    // Get the volume scaling factor from command-line arguments
+    double factor = 1;
+    if (mode == FIXED && parse_number(argv[optind + 2], &factor) != 0)
+    {
+        printf("Invalid factor.\n");
+        return 1;  // Exit with error code 1 for an invalid factor
+    }
+
+    // Samples written to stdout must not be mixed up with messages, so claim it before anything else is printed
+    // (a named output file is only created once the input has been opened)
+    FILE *output = NULL;
+    if (outfile != NULL && strcmp(outfile, "-") == 0 && (output = open_output(outfile)) == NULL)
+    {
+        printf("Could not open output file.\n");
+        return 1;  // Exit with error code 1 for failure to open output file
+    }
 
     // Open the input file for reading in binary mode
-    FILE *input = fopen(argv[1], "rb");
+    FILE *input = open_input(infile);
     if (input == NULL)
     {
         printf("Could not open input file.\n");
+        if (output != NULL)
+        {
+            fclose(output);
+        }
         return 1;  // Exit with error code 1 for failure to open input file
     }
 
     // Open the output file for writing in binary mode
-    FILE *output = fopen(argv[2], "wb");
-    if (output == NULL)
+    if (outfile != NULL && output == NULL && (output = open_output(outfile)) == NULL)
     {
         printf("Could not open output file.\n");
         fclose(input);  // Close input file if output file cannot be opened
         return 1;  // Exit with error code 1 for failure to open output file
     }
 
-    // Get the volume scaling factor from command-line arguments
-    float factor = atof(argv[3]);
+    // Find the sample data, wherever its chunk is. Normalizing reads the samples twice, once to measure them and
+    // once to scale them, so then the input must be a file that can be read again (not a pipe)
+    WAV wav;
+    WAVSTATUS status = WAV_OK;
+    if ((mode == PEAK || mode == RMS) && fseeko(input, 0, SEEK_CUR) != 0)
+    {
+        printf("Cannot normalize an input that cannot be read twice.\n");
+        status = WAV_UNSUPPORTED;
+    }
+    else if ((status = wav_read_header(input, &wav)) != WAV_OK)
+    {
+        printf(status == WAV_UNSUPPORTED ? "Unsupported file format.\n" : "Not enough memory.\n");
+    }
+    if (status != WAV_OK)
+    {
+        fclose(input);
+        if (output != NULL)
+        {
+            fclose(output);
+        }
+        return 1;  // Exit with error code 1 for an unsupported input file
+    }
+
+    // Remember where the samples start, to come back to them after measuring them
+    off_t samples = ftello(input);
 
-    // Copy header from input file to output file
-    uint8_t buffer_data[HEADER_SIZE];  // Buffer to hold the header data
-    fread(buffer_data, HEADER_SIZE, 1, input);  // Read header from input file
-    fwrite(buffer_data, HEADER_SIZE, 1, output);  // Write header to output file
+    // Use many threads through memory maps if asked to, and a block at a time otherwise (or if the files cannot be
+    // mapped, e.g. pipes)
+    POOL *pool = threads >= 0 ? pool_create(threads) : NULL;
 
-    // Read samples from input file, adjust volume, and write modified samples to output file
-    int16_t buffer_data_sample;  // Buffer to hold audio sample data
-    while (fread(&buffer_data_sample, sizeof(int16_t), 1, input) == 1)
+    // Measure the samples first, unless they are simply scaled by a factor, and work out the factor that brings
+    // their level to the target (leaving silence as it is)
+    int failed = 0;
+    if (mode != FIXED)
     {
-        // Modify sample based on volume factor
-        buffer_data_sample *= factor;
+        ANALYSIS analysis;
+        failed = analyze(input, &wav, &analysis, pool);
+        if (!failed)
+        {
+            double level = mode == RMS ? analysis_rms(&analysis, -1) : analysis_peak(&analysis, -1);
+            factor = level > 0 ? pow(10, target / 20) / level : 1;
+            if (mode == STATS)
+            {
+                analysis_print(&analysis);
+            }
+            analysis_free(&analysis);
+        }
+        if (failed)
+        {
+            printf("Not enough memory.\n");
+        }
+        else if (mode != STATS && (fseeko(input, samples, SEEK_SET) != 0 || !isfinite((float) factor)))
+        {
+            printf("Could not normalize input file.\n");
+            failed = 1;
+        }
+    }
 
-        // Write the modified sample to the output file
-        fwrite(&buffer_data_sample, sizeof(int16_t), 1, output);
+    // Scale the samples
+    if (!failed && mode != STATS && (pool == NULL || scale_mapped(input, output, &wav, factor, pool) != 0))
+    {
+        int streamed = scale_stream(input, output, &wav, factor);
+        if (streamed != 0)
+        {
+            printf(streamed == 2 ? "Could not write output file.\n" : "Not enough memory.\n");
+            failed = 1;
+        }
     }
+    pool_destroy(pool);
+    wav_free(&wav);
 
-    // Close the files
+    // Close the files, making sure that the last of the output made it (a full disk, say, may only show up here)
     fclose(input);
-    fclose(output);
+    if (output != NULL && fclose(output) != 0 && !failed)
+    {
+        printf("Could not write output file.\n");
+        failed = 1;
+    }
 
-    return 0;  // Exit successfully
+    return failed;  // Exit with error code 1 for running out of memory, a factor too large to apply or a failed write
 }
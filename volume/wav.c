@@ -0,0 +1,169 @@
+#include <stdlib.h>  // For realloc() and free()
+#include <string.h>  // For memcmp()
+
+#include "wav.h"
+
+// Format tags a `fmt ` chunk can give
+#define TAG_PCM 0x0001
+#define TAG_FLOAT 0x0003
+#define TAG_EXTENSIBLE 0xfffe
+
+// The subformat GUID of a format extensible file starts with the format tag, and always ends with these bytes
+static const uint8_t SUBFORMAT_TAIL[14] = {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00,
+                                           0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71};
+
+// Largest chunk before the sample data that is held in memory; anything bigger is surely not a WAV file
+#define MAX_CHUNK (64 * 1024 * 1024)
+
+// Read little-endian numbers
+static uint16_t le16(const uint8_t *p)
+{
+    return p[0] | p[1] << 8;
+}
+static uint32_t le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+static uint64_t le64(const uint8_t *p)
+{
+    return le32(p) | (uint64_t) le32(p + 4) << 32;
+}
+
+// Read the next size bytes of the file onto the end of the header
+static WAVSTATUS append(FILE *input, WAV *wav, size_t size)
+{
+    uint8_t *grown = realloc(wav->header, wav->header_size + size);
+    if (grown == NULL)
+    {
+        return WAV_NO_MEMORY;
+    }
+    wav->header = grown;
+    if (fread(wav->header + wav->header_size, 1, size, input) != size)
+    {
+        return WAV_UNSUPPORTED;
+    }
+    wav->header_size += size;
+    return WAV_OK;
+}
+
+// Understand a `fmt ` chunk of size bytes, returning 0 if its samples are not in a supported format
+static int parse_format(const uint8_t *fmt, uint32_t size, WAV *wav)
+{
+    if (size < 16)
+    {
+        return 0;
+    }
+    int tag = le16(fmt);
+    wav->channels = le16(fmt + 2);
+    wav->rate = le32(fmt + 4);
+    wav->frame = le16(fmt + 12);
+    int bits = le16(fmt + 14);
+
+    // A format extensible chunk goes on with the size of the extension (at least 22), the bits of each sample
+    // that are used, which speakers the channels are for, and a GUID giving the real format tag
+    if (tag == TAG_EXTENSIBLE)
+    {
+        if (size < 40 || le16(fmt + 16) < 22 || memcmp(fmt + 26, SUBFORMAT_TAIL, sizeof(SUBFORMAT_TAIL)) != 0)
+        {
+            return 0;
+        }
+        tag = le16(fmt + 24);
+    }
+
+    if (tag == TAG_PCM && (bits == 8 || bits == 16 || bits == 24 || bits == 32))
+    {
+        wav->format = bits == 8 ? FORMAT_U8 : bits == 16 ? FORMAT_S16 : bits == 24 ? FORMAT_S24 : FORMAT_S32;
+    }
+    else if (tag == TAG_FLOAT && bits == 32)
+    {
+        wav->format = FORMAT_F32;
+    }
+    else
+    {
+        return 0;
+    }
+    return wav->channels > 0 && wav->frame == wav->channels * format_bytes(wav->format);
+}
+
+// Walk the chunks, keeping every byte read in the header
+static WAVSTATUS read_chunks(FILE *input, WAV *wav)
+{
+    // The RIFF header: "RIFF", the size of the rest of the file, and "WAVE" (or "RF64", or "BW64", with a size
+    // that the ds64 chunk gives instead)
+    WAVSTATUS status = append(input, wav, 12);
+    if (status != WAV_OK)
+    {
+        return status;
+    }
+    if ((memcmp(wav->header, "RIFF", 4) != 0 && memcmp(wav->header, "RF64", 4) != 0 &&
+         memcmp(wav->header, "BW64", 4) != 0) || memcmp(wav->header + 8, "WAVE", 4) != 0)
+    {
+        return WAV_UNSUPPORTED;
+    }
+
+    // Then chunks, each an id and a size followed by that many bytes (and a padding byte, if the size is odd),
+    // until the data chunk, which must come after the format. A data chunk too large for its size field has
+    // UINT32_MAX there, and the real size in a ds64 chunk, or none at all when it was written as a stream
+    int formatted = 0;
+    uint64_t length = UINT64_MAX;
+    while (1)
+    {
+        status = append(input, wav, 8);
+        if (status != WAV_OK)
+        {
+            return status;
+        }
+        const uint8_t *chunk = wav->header + wav->header_size - 8;
+        uint32_t size = le32(chunk + 4);
+        if (memcmp(chunk, "data", 4) == 0)
+        {
+            wav->length = size != UINT32_MAX ? size : length;
+            return formatted ? WAV_OK : WAV_UNSUPPORTED;
+        }
+
+        int format = memcmp(chunk, "fmt ", 4) == 0;
+        int sizes = memcmp(chunk, "ds64", 4) == 0;
+        if (size > MAX_CHUNK)
+        {
+            return WAV_UNSUPPORTED;
+        }
+        status = append(input, wav, size + (size & 1));
+        if (status != WAV_OK)
+        {
+            return status;
+        }
+        if (format)
+        {
+            if (!parse_format(wav->header + wav->header_size - size - (size & 1), size, wav))
+            {
+                return WAV_UNSUPPORTED;
+            }
+            formatted = 1;
+        }
+
+        // The ds64 chunk gives the sizes of the file and of the sample data in 64 bits
+        if (sizes && size >= 16)
+        {
+            length = le64(wav->header + wav->header_size - size - (size & 1) + 8);
+        }
+    }
+}
+
+WAVSTATUS wav_read_header(FILE *input, WAV *wav)
+{
+    wav->header = NULL;
+    wav->header_size = 0;
+    WAVSTATUS status = read_chunks(input, wav);
+    if (status != WAV_OK)
+    {
+        wav_free(wav);
+    }
+    return status;
+}
+
+void wav_free(WAV *wav)
+{
+    free(wav->header);
+    wav->header = NULL;
+    wav->header_size = 0;
+}
@@ -0,0 +1,41 @@
+// Reading the layout of a WAV file: a RIFF file whose chunks include a `fmt ` chunk describing the samples
+// and a `data` chunk holding them, among others (e.g., LIST or fact) that are passed through untouched. Files
+// over 4 GB are RF64 files, whose ds64 chunk gives the size of the data instead
+
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdint.h>  // For fixed-width integer types
+#include <stdio.h>   // For FILE
+
+#include "gain.h"
+
+// Outcomes of reading a WAV file's header
+typedef enum
+{
+    WAV_OK,
+    WAV_UNSUPPORTED,  // Not a RIFF WAVE file, or not one with uncompressed samples in a supported format
+    WAV_NO_MEMORY     // Could not hold the header
+} WAVSTATUS;
+
+// What a WAV file holds, and everything in it before the sample data
+typedef struct
+{
+    FORMAT format;       // Format of the samples
+    int channels;        // Samples in each frame
+    int rate;            // Frames per second
+    int frame;           // Bytes in each frame
+    uint64_t length;     // Bytes of sample data, or UINT64_MAX if they run to the end of the file
+    uint8_t *header;     // Every byte of the file before the sample data, to be copied to the output as it is
+    size_t header_size;  // Bytes in header
+} WAV;
+
+// Read a WAV file from the start up to its sample data, reading (never seeking) through every chunk before the
+// data chunk; a format extensible `fmt ` chunk is understood if its subformat is PCM or float. Leaves input at
+// the first sample
+WAVSTATUS wav_read_header(FILE *input, WAV *wav);
+
+// Release the header held by a WAV
+void wav_free(WAV *wav);
+
+#endif